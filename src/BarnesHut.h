@@ -0,0 +1,362 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "BodyStore.h"
+
+// Barnes-Hut gravity solver. For D = 3 this is an octree, for D = 2 a quadtree.
+// Every cell keeps its mass, centre of mass and traceless quadrupole, and a cell is
+// used as a single source when size / distance < theta. Nodes live in one vector
+// that is cleared (not freed) on every Build, so after the first step rebuilding
+// the tree does not allocate.
+template <int D>
+class BarnesHutTree {
+public:
+    static const int Children = 1 << D;
+    static const int LeafCapacity = 8;
+    static const int MaxDepth = 48; // Deeper leaves just grow, so coincident bodies can't recurse forever
+
+    struct Node {
+        double center[D]; // Geometric centre of the cell
+        double halfSize;
+        double mass;
+        double com[D];
+        double quad[D][D];
+        double openDist2; // Squared distance from com inside which the cell must be opened
+        int child[Children];
+        int firstBody; // Leaf body list, linked through nextBody
+        int bodyCount;
+        bool leaf;
+    };
+
+    double theta = 0.5;   // Opening angle, 0 opens every cell (exact but slow)
+    double eps2 = 0.0;    // Plummer softening squared
+    bool useQuadrupole = true;
+
+    // Theta is baked into the opening distances here, so set it before building.
+    void Build(const BodyStore& bodies) {
+        store = &bodies;
+        for (int k = 0; k < D; ++k) {
+            pos[k] = bodies.pos(k);
+        }
+        nodes.clear();
+        order.clear();
+        size_t n = bodies.size();
+        nextBody.assign(n, -1);
+        if (n == 0) {
+            return;
+        }
+
+        double lo[D];
+        double hi[D];
+        for (int k = 0; k < D; ++k) {
+            lo[k] = hi[k] = pos[k][0];
+            for (size_t i = 1; i < n; ++i) {
+                if (pos[k][i] < lo[k]) lo[k] = pos[k][i];
+                if (pos[k][i] > hi[k]) hi[k] = pos[k][i];
+            }
+        }
+
+        double center[D];
+        double halfSize = 0.0;
+        for (int k = 0; k < D; ++k) {
+            center[k] = 0.5 * (lo[k] + hi[k]);
+            if (0.5 * (hi[k] - lo[k]) > halfSize) {
+                halfSize = 0.5 * (hi[k] - lo[k]);
+            }
+        }
+        halfSize = halfSize * 1.0001 + 1e-9;
+
+        NewNode(center, halfSize);
+        for (size_t i = 0; i < n; ++i) {
+            Insert(0, (int)i, 0);
+        }
+        ComputeMoments(0);
+    }
+
+    // Writes accelerations into the store for the bodies at positions [begin, end) of
+    // the tree's leaf order. Neighbouring bodies walk almost the same cells, so going
+    // leaf by leaf keeps the tree in cache. With potential set, the potential from the
+    // same walk (monopole plus quadrupole for far cells) goes into pot. Returns the
+    // number of body-body and body-cell interactions that were evaluated.
+    size_t ComputeAccelerations(BodyStore& bodies, double G, size_t begin, size_t end, bool potential = false) const {
+        size_t interactions = 0;
+        for (size_t n = begin; n < end; ++n) {
+            int i = order[n];
+            double acc[D];
+            double phi = 0.0;
+            if (potential) {
+                interactions += AccelerationOn<true>(i, G, acc, phi);
+                bodies.pot[i] = phi;
+            } else {
+                interactions += AccelerationOn<false>(i, G, acc, phi);
+            }
+            for (int k = 0; k < D; ++k) {
+                bodies.acc(k)[i] = acc[k];
+            }
+        }
+        return interactions;
+    }
+
+    size_t ComputeAccelerations(BodyStore& bodies, double G) const {
+        return ComputeAccelerations(bodies, G, 0, bodies.size());
+    }
+
+    size_t NodeCount() const { return nodes.size(); }
+
+    // Heap bytes held by the nodes and the body lists
+    size_t MemoryBytes() const {
+        return nodes.capacity() * sizeof(Node) + (nextBody.capacity() + order.capacity()) * sizeof(int);
+    }
+
+private:
+    std::vector<Node> nodes;
+    std::vector<int> nextBody;
+    std::vector<int> order; // Body indices in depth-first leaf order
+    const BodyStore* store = nullptr;
+    const double* pos[D]; // Cached store->pos(k) for the hot loops
+
+    int NewNode(const double* center, double halfSize) {
+        Node node;
+        for (int k = 0; k < D; ++k) {
+            node.center[k] = center[k];
+        }
+        node.halfSize = halfSize;
+        node.mass = 0.0;
+        node.openDist2 = 0.0;
+        for (int c = 0; c < Children; ++c) {
+            node.child[c] = -1;
+        }
+        node.firstBody = -1;
+        node.bodyCount = 0;
+        node.leaf = true;
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    int ChildIndex(int nodeIndex, int body) const {
+        int octant = 0;
+        for (int k = 0; k < D; ++k) {
+            if (pos[k][body] >= nodes[nodeIndex].center[k]) {
+                octant |= 1 << k;
+            }
+        }
+        return octant;
+    }
+
+    void Insert(int nodeIndex, int body, int depth) {
+        while (!nodes[nodeIndex].leaf) {
+            int octant = ChildIndex(nodeIndex, body);
+            int c = nodes[nodeIndex].child[octant];
+            if (c < 0) {
+                double quarter = 0.5 * nodes[nodeIndex].halfSize;
+                double center[D];
+                for (int k = 0; k < D; ++k) {
+                    center[k] = nodes[nodeIndex].center[k] + ((octant >> k) & 1 ? quarter : -quarter);
+                }
+                c = NewNode(center, quarter); // May reallocate nodes, so no references are held here
+                nodes[nodeIndex].child[octant] = c;
+            }
+            nodeIndex = c;
+            depth++;
+        }
+
+        Node& leaf = nodes[nodeIndex];
+        if (leaf.bodyCount < LeafCapacity || depth >= MaxDepth) {
+            nextBody[body] = leaf.firstBody;
+            leaf.firstBody = body;
+            leaf.bodyCount++;
+            return;
+        }
+
+        // Full leaf: turn it into an internal cell and push its bodies down a level
+        int list = leaf.firstBody;
+        leaf.leaf = false;
+        leaf.firstBody = -1;
+        leaf.bodyCount = 0;
+        while (list >= 0) {
+            int next = nextBody[list];
+            Insert(nodeIndex, list, depth);
+            list = next;
+        }
+        Insert(nodeIndex, body, depth);
+    }
+
+    static void AddQuadrupole(double quad[D][D], double m, const double* d) {
+        double d2 = 0.0;
+        for (int k = 0; k < D; ++k) {
+            d2 += d[k] * d[k];
+        }
+        for (int a = 0; a < D; ++a) {
+            for (int b = 0; b < D; ++b) {
+                quad[a][b] += m * (3.0 * d[a] * d[b] - (a == b ? d2 : 0.0));
+            }
+        }
+    }
+
+    void ComputeMoments(int nodeIndex) {
+        Node& node = nodes[nodeIndex];
+        double mass = 0.0;
+        double weighted[D] = {};
+        for (int a = 0; a < D; ++a) {
+            for (int b = 0; b < D; ++b) {
+                node.quad[a][b] = 0.0;
+            }
+        }
+
+        if (node.leaf) {
+            for (int b = node.firstBody; b >= 0; b = nextBody[b]) {
+                order.push_back(b);
+                mass += store->mass[b];
+                for (int k = 0; k < D; ++k) {
+                    weighted[k] += store->mass[b] * pos[k][b];
+                }
+            }
+        } else {
+            for (int c = 0; c < Children; ++c) {
+                if (node.child[c] < 0) {
+                    continue;
+                }
+                ComputeMoments(node.child[c]);
+                const Node& child = nodes[node.child[c]];
+                mass += child.mass;
+                for (int k = 0; k < D; ++k) {
+                    weighted[k] += child.mass * child.com[k];
+                }
+            }
+        }
+
+        node.mass = mass;
+        for (int k = 0; k < D; ++k) {
+            node.com[k] = (mass > 0.0) ? weighted[k] / mass : node.center[k];
+        }
+
+        // Quadrupole about this cell's centre of mass (parallel axis for child cells)
+        double d[D];
+        if (node.leaf) {
+            for (int b = node.firstBody; b >= 0; b = nextBody[b]) {
+                for (int k = 0; k < D; ++k) {
+                    d[k] = pos[k][b] - node.com[k];
+                }
+                AddQuadrupole(node.quad, store->mass[b], d);
+            }
+        } else {
+            for (int c = 0; c < Children; ++c) {
+                if (node.child[c] < 0) {
+                    continue;
+                }
+                const Node& child = nodes[node.child[c]];
+                for (int a = 0; a < D; ++a) {
+                    for (int b = 0; b < D; ++b) {
+                        node.quad[a][b] += child.quad[a][b];
+                    }
+                }
+                for (int k = 0; k < D; ++k) {
+                    d[k] = child.com[k] - node.com[k];
+                }
+                AddQuadrupole(node.quad, child.mass, d);
+            }
+        }
+
+        // Open the cell if the body is closer than size / theta, padded by how far the
+        // centre of mass sits from the geometric centre
+        double offset2 = 0.0;
+        for (int k = 0; k < D; ++k) {
+            offset2 += (node.com[k] - node.center[k]) * (node.com[k] - node.center[k]);
+        }
+        if (theta > 0.0) {
+            double openDist = 2.0 * node.halfSize / theta + std::sqrt(offset2);
+            node.openDist2 = openDist * openDist;
+        } else {
+            node.openDist2 = HUGE_VAL;
+        }
+    }
+
+    template <bool Potential>
+    size_t AccelerationOn(int body, double G, double* acc, double& phi) const {
+        size_t interactions = 0;
+        double p[D];
+        phi = 0.0;
+        for (int k = 0; k < D; ++k) {
+            acc[k] = 0.0;
+            p[k] = pos[k][body];
+        }
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        int stack[MaxDepth * Children + 1];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            double d[D];
+            double r2 = 0.0;
+            for (int k = 0; k < D; ++k) {
+                d[k] = p[k] - node.com[k];
+                r2 += d[k] * d[k];
+            }
+
+            if (node.leaf) {
+                for (int b = node.firstBody; b >= 0; b = nextBody[b]) {
+                    if (b == body) {
+                        continue;
+                    }
+                    double db[D];
+                    double rb2 = eps2;
+                    for (int k = 0; k < D; ++k) {
+                        db[k] = pos[k][b] - p[k];
+                        rb2 += db[k] * db[k];
+                    }
+                    double inv = 1.0 / std::sqrt(rb2);
+                    double s = G * store->mass[b] * inv * inv * inv;
+                    for (int k = 0; k < D; ++k) {
+                        acc[k] += db[k] * s;
+                    }
+                    if (Potential) {
+                        phi -= G * store->mass[b] * inv;
+                    }
+                    interactions++;
+                }
+            } else if (r2 > node.openDist2) {
+                double inv = 1.0 / std::sqrt(r2 + eps2);
+                double inv2 = inv * inv;
+                double inv3 = inv * inv2;
+                for (int k = 0; k < D; ++k) {
+                    acc[k] -= G * node.mass * d[k] * inv3;
+                }
+                if (Potential) {
+                    phi -= G * node.mass * inv;
+                }
+                if (useQuadrupole) {
+                    double qd[D];
+                    double dqd = 0.0;
+                    for (int a = 0; a < D; ++a) {
+                        qd[a] = 0.0;
+                        for (int b = 0; b < D; ++b) {
+                            qd[a] += node.quad[a][b] * d[b];
+                        }
+                        dqd += d[a] * qd[a];
+                    }
+                    double inv5 = inv3 * inv2;
+                    double inv7 = inv5 * inv2;
+                    for (int k = 0; k < D; ++k) {
+                        acc[k] += G * (qd[k] * inv5 - 2.5 * dqd * d[k] * inv7);
+                    }
+                    if (Potential) {
+                        phi -= 0.5 * G * dqd * inv5;
+                    }
+                }
+                interactions++;
+            } else {
+                for (int c = 0; c < Children; ++c) {
+                    if (node.child[c] >= 0) {
+                        stack[top++] = node.child[c];
+                    }
+                }
+            }
+        }
+        return interactions;
+    }
+};
@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "BodyStore.h"
+#include "Forces.h"
+#include "BarnesHut.h"
+#include "SimdForces.h"
+#include "ThreadPool.h"
+#include "ParallelForces.h"
+#include "PotentialField.h"
+#include "Collisions.h"
+#include "SphereMesh.h"
+#include "Scene.h"
+#include "SpatialOrder.h"
+#include "Ensemble.h"
+#include "Simulation.h"
+#include "Trajectory.h"
+
+// Headless microbenchmarks of the physics, collision and grid kernels, written as
+// JSON so results can be compared between releases. Needs no GL.
+//
+// Every result reports the time per call, the work it did in "interactions" (the
+// unit is named in each result: body pairs, body-cell pairs, bodies, grid samples
+// or mesh vertices), ns per interaction, interactions per second and the heap
+// bytes per body the kernel needed, body store included.
+
+const double GravConst = 6.674e-5; // Same as the 3D view
+
+struct BenchOptions {
+    size_t maxN = 1000000;
+    size_t maxDirect = 10000; // All-pairs kernels are O(N^2), larger N is skipped
+    double minTime = 0.25;    // Seconds spent timing each case
+    int threads = ThreadPool::HardwareThreads();
+    std::string outPath;      // stdout if empty
+    bool check = false;       // Run CheckPotentialInvariance instead of the benchmarks
+    bool checkTrajectory = false; // Run CheckTrajectoryRoundTrip instead of the benchmarks
+};
+
+struct BenchResult {
+    std::string kernel;
+    size_t n;
+    size_t iterations;
+    double seconds;     // Mean per call
+    double bestSeconds; // Fastest call
+    double interactions; // Per call
+    const char* unit;
+    double bytesPerBody;
+};
+
+// Calls fn() until minTime has passed (at least twice, the first call is a warm-up
+// unless it alone took longer than minTime)
+template <class Fn>
+void Measure(double minTime, Fn&& fn, size_t& iterations, double& mean, double& best) {
+    typedef std::chrono::steady_clock Clock;
+    auto start = Clock::now();
+    fn();
+    double first = std::chrono::duration<double>(Clock::now() - start).count();
+    if (first >= minTime) {
+        iterations = 1;
+        mean = best = first;
+        return;
+    }
+
+    iterations = 0;
+    best = 1e300;
+    double total = 0.0;
+    while (total < minTime || iterations == 0) {
+        auto begin = Clock::now();
+        fn();
+        double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        best = std::min(best, seconds);
+        total += seconds;
+        iterations++;
+    }
+    mean = total / (double)iterations;
+}
+
+// Uniform bodies in a 1000 x 100 x 1000 slab, inside the curved grid, with radii
+// small enough that few overlap. They are stored in generation order, i.e. shuffled
+// in space; the *_hilbert kernels rerun on a copy sorted along the Hilbert curve.
+void MakeBodies(BodyStore& bodies, size_t n, unsigned int seed) {
+    bodies.clear();
+    bodies.reserve(n);
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> across(0.0, 1000.0);
+    std::uniform_real_distribution<double> height(-50.0, 50.0);
+    for (size_t i = 0; i < n; ++i) {
+        double x = across(rng);
+        double y = height(rng);
+        double z = across(rng);
+        bodies.add("Body" + std::to_string(i), 1e3, 0.25, x, y, z, 0.0, 0.0, 0.0);
+    }
+}
+
+double StoreBytesPerBody(const BodyStore& bodies) {
+    return (double)(BodyStore::FieldCount * sizeof(double) * bodies.capacity()) / (double)bodies.size();
+}
+
+void PrintJson(std::ostream& out, const BenchOptions& options, const std::vector<BenchResult>& results) {
+    out.precision(6);
+    out << "{\n";
+    out << "  \"benchmark\": \"GravitySim kernels\",\n";
+    out << "  \"version\": 1,\n";
+    out << "  \"threads\": " << options.threads << ",\n";
+    out << "  \"simd\": \"" << SimdLevelName(DetectSimdLevel()) << "\",\n";
+    out << "  \"min_time_s\": " << options.minTime << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t r = 0; r < results.size(); ++r) {
+        const BenchResult& result = results[r];
+        double perInteraction = result.interactions > 0.0 ? result.seconds / result.interactions : 0.0;
+        out << "    {\"kernel\": \"" << result.kernel << "\", \"n\": " << result.n
+            << ", \"iterations\": " << result.iterations
+            << ", \"seconds_per_call\": " << result.seconds
+            << ", \"best_seconds\": " << result.bestSeconds
+            << ", \"interaction\": \"" << result.unit << "\""
+            << ", \"interactions_per_call\": " << result.interactions
+            << ", \"ns_per_interaction\": " << perInteraction * 1e9
+            << ", \"interactions_per_second\": " << (perInteraction > 0.0 ? 1.0 / perInteraction : 0.0)
+            << ", \"bytes_per_body\": " << result.bytesPerBody << "}"
+            << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+// Runs every solver on a Plummer sphere whose size is not a multiple of ForceTileSize,
+// once plain and once with the potential filled on every force pass, and fails unless
+// both runs end in exactly the same state, accelerations included: a last-bit change
+// in them can vanish from 20 steps of positions. The simd solvers also run with the
+// slot memory cap lowered until it binds. Diagnostics turn the potential on, and must
+// never change the trajectory they measure.
+int CheckPotentialInvariance(const BenchOptions& options) {
+    struct Case {
+        std::string name;
+        ForceSolver solver;
+        SimdLevel simd;
+        ForcePrecision precision;
+        size_t maxSlotBytes;
+    };
+    const size_t n = 2 * ForceTileSize + 37; // Partial tiles, and rows that start unaligned
+    // Room for nine arrays: two slots of four, where it would be three slots of three,
+    // so the cap binds as it does above 65536 bodies at the default MaxSlotBytes
+    const size_t capped = 9 * sizeof(double) * ((n + 7) / 8 * 8);
+    const size_t uncapped = ParallelForces::MaxSlotBytes;
+
+    std::vector<Case> cases = {{"direct", ForceSolver::Pairwise, SimdLevel::Scalar, ForcePrecision::Double, uncapped},
+                               {"bh", ForceSolver::BarnesHut, SimdLevel::Scalar, ForcePrecision::Double, uncapped}};
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level <= DetectSimdLevel()) {
+            std::string name = SimdLevelName(level);
+            cases.push_back({"simd_" + name, ForceSolver::Simd, level, ForcePrecision::Double, uncapped});
+            cases.push_back({"simd_mixed_" + name, ForceSolver::Simd, level, ForcePrecision::Mixed, uncapped});
+            cases.push_back({"simd_capped_" + name, ForceSolver::Simd, level, ForcePrecision::Double, capped});
+            cases.push_back({"simd_mixed_capped_" + name, ForceSolver::Simd, level, ForcePrecision::Mixed, capped});
+        }
+    }
+
+    const uint64_t steps = 20;
+    int failures = 0;
+    for (const Case& c : cases) {
+        BodyStore results[2];
+        for (int potential = 0; potential < 2; ++potential) {
+            Simulation sim(GravConst, options.threads);
+            sim.engine.collisions.verbose = false;
+            sim.engine.solver = c.solver;
+            sim.engine.simd = c.simd;
+            sim.engine.precision = c.precision;
+            sim.engine.forces.maxSlotBytes = c.maxSlotBytes;
+            sim.engine.eps2 = 0.05 * 0.05;
+            sim.engine.computePotential = potential != 0;
+            SceneParams params;
+            params.G = GravConst;
+            GenerateScene(sim.bodies, SceneKind::Plummer, n, params, 12345, sim.engine.pool);
+            sim.Step(steps);
+            results[potential] = sim.bodies;
+        }
+
+        const BodyStore& a = results[0];
+        const BodyStore& b = results[1];
+        bool same = a.size() == b.size();
+        for (int k = 0; k < 3 && same; ++k) {
+            same = std::memcmp(a.pos(k), b.pos(k), a.size() * sizeof(double)) == 0 &&
+                   std::memcmp(a.vel(k), b.vel(k), a.size() * sizeof(double)) == 0 &&
+                   std::memcmp(a.acc(k), b.acc(k), a.size() * sizeof(double)) == 0;
+        }
+        std::cout << c.name << " n=" << n << ": " << (same ? "same state with and without the potential" : "STATES DIFFER")
+                  << std::endl;
+        if (!same) {
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// Writes a few frames of a changing store with TrajectoryWriter, in both precisions,
+// and fails unless TrajectoryReader gives back every value (rounded to float for
+// float32 files) and FrameAt finds the right frame, including for times before the
+// first frame and for an empty file.
+int CheckTrajectoryRoundTrip() {
+    const char* path = "trajectory_check.traj";
+    const size_t frames = 5;
+    int failures = 0;
+    for (bool float32 : {false, true}) {
+        BodyStore bodies;
+        MakeBodies(bodies, 300, 777);
+        std::vector<BodyStore> written;
+        TrajectoryWriter<3> writer;
+        bool ok = writer.Open(path, float32);
+        for (size_t f = 0; f < frames && ok; ++f) {
+            for (size_t i = 0; i < bodies.size(); ++i) {
+                bodies.x[i] += 0.1 * (double)f;
+                bodies.vz[i] = 1.0 / (double)(i + f + 1);
+            }
+            if (f == 3) {
+                bodies.remove(7); // Merges change the count between frames
+            }
+            ok = writer.Append(bodies, 0.5 * (double)(f + 1), 10 * f);
+            written.push_back(bodies);
+        }
+        writer.Close();
+
+        TrajectoryReader reader;
+        ok = ok && reader.Open(path) && reader.Complete() && reader.FrameCount() == frames &&
+             reader.Float32() == float32 && reader.Dimensions() == 3;
+        for (size_t f = 0; f < frames && ok; ++f) {
+            TrajectoryFrame frame = reader.Frame(f);
+            const BodyStore& expected = written[f];
+            ok = frame.time == 0.5 * (double)(f + 1) && frame.step == 10 * f && frame.count == expected.size();
+            for (size_t i = 0; i < frame.count && ok; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    double p = float32 ? (double)(float)expected.pos(k)[i] : expected.pos(k)[i];
+                    double v = float32 ? (double)(float)expected.vel(k)[i] : expected.vel(k)[i];
+                    ok = ok && frame.PositionAt(k, i) == p && frame.VelocityAt(k, i) == v;
+                }
+                double m = float32 ? (double)(float)expected.mass[i] : expected.mass[i];
+                ok = ok && frame.MassAt(i) == m;
+            }
+        }
+        ok = ok && reader.FrameAt(0.0) == frames && reader.FrameAt(0.5) == 0 && reader.FrameAt(1.7) == 2 &&
+             reader.FrameAt(100.0) == frames - 1;
+        reader.Close();
+        ok = ok && reader.FrameAt(1.0) == reader.FrameCount();
+
+        std::cout << "trajectory " << (float32 ? "float32" : "double") << ": "
+                  << (ok ? "read back as written" : "READ BACK DIFFERS") << std::endl;
+        if (!ok) {
+            failures++;
+        }
+    }
+    std::remove(path);
+    return failures == 0 ? 0 : 1;
+}
+
+// Usage: GravityBench [--max-n n] [--max-direct n] [--min-time seconds] [--threads n] [--out file.json] [--check] [--check-trajectory]
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--max-n") == 0 && a + 1 < argc) {
+            options.maxN = std::strtoull(argv[++a], nullptr, 10);
+        } else if (std::strcmp(argv[a], "--max-direct") == 0 && a + 1 < argc) {
+            options.maxDirect = std::strtoull(argv[++a], nullptr, 10);
+        } else if (std::strcmp(argv[a], "--min-time") == 0 && a + 1 < argc) {
+            options.minTime = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            options.threads = std::max(1, std::atoi(argv[++a]));
+        } else if (std::strcmp(argv[a], "--out") == 0 && a + 1 < argc) {
+            options.outPath = argv[++a];
+        } else if (std::strcmp(argv[a], "--check") == 0) {
+            options.check = true;
+        } else if (std::strcmp(argv[a], "--check-trajectory") == 0) {
+            options.checkTrajectory = true;
+        } else {
+            std::cerr << "Ignoring unknown argument " << argv[a] << std::endl;
+        }
+    }
+    if (options.check) {
+        return CheckPotentialInvariance(options);
+    }
+    if (options.checkTrajectory) {
+        return CheckTrajectoryRoundTrip();
+    }
+
+    ThreadPool pool(options.threads);
+    ParallelForces forces;
+    std::vector<BenchResult> results;
+    auto record = [&](const std::string& kernel, size_t n, double interactions, const char* unit, double bytesPerBody,
+                      size_t iterations, double mean, double best) {
+        results.push_back({kernel, n, iterations, mean, best, interactions, unit, bytesPerBody});
+        std::cerr << kernel << " n=" << n << ": " << mean * 1e3 << " ms/call" << std::endl;
+    };
+
+    std::vector<size_t> sizes;
+    for (size_t n : {(size_t)3, (size_t)10, (size_t)100, (size_t)1000, (size_t)10000, (size_t)100000, (size_t)1000000}) {
+        if (n <= options.maxN) {
+            sizes.push_back(n);
+        }
+    }
+
+    size_t iterations = 0;
+    double mean = 0.0;
+    double best = 0.0;
+    for (size_t n : sizes) {
+        BodyStore bodies;
+        MakeBodies(bodies, n, 12345);
+
+        // Merge the few overlapping pairs up front so every timed call sees the same bodies
+        CollisionSystem<3> collisions;
+        collisions.verbose = false;
+        while (collisions.Resolve(bodies) > 0) {
+        }
+        size_t count = bodies.size();
+        double pairs = 0.5 * (double)count * (double)(count - 1);
+        double storeBytes = StoreBytesPerBody(bodies);
+
+        if (count <= options.maxDirect) {
+            Measure(options.minTime, [&] { DirectAccelerations<3>(bodies, GravConst); }, iterations, mean, best);
+            record("direct_scalar", count, pairs, "body pair", storeBytes, iterations, mean, best);
+
+            Measure(options.minTime, [&] { forces.Direct(pool, bodies, GravConst, 0.0, DetectSimdLevel()); },
+                    iterations, mean, best);
+            record("direct_simd_parallel", count, pairs, "body pair", storeBytes, iterations, mean, best);
+
+            Measure(options.minTime, [&] {
+                forces.Direct(pool, bodies, GravConst, 0.0, DetectSimdLevel(), ForcePrecision::Mixed);
+            }, iterations, mean, best);
+            record("direct_simd_mixed", count, pairs, "body pair", storeBytes + (double)forces.MemoryBytes() / (double)count,
+                   iterations, mean, best);
+        }
+
+        BarnesHutTree<3> tree;
+        size_t treeInteractions = 0;
+        Measure(options.minTime, [&] {
+            tree.Build(bodies);
+            treeInteractions = forces.Tree(pool, tree, bodies, GravConst);
+        }, iterations, mean, best);
+        record("barnes_hut", count, (double)treeInteractions, "body-cell pair",
+               storeBytes + (double)tree.MemoryBytes() / (double)count, iterations, mean, best);
+
+        BodyStore scene;
+        SceneParams sceneParams;
+        sceneParams.G = GravConst;
+        Measure(options.minTime, [&] { GenerateScene(scene, SceneKind::Plummer, n, sceneParams, 12345, pool); },
+                iterations, mean, best);
+        record("scene_plummer", n, (double)n, "body", StoreBytesPerBody(scene), iterations, mean, best);
+
+        Measure(options.minTime, [&] { collisions.Resolve(bodies); }, iterations, mean, best);
+        record("collision_broad_phase", count, (double)count, "body",
+               storeBytes + (double)collisions.MemoryBytes() / (double)count, iterations, mean, best);
+
+        // Sorting an already sorted store does the same work, so the copy is sorted in place
+        BodyStore sorted = bodies;
+        for (CurveKind curve : {CurveKind::Morton, CurveKind::Hilbert}) {
+            SpatialOrder<3> order;
+            order.curve = curve;
+            Measure(options.minTime, [&] { order.Sort(pool, sorted); }, iterations, mean, best);
+            record(std::string("reorder_") + CurveKindName(curve), count, (double)count, "body", storeBytes,
+                   iterations, mean, best);
+        }
+
+        Measure(options.minTime, [&] {
+            tree.Build(sorted);
+            treeInteractions = forces.Tree(pool, tree, sorted, GravConst);
+        }, iterations, mean, best);
+        record("barnes_hut_hilbert", count, (double)treeInteractions, "body-cell pair",
+               storeBytes + (double)tree.MemoryBytes() / (double)count, iterations, mean, best);
+
+        Measure(options.minTime, [&] { collisions.Resolve(sorted); }, iterations, mean, best);
+        record("collision_broad_phase_hilbert", count, (double)count, "body",
+               storeBytes + (double)collisions.MemoryBytes() / (double)count, iterations, mean, best);
+
+        // Lines every 4 units sampled every unit, as drawn by the 3D view
+        PotentialField field(1000, 4, 1);
+        Measure(options.minTime, [&] {
+            field.Invalidate();
+            field.Update(bodies, GravConst, &pool);
+        }, iterations, mean, best);
+        record(count >= field.pmThreshold ? "grid_potential_pm" : "grid_potential_direct", count,
+               (double)field.Vertices().size(), "grid sample",
+               storeBytes + (double)field.MemoryBytes() / (double)count, iterations, mean, best);
+    }
+
+    // n is the member count; each call sets the members up and takes 100 steps of the
+    // three planets, since a run moves members between lanes and can't be repeated
+    for (size_t members : {(size_t)64, (size_t)4096, (size_t)65536}) {
+        BodyStore planets;
+        planets.add("Planet1", 1e6, 1.0, 550.0, 0.0, 530.0, -5.0, 0.0, 0.0);
+        planets.add("Planet2", 5e6, 2.0, 525.0, 0.0, 500.0, -2.0, 0.0, 0.0);
+        planets.add("Planet3", 9e6, 3.0, 450.0, 0.0, 450.0, 0.0, 0.0, 0.0);
+        EnsembleParams params;
+        params.members = members;
+        params.G = GravConst;
+        Ensemble ensemble;
+        Measure(options.minTime, [&] {
+            ensemble.Setup(planets, params);
+            ensemble.Run(pool, 0.001, 100, DetectSimdLevel());
+        }, iterations, mean, best);
+        record("ensemble_3body", members, (double)ensemble.MemberSteps(), "system step",
+               (double)(Ensemble::Fields * 3 * sizeof(double) + sizeof(EnsembleRecord)), iterations, mean, best);
+    }
+
+    // n is the stack (and slice) count here; bytes_per_body is the whole mesh, which
+    // every body shares when drawn instanced
+    for (int stacks : {10, 50, 200, 1000}) {
+        size_t vertices = 0;
+        size_t meshBytes = 0;
+        Measure(options.minTime, [&] {
+            SphereMesh mesh = BuildSphereMesh(stacks, stacks);
+            vertices = mesh.vertices.size() / 3;
+            meshBytes = mesh.vertices.size() * sizeof(float) + mesh.indices.size() * sizeof(unsigned int);
+        }, iterations, mean, best);
+        record("sphere_mesh", (size_t)stacks, (double)vertices, "vertex", (double)meshBytes, iterations, mean, best);
+    }
+
+    if (options.outPath.empty()) {
+        PrintJson(std::cout, options, results);
+    } else {
+        std::ofstream out(options.outPath);
+        if (!out) {
+            std::cerr << "Could not open " << options.outPath << std::endl;
+            return 1;
+        }
+        PrintJson(out, options, results);
+    }
+    return 0;
+}
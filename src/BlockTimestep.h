@@ -0,0 +1,312 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+
+// Hierarchical block timesteps with a 4th order Hermite predictor-corrector. Every
+// body steps by dtMax / 2^level, picked from its acceleration and jerk (Aarseth's
+// criterion), so a tight binary gets small steps while the rest of the system keeps
+// taking large ones. Bodies whose next step ends at the same time form the active
+// block; only they get forces recomputed, against positions and velocities of all
+// other bodies predicted to that time.
+//
+// Times are kept as integer ticks, dtMax = 2^MaxLevel ticks, so block membership is
+// exact. After every sub-step the store holds the whole system at the current time
+// (corrected state for the active bodies, predicted for the rest), so drawing and
+// diagnostics never see bodies at different times.
+//
+// Forces come from direct summation with jerk. The tree and SIMD solvers have no
+// jerk, so they are not used with block steps.
+template <int D>
+class BlockIntegrator {
+public:
+    static const int MaxLevel = 24; // Smallest step is dtMax / 2^24
+    static const size_t BodiesPerTask = 64;
+
+    double dt; // Largest (level 0) step
+    double G;
+    double eps2;
+    double eta = 0.02; // Accuracy parameter of the step criterion
+    int maxStepsPerAdvance = 64;
+
+    BlockIntegrator(double dt, double G, double eps2, ThreadPool* pool = nullptr)
+        : dt(dt), G(G), eps2(eps2), pool(pool) {}
+
+    // Advances the whole system by one level 0 step. The force callback is taken for
+    // compatibility with Integrator and not used.
+    template <class Force>
+    void Step(BodyStore& bodies, Force&&) {
+        if (!initialised || bodies.size() != count) {
+            Initialise(bodies);
+        }
+        const uint64_t blockTicks = uint64_t(1) << MaxLevel;
+        uint64_t end = tick + blockTicks;
+        while (tick < end) {
+            uint64_t next = end;
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t due = bodyTick[i] + StepTicks(level[i]);
+                if (due < next) {
+                    next = due;
+                }
+            }
+            active.clear();
+            for (size_t i = 0; i < count; ++i) {
+                if (bodyTick[i] + StepTicks(level[i]) == next) {
+                    active.push_back(i);
+                }
+            }
+
+            tick = next;
+            Predict(bodies);
+            ComputeActive(bodies);
+            Correct(bodies);
+            subSteps++;
+        }
+        blocks++;
+    }
+
+    template <class Force>
+    int Advance(BodyStore& bodies, double elapsed, Force&& force) {
+        return Advance(bodies, elapsed, force, [] {});
+    }
+
+    // Same, calling afterStep() after every step, e.g. to resolve collisions
+    template <class Force, class AfterStep>
+    int Advance(BodyStore& bodies, double elapsed, Force&& force, AfterStep&& afterStep) {
+        accumulator += elapsed;
+        int steps = 0;
+        while (accumulator >= dt && steps < maxStepsPerAdvance) {
+            Step(bodies, force);
+            afterStep();
+            accumulator -= dt;
+            steps++;
+        }
+        if (accumulator >= dt) {
+            accumulator = 0.0;
+        }
+        return steps;
+    }
+
+    // Call whenever positions, velocities or masses change outside Step. The next
+    // step restarts every body from the store at the current time.
+    void Invalidate() { initialised = false; }
+
+    // Levels and per-body times are indexed by body, so a reorder restarts them
+    void BodiesReordered() { Invalidate(); }
+
+    // Block steps never call the force callback, so pot is never filled on the way
+    bool ForcesCurrent() const { return false; }
+
+    double Time() const { return (double)tick * TickLength(); }
+
+    // For resuming from a checkpoint. Levels are not saved, so every body restarts
+    // from the store with a fresh step.
+    void SetTime(double t) {
+        tick = (uint64_t)std::llround(t / TickLength());
+        initialised = false;
+    }
+    double Alpha() const { return accumulator / dt; }
+
+    // Number of single-body force evaluations (each one a sum over all N bodies)
+    size_t ForceEvaluations() const { return evaluations; }
+
+    // What stepping every body at the smallest step used so far would have cost
+    double SharedStepEvaluations() const {
+        return (double)blocks * (double)count * (double)StepsPerBlock(deepestLevel);
+    }
+
+    int DeepestLevel() const { return deepestLevel; }
+    size_t SubSteps() const { return subSteps; }
+
+private:
+    ThreadPool* pool;
+    bool initialised = false;
+    size_t count = 0;
+    uint64_t tick = 0;
+    double accumulator = 0.0;
+    size_t evaluations = 0;
+    size_t blocks = 0;
+    size_t subSteps = 0;
+    int deepestLevel = 0;
+
+    // Per-body state at the body's own last step
+    std::vector<double> x0[D];
+    std::vector<double> v0[D];
+    std::vector<double> a0[D];
+    std::vector<double> j0[D];
+    std::vector<double> a1[D]; // New accelerations and jerks of the active bodies
+    std::vector<double> j1[D];
+    std::vector<uint64_t> bodyTick;
+    std::vector<int> level;
+    std::vector<size_t> active;
+
+    double TickLength() const { return dt / (double)(uint64_t(1) << MaxLevel); }
+    static uint64_t StepTicks(int lvl) { return uint64_t(1) << (MaxLevel - lvl); }
+    static uint64_t StepsPerBlock(int lvl) { return uint64_t(1) << lvl; }
+
+    void Initialise(BodyStore& bodies) {
+        count = bodies.size();
+        for (int k = 0; k < D; ++k) {
+            x0[k].assign(bodies.pos(k), bodies.pos(k) + count);
+            v0[k].assign(bodies.vel(k), bodies.vel(k) + count);
+            a0[k].assign(count, 0.0);
+            j0[k].assign(count, 0.0);
+            a1[k].assign(count, 0.0);
+            j1[k].assign(count, 0.0);
+        }
+        bodyTick.assign(count, tick);
+        level.assign(count, 0);
+
+        active.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            active[i] = i;
+        }
+        ComputeActive(bodies);
+
+        // Start with a cautious |a| / |j| step, aligned to the current tick
+        for (size_t i = 0; i < count; ++i) {
+            double aa = 0.0;
+            double jj = 0.0;
+            for (int k = 0; k < D; ++k) {
+                a0[k][i] = a1[k][i];
+                j0[k][i] = j1[k][i];
+                aa += a1[k][i] * a1[k][i];
+                jj += j1[k][i] * j1[k][i];
+            }
+            double wanted = (jj > 0.0) ? 0.25 * eta * std::sqrt(aa / jj) : dt;
+            int lvl = LevelFor(wanted);
+            while (lvl < MaxLevel && tick % StepTicks(lvl) != 0) {
+                lvl++;
+            }
+            level[i] = lvl;
+            if (lvl > deepestLevel) {
+                deepestLevel = lvl;
+            }
+        }
+        initialised = true;
+    }
+
+    // Smallest level whose step does not exceed wanted
+    int LevelFor(double wanted) const {
+        int lvl = 0;
+        double step = dt;
+        while (lvl < MaxLevel && step > wanted) {
+            step *= 0.5;
+            lvl++;
+        }
+        return lvl;
+    }
+
+    // Writes every body's position and velocity at the current tick into the store
+    void Predict(BodyStore& bodies) {
+        double unit = TickLength();
+        for (size_t i = 0; i < count; ++i) {
+            double h = (double)(tick - bodyTick[i]) * unit;
+            for (int k = 0; k < D; ++k) {
+                bodies.pos(k)[i] = x0[k][i] + h * (v0[k][i] + h * (0.5 * a0[k][i] + h * j0[k][i] / 6.0));
+                bodies.vel(k)[i] = v0[k][i] + h * (a0[k][i] + h * 0.5 * j0[k][i]);
+            }
+        }
+    }
+
+    // Acceleration and jerk of every active body from the predicted store state
+    void ComputeActive(const BodyStore& bodies) {
+        size_t tasks = (active.size() + BodiesPerTask - 1) / BodiesPerTask;
+        auto task = [&](size_t t, int) {
+            size_t begin = t * BodiesPerTask;
+            size_t end = (begin + BodiesPerTask < active.size()) ? begin + BodiesPerTask : active.size();
+            for (size_t a = begin; a < end; ++a) {
+                AccelerationAndJerk(bodies, active[a]);
+            }
+        };
+        if (pool) {
+            pool->ParallelFor(tasks, task);
+        } else {
+            for (size_t t = 0; t < tasks; ++t) {
+                task(t, 0);
+            }
+        }
+        evaluations += active.size();
+    }
+
+    void AccelerationAndJerk(const BodyStore& bodies, size_t i) {
+        double acc[D] = {};
+        double jerk[D] = {};
+        for (size_t j = 0; j < count; ++j) {
+            if (j == i) {
+                continue;
+            }
+            double dx[D];
+            double dv[D];
+            double r2 = eps2;
+            double rv = 0.0;
+            for (int k = 0; k < D; ++k) {
+                dx[k] = bodies.pos(k)[j] - bodies.pos(k)[i];
+                dv[k] = bodies.vel(k)[j] - bodies.vel(k)[i];
+                r2 += dx[k] * dx[k];
+                rv += dx[k] * dv[k];
+            }
+            double inv = 1.0 / std::sqrt(r2);
+            double inv3 = bodies.mass[j] * inv * inv * inv;
+            double three = 3.0 * rv / r2;
+            for (int k = 0; k < D; ++k) {
+                acc[k] += dx[k] * inv3;
+                jerk[k] += (dv[k] - three * dx[k]) * inv3;
+            }
+        }
+        for (int k = 0; k < D; ++k) {
+            a1[k][i] = G * acc[k];
+            j1[k][i] = G * jerk[k];
+        }
+    }
+
+    // Hermite corrector for the active bodies, then their next step
+    void Correct(BodyStore& bodies) {
+        for (size_t i : active) {
+            double h = (double)(tick - bodyTick[i]) * TickLength();
+            double a2[D];
+            double a3[D];
+            double aa = 0.0, jj = 0.0, a22 = 0.0, a33 = 0.0;
+            for (int k = 0; k < D; ++k) {
+                double v1 = v0[k][i] + 0.5 * h * (a0[k][i] + a1[k][i]) + h * h / 12.0 * (j0[k][i] - j1[k][i]);
+                double x1 = x0[k][i] + 0.5 * h * (v0[k][i] + v1) + h * h / 12.0 * (a0[k][i] - a1[k][i]);
+                x0[k][i] = bodies.pos(k)[i] = x1;
+                v0[k][i] = bodies.vel(k)[i] = v1;
+                bodies.acc(k)[i] = a1[k][i];
+
+                // Second and third derivatives of the acceleration at the new time
+                double da = a0[k][i] - a1[k][i];
+                a3[k] = (12.0 * da + 6.0 * h * (j0[k][i] + j1[k][i])) / (h * h * h);
+                a2[k] = (-6.0 * da - h * (4.0 * j0[k][i] + 2.0 * j1[k][i])) / (h * h) + h * a3[k];
+
+                a0[k][i] = a1[k][i];
+                j0[k][i] = j1[k][i];
+                aa += a1[k][i] * a1[k][i];
+                jj += j1[k][i] * j1[k][i];
+                a22 += a2[k] * a2[k];
+                a33 += a3[k] * a3[k];
+            }
+            bodyTick[i] = tick;
+
+            double num = std::sqrt(aa) * std::sqrt(a22) + jj;
+            double den = std::sqrt(jj) * std::sqrt(a33) + a22;
+            double wanted = (den > 0.0) ? std::sqrt(eta * num / den) : dt;
+
+            // Shrink freely, grow one level at a time and only on a block boundary
+            int lvl = LevelFor(wanted);
+            if (lvl < level[i]) {
+                lvl = level[i] - 1;
+                if (tick % StepTicks(lvl) != 0) {
+                    lvl = level[i];
+                }
+            }
+            level[i] = lvl;
+            if (lvl > deepestLevel) {
+                deepestLevel = lvl;
+            }
+        }
+    }
+};
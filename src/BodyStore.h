@@ -0,0 +1,251 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// 64 byte aligned heap blocks, shared by the body store and the force scratch buffers.
+// Throws std::bad_alloc like new does instead of returning null.
+inline void* AllocAligned(size_t bytes) {
+    if (bytes > SIZE_MAX - 63) {
+        throw std::bad_alloc();
+    }
+#ifdef _WIN32
+    void* ptr = _aligned_malloc(bytes, 64);
+#else
+    void* ptr = std::aligned_alloc(64, (bytes + 63) / 64 * 64);
+#endif
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+inline void FreeAligned(void* ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+// Structure-of-arrays storage for every body in the sim. Each field is its own
+// contiguous, 64 byte aligned array so the force loops stream through memory
+// instead of chasing a heap allocated std::vector per object.
+class BodyStore {
+public:
+    static const size_t FieldCount = 12;
+
+    double* x = nullptr;
+    double* y = nullptr;
+    double* z = nullptr;
+    double* vx = nullptr;
+    double* vy = nullptr;
+    double* vz = nullptr;
+    double* mass = nullptr;
+    double* radius = nullptr;
+    double* ax = nullptr; // Accelerations written by the force solvers
+    double* ay = nullptr;
+    double* az = nullptr;
+    double* pot = nullptr; // Potential per unit mass, only written when a solver is asked for it
+    std::vector<std::string> name; // Cold data, only used for printing
+    std::vector<uint32_t> id;      // Stable per-body id, follows the body when indices change (colours key off it)
+    uint64_t layout = 0;           // Bumped whenever bodies change index, so index-matched copies know to resync
+
+    BodyStore() {}
+
+    BodyStore(const BodyStore& other) {
+        *this = other;
+    }
+
+    BodyStore& operator=(const BodyStore& other) {
+        if (this != &other) {
+            clear();
+            reserve(other.count);
+            for (size_t f = 0; f < FieldCount && other.count > 0; ++f) {
+                std::memcpy(block + f * cap, other.block + f * other.cap, sizeof(double) * other.count);
+            }
+            count = other.count;
+            name = other.name;
+            id = other.id;
+            nextId = other.nextId;
+            layout = other.layout;
+        }
+        return *this;
+    }
+
+    ~BodyStore() {
+        FreeAligned(block);
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return cap; }
+
+    // Per-axis access for code that loops over dimensions
+    double* pos(int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+    double* vel(int axis) const { return axis == 0 ? vx : (axis == 1 ? vy : vz); }
+    double* acc(int axis) const { return axis == 0 ? ax : (axis == 1 ? ay : az); }
+
+    // Field f of FieldCount, in declaration order, for code that treats every array alike
+    double* field(size_t f) const { return block + f * cap; }
+
+    void clear() {
+        count = 0;
+        name.clear();
+        id.clear();
+        nextId = 0;
+        layout++;
+    }
+
+    // Exchanges the bodies of two stores without copying, e.g. to put a fully loaded
+    // scene in place. Both layouts move past either old value, since every index now
+    // holds another body.
+    void swap(BodyStore& other) {
+        std::swap(block, other.block);
+        std::swap(count, other.count);
+        std::swap(cap, other.cap);
+        std::swap(nextId, other.nextId);
+        name.swap(other.name);
+        id.swap(other.id);
+        layout = other.layout = std::max(layout, other.layout) + 1;
+        SetPointers();
+        other.SetPointers();
+    }
+
+    // Grows every array together. Capacity is rounded up to a multiple of 8 so each
+    // field starts on a 64 byte boundary and SIMD loops can run past the end safely.
+    // Throws std::bad_alloc if the block can't be had, leaving the store as it was.
+    void reserve(size_t wanted) {
+        if (wanted <= cap) {
+            return;
+        }
+        const size_t maxCap = SIZE_MAX / (sizeof(double) * FieldCount) / 8 * 8; // Largest block size_t can count
+        if (wanted > maxCap) {
+            throw std::bad_alloc();
+        }
+        size_t newCap = cap ? cap : 8;
+        while (newCap < wanted) {
+            newCap = newCap > maxCap / 2 ? maxCap : newCap * 2;
+        }
+
+        double* newBlock = static_cast<double*>(AllocAligned(sizeof(double) * FieldCount * newCap));
+        std::memset(newBlock, 0, sizeof(double) * FieldCount * newCap);
+        for (size_t f = 0; f < FieldCount; ++f) {
+            if (block) {
+                std::memcpy(newBlock + f * newCap, block + f * cap, sizeof(double) * count);
+            }
+        }
+        FreeAligned(block);
+        block = newBlock;
+        cap = newCap;
+        SetPointers();
+    }
+
+    // Sets the body count, e.g. before filling the arrays from a file. New bodies are
+    // zeroed and unnamed.
+    void resize(size_t newCount) {
+        reserve(newCount);
+        for (size_t f = 0; f < FieldCount && newCount > count; ++f) {
+            std::memset(block + f * cap + count, 0, sizeof(double) * (newCount - count));
+        }
+        count = newCount;
+        name.resize(newCount);
+        while (id.size() < newCount) {
+            id.push_back(nextId++);
+        }
+        id.resize(newCount);
+    }
+
+    size_t add(const std::string& bodyName, double bodyMass, double bodyRadius, double px, double py, double pz, double velx, double vely, double velz) {
+        if (count == cap) {
+            reserve(count + 1);
+        }
+        size_t i = count++;
+        x[i] = px;
+        y[i] = py;
+        z[i] = pz;
+        vx[i] = velx;
+        vy[i] = vely;
+        vz[i] = velz;
+        mass[i] = bodyMass;
+        radius[i] = bodyRadius;
+        name.push_back(bodyName);
+        id.push_back(nextId++);
+        return i;
+    }
+
+    // Removes body i by moving the last body into its slot, so indices are not stable.
+    void remove(size_t i) {
+        size_t last = count - 1;
+        if (i != last) {
+            for (size_t f = 0; f < FieldCount; ++f) {
+                double* field = block + f * cap;
+                field[i] = field[last];
+            }
+            name[i] = name[last];
+            id[i] = id[last];
+            layout++;
+        }
+        name.pop_back();
+        id.pop_back();
+        count--;
+    }
+
+    // Moves the name and id of body order[i] to slot i for every i. Whoever reorders
+    // the numeric fields (see SpatialOrder.h) calls this so the cold data follows. The
+    // ids are copied back into place, so id.data() stays put like the numeric arrays.
+    void permuteNamesAndIds(const uint32_t* order) {
+        std::vector<std::string> newName(count);
+        std::vector<uint32_t> newId(count);
+        for (size_t i = 0; i < count; ++i) {
+            newName[i] = std::move(name[order[i]]);
+            newId[i] = id[order[i]];
+        }
+        name.swap(newName);
+        std::copy(newId.begin(), newId.end(), id.begin());
+        layout++;
+    }
+
+    // The id the next added body will get; every id so far is below it
+    uint32_t idsIssued() const { return nextId; }
+
+    // Puts back ids saved with idsIssued(), e.g. from a checkpoint, so bodies keep
+    // their names' colours and later bodies don't reuse an id
+    void restoreIds(const uint32_t* ids, uint32_t issued) {
+        std::copy(ids, ids + count, id.begin());
+        nextId = issued;
+        for (size_t i = 0; i < count; ++i) {
+            nextId = std::max(nextId, id[i] + 1);
+        }
+        layout++;
+    }
+
+private:
+    double* block = nullptr;
+    size_t count = 0;
+    size_t cap = 0;
+    uint32_t nextId = 0;
+
+    void SetPointers() {
+        x = block;
+        y = block + cap;
+        z = block + 2 * cap;
+        vx = block + 3 * cap;
+        vy = block + 4 * cap;
+        vz = block + 5 * cap;
+        mass = block + 6 * cap;
+        radius = block + 7 * cap;
+        ax = block + 8 * cap;
+        ay = block + 9 * cap;
+        az = block + 10 * cap;
+        pot = block + 11 * cap;
+    }
+
+};
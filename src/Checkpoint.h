@@ -0,0 +1,296 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BodyStore.h"
+#include "Integrator.h"
+#include "MappedFile.h"
+
+// Snapshots of the whole simulation for stopping and resuming long runs.
+//
+//   CheckpointHeader    128 bytes
+//   body arrays         x, y, z, vx, vy, vz, mass, radius: count doubles each, every
+//                       array padded to 64 bytes so it starts 64 byte aligned
+//   ids                 count uint32 body ids, padded to 64 bytes
+//   names               count NUL terminated strings
+//
+// Accelerations are not stored; the integrator recomputes them from the positions on
+// its first step. For the fixed-step schemes that gives the same numbers a run that
+// never stopped would have used, so a resumed run continues bit for bit. The ids and
+// the next free id are kept too, so bodies keep their colours across a resume even
+// after reordering or merges have moved them.
+//
+// Loading maps the file and copies each array into the store with one memcpy. Saving
+// writes "<path>.tmp" and renames it over the old checkpoint, so a crash while saving
+// leaves the previous checkpoint intact.
+
+// Everything besides the bodies needed to carry on
+struct CheckpointState {
+    double time = 0.0;
+    uint64_t step = 0;
+    IntegratorKind integrator = IntegratorKind::Leapfrog;
+    double dt = 0.0;
+    uint64_t seed = 0; // Seed the scene generator used
+};
+
+struct CheckpointHeader {
+    char magic[8];       // "GSCHKPT\0"
+    uint32_t version;
+    uint32_t byteOrder;  // 0x01020304 as written
+    uint32_t dimensions; // Always 3, the store holds x, y and z either way
+    uint32_t integrator; // IntegratorKind
+    uint64_t count;
+    uint64_t step;
+    double time;
+    double dt;
+    uint64_t seed;
+    uint64_t fieldsOffset;
+    uint64_t namesOffset;
+    uint64_t namesBytes;
+    uint64_t fileBytes;  // Whole file, catches truncation
+    uint64_t idsOffset;
+    uint32_t nextId;     // BodyStore::idsIssued()
+    uint8_t reserved[20];
+};
+
+static_assert(sizeof(CheckpointHeader) == 128, "checkpoint header layout");
+
+const uint32_t CheckpointVersion = 2;
+const uint32_t CheckpointByteOrder = 0x01020304;
+const int CheckpointFields = 8; // The first eight BodyStore fields, up to radius
+
+inline double* CheckpointField(const BodyStore& bodies, int field) {
+    return field < 3 ? bodies.pos(field) : (field < 6 ? bodies.vel(field - 3) : (field == 6 ? bodies.mass : bodies.radius));
+}
+
+// Values per array in the file, a multiple of 8 doubles
+inline uint64_t CheckpointStride(uint64_t count) {
+    return (count + 7) / 8 * 8;
+}
+
+// Ids in the file, a multiple of 16 uint32s
+inline uint64_t CheckpointIdStride(uint64_t count) {
+    return (count + 15) / 16 * 16;
+}
+
+// True if the header's sections lie in order inside a file of size bytes. count is
+// bounded by the size before anything is multiplied by it, and every other test
+// subtracts from a bound already checked, so a damaged header can't overflow them.
+inline bool CheckpointLayoutValid(const CheckpointHeader& header, uint64_t size) {
+    if (header.fileBytes != size || header.count > size / (CheckpointFields * sizeof(double))) {
+        return false;
+    }
+    uint64_t fieldBytes = CheckpointFields * CheckpointStride(header.count) * sizeof(double);
+    return header.fieldsOffset >= sizeof(CheckpointHeader) && header.idsOffset >= header.fieldsOffset &&
+           header.idsOffset - header.fieldsOffset >= fieldBytes && header.namesOffset >= header.idsOffset &&
+           header.namesOffset - header.idsOffset >= header.count * sizeof(uint32_t) && header.namesOffset <= size &&
+           header.namesBytes <= size - header.namesOffset;
+}
+
+// Writes a checkpoint. Returns false (with a message) if it could not be written.
+inline bool SaveCheckpoint(const std::string& path, const BodyStore& bodies, const CheckpointState& state) {
+    uint64_t count = bodies.size();
+    uint64_t stride = CheckpointStride(count);
+
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "GSCHKPT\0", 8);
+    header.version = CheckpointVersion;
+    header.byteOrder = CheckpointByteOrder;
+    header.dimensions = 3;
+    header.integrator = (uint32_t)state.integrator;
+    header.count = count;
+    header.step = state.step;
+    header.time = state.time;
+    header.dt = state.dt;
+    header.seed = state.seed;
+    header.fieldsOffset = sizeof(CheckpointHeader);
+    header.idsOffset = header.fieldsOffset + CheckpointFields * stride * sizeof(double);
+    header.nextId = bodies.idsIssued();
+    header.namesOffset = header.idsOffset + CheckpointIdStride(count) * sizeof(uint32_t);
+    for (size_t i = 0; i < count; ++i) {
+        header.namesBytes += bodies.name[i].size() + 1;
+    }
+    header.fileBytes = header.namesOffset + header.namesBytes;
+
+    std::string temp = path + ".tmp";
+    std::FILE* file = std::fopen(temp.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Could not open checkpoint file " << temp << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    const double padding[8] = {};
+    for (int f = 0; f < CheckpointFields && ok && count > 0; ++f) { // An empty store has no arrays to pass
+        ok = std::fwrite(CheckpointField(bodies, f), sizeof(double), count, file) == count &&
+             std::fwrite(padding, sizeof(double), stride - count, file) == stride - count;
+    }
+    uint64_t idStride = CheckpointIdStride(count);
+    if (ok && count > 0) {
+        ok = std::fwrite(bodies.id.data(), sizeof(uint32_t), count, file) == count &&
+             std::fwrite(padding, sizeof(uint32_t), idStride - count, file) == idStride - count;
+    }
+    for (size_t i = 0; i < count && ok; ++i) {
+        ok = std::fwrite(bodies.name[i].c_str(), 1, bodies.name[i].size() + 1, file) == bodies.name[i].size() + 1;
+    }
+    if (std::fclose(file) != 0) {
+        ok = false;
+    }
+    if (ok) {
+#ifdef _WIN32
+        ok = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        ok = std::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+    }
+    if (!ok) {
+        std::cerr << "Writing checkpoint " << path << " failed" << std::endl;
+        std::remove(temp.c_str());
+    }
+    return ok;
+}
+
+// Replaces the store's bodies with the checkpoint's. Returns false (with a message)
+// if the file is missing, truncated or from another version.
+inline bool LoadCheckpoint(const std::string& path, BodyStore& bodies, CheckpointState& state) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cerr << "Could not map checkpoint file " << path << std::endl;
+        return false;
+    }
+    CheckpointHeader header;
+    if (file.Size() < sizeof(header)) {
+        std::cerr << "Checkpoint " << path << " is too short" << std::endl;
+        return false;
+    }
+    std::memcpy(&header, file.Data(), sizeof(header));
+    if (std::memcmp(header.magic, "GSCHKPT\0", 8) != 0) {
+        std::cerr << path << " is not a checkpoint" << std::endl;
+        return false;
+    }
+    if (header.byteOrder != CheckpointByteOrder || header.version != CheckpointVersion) {
+        std::cerr << "Checkpoint " << path << " is version " << header.version
+                  << " or from another byte order, this build reads version " << CheckpointVersion << std::endl;
+        return false;
+    }
+    if (!CheckpointLayoutValid(header, file.Size()) || header.integrator > (uint32_t)IntegratorKind::Block) {
+        std::cerr << "Checkpoint " << path << " is truncated or damaged" << std::endl;
+        return false;
+    }
+    uint64_t stride = CheckpointStride(header.count);
+
+    size_t count = (size_t)header.count;
+    bodies.clear();
+    bodies.resize(count);
+    const unsigned char* fields = file.Data() + header.fieldsOffset;
+    for (int f = 0; f < CheckpointFields && count > 0; ++f) {
+        std::memcpy(CheckpointField(bodies, f), fields + f * stride * sizeof(double), count * sizeof(double));
+    }
+    std::vector<uint32_t> ids(count);
+    if (count > 0) {
+        std::memcpy(ids.data(), file.Data() + header.idsOffset, count * sizeof(uint32_t));
+    }
+    bodies.restoreIds(ids.data(), header.nextId);
+    const char* names = reinterpret_cast<const char*>(file.Data() + header.namesOffset);
+    const char* namesEnd = names + header.namesBytes;
+    for (size_t i = 0; i < count && names < namesEnd; ++i) {
+        const char* end = static_cast<const char*>(std::memchr(names, 0, namesEnd - names));
+        size_t length = end ? (size_t)(end - names) : (size_t)(namesEnd - names);
+        bodies.name[i].assign(names, length);
+        names += length + 1;
+    }
+
+    state.time = header.time;
+    state.step = header.step;
+    state.integrator = (IntegratorKind)header.integrator;
+    state.dt = header.dt;
+    state.seed = header.seed;
+    return true;
+}
+
+// Periodic checkpoints from the step loop. Save() copies the bodies into a snapshot
+// and returns; a background thread writes the snapshot out. If the previous
+// checkpoint is still being written, the request is skipped rather than waiting, so
+// the loop only ever pays for the copy.
+class Checkpointer {
+public:
+    Checkpointer() {
+        worker = std::thread([this] { WriteLoop(); });
+    }
+
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Returns false if the request was skipped
+    bool Save(const std::string& path, const BodyStore& bodies, const CheckpointState& state) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy) {
+            skipped++;
+            return false;
+        }
+        snapshot = bodies;
+        snapshotState = state;
+        snapshotPath = path;
+        busy = true;
+        wake.notify_one();
+        return true;
+    }
+
+    // Blocks until the last requested checkpoint is on disk, e.g. before exiting.
+    // Returns false if it failed.
+    bool Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return !busy; });
+        return lastOk;
+    }
+
+    size_t Written() const { return written; }
+    size_t Skipped() const { return skipped; }
+
+private:
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    BodyStore snapshot; // Owned by the worker while busy
+    CheckpointState snapshotState;
+    std::string snapshotPath;
+    bool busy = false;
+    bool stopping = false;
+    bool lastOk = true;
+    size_t written = 0;
+    size_t skipped = 0;
+
+    void WriteLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || busy; });
+            if (!busy) {
+                return;
+            }
+            lock.unlock();
+            bool ok = SaveCheckpoint(snapshotPath, snapshot, snapshotState);
+            lock.lock();
+            lastOk = ok;
+            written += ok ? 1 : 0;
+            busy = false;
+            idle.notify_all();
+        }
+    }
+};
@@ -0,0 +1,293 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "BodyStore.h"
+#include "Profiler.h"
+
+enum class CollisionResponse {
+    Off,
+    Merge,  // Perfectly inelastic: one body with the combined mass, momentum and volume
+    Bounce  // Impulse along the line of centres with a restitution coefficient
+};
+
+inline const char* CollisionResponseName(CollisionResponse response) {
+    switch (response) {
+        case CollisionResponse::Off: return "off";
+        case CollisionResponse::Bounce: return "bounce";
+        default: return "merge";
+    }
+}
+
+// Finds overlapping bodies and resolves them in place, so an impact only affects the
+// bodies involved.
+//
+// Broad phase: a uniform grid hashed into one sorted array. The cell size is twice the
+// diameter of a typical (90th percentile) body, but at least a quarter of the largest
+// radius. Each body is entered in every cell its bounding box touches, so bodies much
+// larger than the rest still work. Sorting the entries by cell key groups each cell's
+// bodies, and only bodies sharing a cell are compared. The cost grows with N log N
+// rather than N^2. A body whose position or radius is not finite takes no part.
+//
+// Narrow phase: exact sphere (circle in 2D) overlap. Hits are resolved in index order
+// so runs are repeatable. Both bodies of a merge are done for the pass: the survivor
+// has moved and grown since its overlaps were found, so any further hit it has waits
+// for the next call, which tests it again as it is now.
+template <int D>
+class CollisionSystem {
+public:
+    CollisionResponse response = CollisionResponse::Merge;
+    double restitution = 1.0; // Bounce only: 1 is elastic, 0 removes all normal velocity
+    bool verbose = true;      // Print each collision
+
+    // Returns the number of collisions resolved. Merges remove bodies from the store.
+    size_t Resolve(BodyStore& bodies) {
+        if (response == CollisionResponse::Off || bodies.size() < 2) {
+            return 0;
+        }
+        PROFILE_SCOPE("collisions");
+        FindOverlaps(bodies);
+        if (hits.empty()) {
+            return 0;
+        }
+
+        size_t resolved = 0;
+        merged.assign(bodies.size(), NotMerged);
+        for (const std::pair<int, int>& hit : hits) {
+            int i = hit.first;
+            int j = hit.second;
+            if (merged[i] != NotMerged || merged[j] != NotMerged) {
+                continue;
+            }
+            if (verbose) {
+                std::cout << "Collision between " << bodies.name[i] << " and " << bodies.name[j] << std::endl;
+            }
+            if (response == CollisionResponse::Merge) {
+                Merge(bodies, i, j);
+            } else {
+                Bounce(bodies, i, j);
+            }
+            resolved++;
+        }
+
+        // Descending order keeps swap-with-last removal from moving a flagged body
+        for (size_t i = merged.size(); i-- > 0;) {
+            if (merged[i] == MergedAway) {
+                bodies.remove(i);
+            }
+        }
+        total += resolved;
+        return resolved;
+    }
+
+    size_t TotalCollisions() const { return total; }
+    size_t PairTests() const { return pairTests; } // Narrow phase tests so far
+
+    // Heap bytes held by the broad phase scratch
+    size_t MemoryBytes() const {
+        return entries.capacity() * sizeof(Entry) + radiusScratch.capacity() * sizeof(double) +
+               hits.capacity() * sizeof(std::pair<int, int>) + merged.capacity();
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        int body;
+        bool operator<(const Entry& other) const {
+            return key < other.key || (key == other.key && body < other.body);
+        }
+    };
+
+    std::vector<Entry> entries;
+    std::vector<double> radiusScratch;
+    std::vector<std::pair<int, int>> hits;
+    enum : char { NotMerged, MergedInto, MergedAway };
+    std::vector<char> merged; // Per body, for the current pass
+    size_t total = 0;
+    size_t pairTests = 0;
+
+    static uint64_t CellKey(const int64_t* cell) {
+        uint64_t key = 1469598103934665603ULL;
+        for (int k = 0; k < D; ++k) {
+            key = (key ^ (uint64_t)cell[k]) * 1099511628211ULL;
+            key ^= key >> 29;
+        }
+        return key;
+    }
+
+    // Cells of the interval center +- radius along one axis, clamped to +-CellLimit so
+    // the casts stay defined. False if the interval isn't finite: such a body is left
+    // out of the broad phase, it can't be placed in any cell.
+    static bool CellSpan(double center, double radius, double inv, int64_t& lo, int64_t& hi) {
+        const double CellLimit = 1e15; // Exact in a double, far inside int64_t
+        double first = std::floor((center - radius) * inv);
+        double last = std::floor((center + radius) * inv);
+        if (!std::isfinite(first) || !std::isfinite(last)) {
+            return false;
+        }
+        lo = (int64_t)std::min(std::max(first, -CellLimit), CellLimit);
+        hi = (int64_t)std::min(std::max(last, -CellLimit), CellLimit);
+        return true;
+    }
+
+    void FindOverlaps(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        radiusScratch.clear(); // Finite radii only, a NaN would break the ordering
+        for (size_t i = 0; i < n; ++i) {
+            if (std::isfinite(bodies.radius[i])) {
+                radiusScratch.push_back(bodies.radius[i]);
+            }
+        }
+        double cellSize = 0.0;
+        if (!radiusScratch.empty()) {
+            size_t typical = radiusScratch.size() * 9 / 10;
+            std::nth_element(radiusScratch.begin(), radiusScratch.begin() + typical, radiusScratch.end());
+            double typicalRadius = radiusScratch[typical];
+            double largest = *std::max_element(radiusScratch.begin(), radiusScratch.end());
+            cellSize = std::max(4.0 * typicalRadius, 0.25 * largest); // Caps a giant body at 9^D cells
+        }
+        if (!(cellSize > 0.0)) {
+            cellSize = 1.0;
+        }
+        double inv = 1.0 / cellSize;
+
+        entries.clear();
+        for (size_t i = 0; i < n; ++i) {
+            int64_t lo[D];
+            int64_t hi[D];
+            bool placed = true;
+            for (int k = 0; k < D && placed; ++k) {
+                placed = CellSpan(bodies.pos(k)[i], bodies.radius[i], inv, lo[k], hi[k]);
+            }
+            if (!placed) {
+                continue;
+            }
+            int64_t cell[D];
+            for (int k = 0; k < D; ++k) {
+                cell[k] = lo[k];
+            }
+            while (true) {
+                entries.push_back({CellKey(cell), (int)i});
+                int k = 0;
+                while (k < D && ++cell[k] > hi[k]) {
+                    cell[k] = lo[k];
+                    k++;
+                }
+                if (k == D) {
+                    break;
+                }
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+
+        hits.clear();
+        for (size_t start = 0; start < entries.size();) {
+            size_t end = start + 1;
+            while (end < entries.size() && entries[end].key == entries[start].key) {
+                end++;
+            }
+            for (size_t a = start; a < end; ++a) {
+                for (size_t b = a + 1; b < end; ++b) {
+                    int i = entries[a].body;
+                    int j = entries[b].body;
+                    if (i == j) {
+                        continue; // Two of the body's cells hashed to the same key
+                    }
+                    pairTests++;
+                    if (Overlap(bodies, i, j)) {
+                        hits.push_back(std::make_pair(i, j)); // i < j, entries are sorted by body within a cell
+                    }
+                }
+            }
+            start = end;
+        }
+
+        // A pair sharing several cells is found once per cell
+        std::sort(hits.begin(), hits.end());
+        hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+    }
+
+    static bool Overlap(const BodyStore& bodies, int i, int j) {
+        double d2 = 0.0;
+        for (int k = 0; k < D; ++k) {
+            double d = bodies.pos(k)[j] - bodies.pos(k)[i];
+            d2 += d * d;
+        }
+        double reach = bodies.radius[i] + bodies.radius[j];
+        return d2 <= reach * reach;
+    }
+
+    // The heavier body survives with the combined mass at the centre of mass, moving
+    // with the total momentum. Volume is conserved, so the radius grows as the cube
+    // root (square root in 2D) of the summed powers.
+    void Merge(BodyStore& bodies, int i, int j) {
+        int keep = (bodies.mass[j] > bodies.mass[i]) ? j : i;
+        int gone = (keep == i) ? j : i;
+        double mk = bodies.mass[keep];
+        double mg = bodies.mass[gone];
+        double m = mk + mg;
+        if (m > 0.0) {
+            for (int k = 0; k < D; ++k) {
+                bodies.pos(k)[keep] = (mk * bodies.pos(k)[keep] + mg * bodies.pos(k)[gone]) / m;
+                bodies.vel(k)[keep] = (mk * bodies.vel(k)[keep] + mg * bodies.vel(k)[gone]) / m;
+            }
+        }
+        double rk = bodies.radius[keep];
+        double rg = bodies.radius[gone];
+        bodies.radius[keep] = (D == 3) ? std::cbrt(rk * rk * rk + rg * rg * rg) : std::sqrt(rk * rk + rg * rg);
+        bodies.mass[keep] = m;
+        merged[keep] = MergedInto;
+        merged[gone] = MergedAway;
+    }
+
+    // Exchanges momentum along the line of centres if the bodies are approaching, then
+    // pushes them apart so they don't stay overlapped. Both steps conserve momentum.
+    void Bounce(BodyStore& bodies, int i, int j) {
+        double normal[D];
+        double dist2 = 0.0;
+        for (int k = 0; k < D; ++k) {
+            normal[k] = bodies.pos(k)[j] - bodies.pos(k)[i];
+            dist2 += normal[k] * normal[k];
+        }
+        double dist = std::sqrt(dist2);
+        if (dist > 0.0) {
+            for (int k = 0; k < D; ++k) {
+                normal[k] /= dist;
+            }
+        } else {
+            for (int k = 0; k < D; ++k) {
+                normal[k] = (k == 0) ? 1.0 : 0.0;
+            }
+        }
+
+        double invI = (bodies.mass[i] > 0.0) ? 1.0 / bodies.mass[i] : 0.0;
+        double invJ = (bodies.mass[j] > 0.0) ? 1.0 / bodies.mass[j] : 0.0;
+        if (invI + invJ == 0.0) {
+            return;
+        }
+
+        double approach = 0.0;
+        for (int k = 0; k < D; ++k) {
+            approach += (bodies.vel(k)[j] - bodies.vel(k)[i]) * normal[k];
+        }
+        if (approach < 0.0) {
+            double impulse = -(1.0 + restitution) * approach / (invI + invJ);
+            for (int k = 0; k < D; ++k) {
+                bodies.vel(k)[i] -= impulse * invI * normal[k];
+                bodies.vel(k)[j] += impulse * invJ * normal[k];
+            }
+        }
+
+        double overlap = bodies.radius[i] + bodies.radius[j] - dist;
+        if (overlap > 0.0) {
+            for (int k = 0; k < D; ++k) {
+                bodies.pos(k)[i] -= overlap * invI / (invI + invJ) * normal[k];
+                bodies.pos(k)[j] += overlap * invJ / (invI + invJ) * normal[k];
+            }
+        }
+    }
+};
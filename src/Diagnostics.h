@@ -0,0 +1,160 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include "BodyStore.h"
+
+// Conservation diagnostics sampled from the step loop: energy, virial ratio, linear
+// and angular momentum and centre of mass, each against the first sample taken.
+//
+// Sample reads the potential from the store's pot array and the virial from ax/ay/az,
+// so both must belong to the current positions: the force pass that ended the step has
+// to have run with Engine::computePotential set. Nothing is recomputed here, so a sample
+// costs O(N) on top of that pass.
+//
+// The virial is Clausius' W = sum m (x - x_com) . a, which equals the potential energy
+// for unsoftened gravity; 2K / |W| is 1 for a system in virial equilibrium. The centre
+// of mass drift is measured against the straight line the first sample's centre of
+// mass and mean velocity predict. Merges keep momentum and mass but not kinetic
+// energy, so with merging collisions only the energy column drifts for a reason.
+// Every sum runs over all three components; 2D stores have z = 0.
+
+struct DiagnosticsSample {
+    uint64_t step = 0;
+    double time = 0.0;
+    size_t count = 0;
+    double kinetic = 0.0;
+    double potential = 0.0;      // 0.5 sum m * pot
+    double energy = 0.0;
+    double energyError = 0.0;    // (E - E0) / |E0|
+    double virialRatio = 0.0;    // 2K / |W|
+    double momentum[3] = {0.0, 0.0, 0.0};
+    double momentumError = 0.0;  // |P - P0| / sqrt(2 M (K0 + |U0|)) of the first sample
+    double angularMomentum[3] = {0.0, 0.0, 0.0};
+    double angularError = 0.0;   // |L - L0| / |L0|
+    double com[3] = {0.0, 0.0, 0.0};
+    double comDrift = 0.0;       // Distance from where the first sample's motion puts it
+};
+
+class Diagnostics {
+public:
+    long every = 100; // Steps between samples
+
+    // Writes a header line to out and sends every sample after it there as one line.
+    // out may be null to only keep the samples for Latest().
+    void Start(std::ostream* stream) {
+        out = stream;
+        hasReference = false;
+        if (out) {
+            *out << "# step time bodies kinetic potential energy energy_error virial_ratio"
+                    " px py pz momentum_error angular_error com_drift" << std::endl;
+        }
+    }
+
+    bool Due(uint64_t step) const { return every > 0 && step % (uint64_t)every == 0; }
+
+    // Measures the store as it is now; the first call becomes the reference
+    const DiagnosticsSample& Sample(const BodyStore& bodies, uint64_t step, double time) {
+        DiagnosticsSample s;
+        s.step = step;
+        s.time = time;
+        s.count = bodies.size();
+        Measure(bodies, s);
+
+        if (!hasReference) {
+            reference = s;
+            hasReference = true;
+        }
+        s.energyError = reference.energy != 0.0 ? (s.energy - reference.energy) / std::abs(reference.energy) : 0.0;
+        // M times the speed the first sample's K + |U| would give all its mass, which
+        // exists for a cold start where sum m |v| is 0
+        double p0 = std::sqrt(2.0 * referenceMass * (reference.kinetic + std::abs(reference.potential)));
+        s.momentumError = p0 > 0.0 ? Distance(s.momentum, reference.momentum) / p0 : 0.0;
+        double l0 = Length(reference.angularMomentum);
+        s.angularError = Distance(s.angularMomentum, reference.angularMomentum) / (l0 > 0.0 ? l0 : 1.0);
+        double expected[3];
+        for (int k = 0; k < 3; ++k) {
+            double drift = referenceMass > 0.0 ? reference.momentum[k] / referenceMass : 0.0;
+            expected[k] = reference.com[k] + drift * (time - reference.time);
+        }
+        s.comDrift = Distance(s.com, expected);
+
+        latest = s;
+        if (out) {
+            Write(*out, latest);
+            out->flush();
+        }
+        return latest;
+    }
+
+    bool HasSamples() const { return hasReference; }
+    const DiagnosticsSample& Reference() const { return reference; }
+    const DiagnosticsSample& Latest() const { return latest; }
+
+    static void Write(std::ostream& stream, const DiagnosticsSample& s) {
+        std::ios::fmtflags flags = stream.flags();
+        std::streamsize precision = stream.precision();
+        stream << std::setprecision(10) << s.step << ' ' << s.time << ' ' << s.count << ' ' << s.kinetic << ' '
+               << s.potential << ' ' << s.energy << ' ' << std::setprecision(4) << s.energyError << ' '
+               << s.virialRatio << ' ' << std::setprecision(10) << s.momentum[0] << ' ' << s.momentum[1] << ' '
+               << s.momentum[2] << ' ' << std::setprecision(4) << s.momentumError << ' ' << s.angularError << ' '
+               << s.comDrift << '\n';
+        stream.flags(flags);
+        stream.precision(precision);
+    }
+
+private:
+    std::ostream* out = nullptr;
+    bool hasReference = false;
+    DiagnosticsSample reference;
+    DiagnosticsSample latest;
+    double referenceMass = 0.0;
+
+    static double Length(const double* v) {
+        return std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    }
+
+    static double Distance(const double* a, const double* b) {
+        double d[3] = {a[0] - b[0], a[1] - b[1], a[2] - b[2]};
+        return Length(d);
+    }
+
+    void Measure(const BodyStore& bodies, DiagnosticsSample& s) {
+        size_t n = bodies.size();
+        double totalMass = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            double m = bodies.mass[i];
+            double p[3] = {bodies.x[i], bodies.y[i], bodies.z[i]};
+            double v[3] = {bodies.vx[i], bodies.vy[i], bodies.vz[i]};
+            double v2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+            totalMass += m;
+            s.kinetic += 0.5 * m * v2;
+            s.potential += 0.5 * m * bodies.pot[i];
+            for (int k = 0; k < 3; ++k) {
+                s.momentum[k] += m * v[k];
+                s.com[k] += m * p[k];
+            }
+            s.angularMomentum[0] += m * (p[1] * v[2] - p[2] * v[1]);
+            s.angularMomentum[1] += m * (p[2] * v[0] - p[0] * v[2]);
+            s.angularMomentum[2] += m * (p[0] * v[1] - p[1] * v[0]);
+        }
+        for (int k = 0; k < 3; ++k) {
+            s.com[k] = totalMass > 0.0 ? s.com[k] / totalMass : 0.0;
+        }
+
+        // Second pass, the virial needs the centre of mass first
+        double virial = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            virial += bodies.mass[i] * ((bodies.x[i] - s.com[0]) * bodies.ax[i] + (bodies.y[i] - s.com[1]) * bodies.ay[i] +
+                                        (bodies.z[i] - s.com[2]) * bodies.az[i]);
+        }
+        s.energy = s.kinetic + s.potential;
+        s.virialRatio = virial != 0.0 ? 2.0 * s.kinetic / std::abs(virial) : 0.0;
+
+        if (!hasReference) {
+            referenceMass = totalMass;
+        }
+    }
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include "BodyStore.h"
+#include "Vec.h"
+#include "Forces.h"
+#include "BarnesHut.h"
+#include "SimdForces.h"
+#include "ThreadPool.h"
+#include "ParallelForces.h"
+#include "Collisions.h"
+#include "SpatialOrder.h"
+#include "Profiler.h"
+
+// The physics both views run: force solver selection, the solvers' long-lived state
+// and collision handling, templated on the dimension. GravitySim (D = 2) and
+// GravitySim3D (D = 3) differ only in drawing, scene setup and options, so anything
+// done to the hot path here reaches both.
+//
+// In 2D every body has z = 0, so the SIMD direct kernel, which always sums three
+// components, gives the 2D result unchanged.
+
+enum class ForceSolver {
+    Pairwise,  // Scalar all-pairs summation
+    Simd,      // Vectorised all-pairs summation
+    BarnesHut
+};
+
+template <int D>
+class Engine {
+public:
+    ForceSolver solver = ForceSolver::Pairwise;
+    double G;
+    double eps2 = 0.0; // Plummer softening squared
+    SimdLevel simd = DetectSimdLevel();
+    ForcePrecision precision = ForcePrecision::Double; // Simd solver only
+    bool computePotential = false; // Also fill the store's pot array on the next force passes
+
+    BarnesHutTree<D> tree; // Set tree.theta for the opening angle
+    ThreadPool pool;
+    ParallelForces forces;
+    CollisionSystem<D> collisions;
+    SpatialOrder<D> order; // Set order.threshold = 0 to keep bodies where they are
+
+    Engine(double G, int threads) : G(G), pool(threads) {}
+
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // Fills the store's accelerations with the selected solver. Returns the number of
+    // pairwise (or body-cell) interactions evaluated.
+    double ComputeForces(BodyStore& bodies) {
+        PROFILE_SCOPE("forces");
+        size_t count = bodies.size();
+
+        if (solver == ForceSolver::BarnesHut) {
+            tree.eps2 = eps2;
+            {
+                PROFILE_SCOPE("tree build");
+                tree.Build(bodies);
+            }
+            return (double)forces.Tree(pool, tree, bodies, G, computePotential);
+        }
+
+        if (solver == ForceSolver::Simd) {
+            forces.Direct(pool, bodies, G, eps2, simd, precision, computePotential);
+        } else {
+            DirectAccelerations<D>(bodies, G, eps2, computePotential);
+        }
+        return 0.5 * (double)count * (double)(count - (count > 0 ? 1 : 0));
+    }
+
+    // Housekeeping after every step: merges or bounces overlapping bodies, telling
+    // the integrator to recompute its accelerations if anything changed, then re-sorts
+    // the store along the space-filling curve if its order has decayed. Returns the
+    // number of collisions resolved.
+    template <class Stepper>
+    size_t FinishStep(BodyStore& bodies, Stepper& integrator) {
+        size_t resolved = collisions.Resolve(bodies);
+        if (resolved > 0) {
+            integrator.Invalidate();
+        }
+        if (order.Maintain(pool, bodies)) {
+            integrator.BodiesReordered();
+        }
+        return resolved;
+    }
+};
+
+inline const char* ForceSolverName(ForceSolver solver, SimdLevel simd) {
+    switch (solver) {
+        case ForceSolver::BarnesHut: return "barnes-hut";
+        case ForceSolver::Simd: return SimdLevelName(simd);
+        default: return "direct";
+    }
+}
@@ -0,0 +1,594 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "BodyStore.h"
+#include "SimdForces.h"
+#include "ThreadPool.h"
+#include "Scene.h"
+
+// Thousands of independent copies of one small system, each with its masses and
+// velocities perturbed, integrated together for parameter sweeps.
+//
+// Storage is field-major with the member innermost: x of body k for every member,
+// then x of body k + 1, and so on. A SIMD vector therefore holds the same body of
+// 4 (AVX2) or 8 (AVX-512) consecutive members, and the pair loop over the bodies
+// vectorises across members with plain aligned loads. Members are integrated with
+// leapfrog in blocks of BlockMembers lanes, one pool task per block for the whole
+// run, so a block stays in L1/L2 and the threads never synchronise mid-run.
+//
+// A member stops at the first step on which two of its bodies touch (centres closer
+// than the sum of their radii) or a body is further than escapeRadius from the
+// member's centre of mass. Its lane keeps being computed with a step of zero, so it
+// freezes in place. Once half of a block's lanes have stopped, the running members
+// are moved to the front and the block narrows, and a block whose members have all
+// stopped ends early. Member 0 is the unperturbed system.
+
+enum class EnsembleOutcome : uint8_t {
+    Survived, // Still running after the last step
+    Collided,
+    Escaped
+};
+
+inline const char* EnsembleOutcomeName(EnsembleOutcome outcome) {
+    switch (outcome) {
+        case EnsembleOutcome::Collided: return "collided";
+        case EnsembleOutcome::Escaped: return "escaped";
+        default: return "survived";
+    }
+}
+
+struct EnsembleParams {
+    size_t members = 1000;
+    double velocitySpread = 0.01; // Each velocity component moves by up to this fraction of the body's speed
+    double massSpread = 0.01;     // Each mass is scaled by a factor in [1 - spread, 1 + spread]
+    double escapeRadius = 1000.0; // From the member's centre of mass
+    double G = 0.0;
+    double eps2 = 0.0;            // Plummer softening squared
+    uint64_t seed = 12345;
+};
+
+// One member's result, 8 bytes in the results file
+struct EnsembleRecord {
+    uint32_t step;   // Step the member stopped on, or the last step if it survived
+    uint8_t outcome; // EnsembleOutcome
+    uint8_t bodyA;   // Collided: the two bodies that touched. Escaped: the body that left
+    uint8_t bodyB;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(EnsembleRecord) == 8, "ensemble record layout");
+
+//   EnsembleHeader      96 bytes
+//   records             one EnsembleRecord per member, in member order
+struct EnsembleHeader {
+    char magic[8];       // "GSENSMB\0"
+    uint32_t version;
+    uint32_t byteOrder;  // 0x01020304 as written
+    uint32_t bodies;     // Per member
+    uint32_t reserved0;
+    uint64_t members;
+    uint64_t steps;      // Steps asked for
+    double dt;
+    uint64_t seed;
+    double velocitySpread;
+    double massSpread;
+    double escapeRadius;
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(EnsembleHeader) == 96, "ensemble header layout");
+
+const uint32_t EnsembleVersion = 1;
+
+// The block loop is inlined into one copy per SIMD level, so its plain lane loops
+// (kicks, drifts, the escape test) are vectorised at that level as well
+#ifdef GRAVITYSIM_X86
+#define ENSEMBLE_INLINE __attribute__((always_inline)) inline
+#else
+#define ENSEMBLE_INLINE inline
+#endif
+
+// Pointers to the lanes of one block: field[k] is body k's value for the block's
+// first member, and the next lanes members follow it
+struct EnsembleBlock {
+    static const size_t MaxBodies = 16;
+
+    size_t bodies;
+    size_t lanes;
+    double* x[MaxBodies];
+    double* y[MaxBodies];
+    double* z[MaxBodies];
+    double* m[MaxBodies];
+    double* r[MaxBodies];
+    double* ax[MaxBodies];
+    double* ay[MaxBodies];
+    double* az[MaxBodies];
+};
+
+// Accelerations of every lane. contact[j] is set to 1 + the index of the first
+// touching pair (pairs numbered k < l in order) unless it is already set.
+inline void EnsembleForcesScalar(const EnsembleBlock& b, double G, double eps2, uint8_t* contact) {
+    for (size_t k = 0; k < b.bodies; ++k) {
+        std::fill(b.ax[k], b.ax[k] + b.lanes, 0.0);
+        std::fill(b.ay[k], b.ay[k] + b.lanes, 0.0);
+        std::fill(b.az[k], b.az[k] + b.lanes, 0.0);
+    }
+    uint8_t pair = 1;
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t l = k + 1; l < b.bodies; ++l, ++pair) {
+            for (size_t j = 0; j < b.lanes; ++j) {
+                double dx = b.x[l][j] - b.x[k][j];
+                double dy = b.y[l][j] - b.y[k][j];
+                double dz = b.z[l][j] - b.z[k][j];
+                double d2 = dx * dx + dy * dy + dz * dz;
+                double touch = b.r[k][j] + b.r[l][j];
+                if (d2 < touch * touch && contact[j] == 0) {
+                    contact[j] = pair;
+                }
+                double inv = 1.0 / std::sqrt(d2 + eps2);
+                double inv3 = inv * inv * inv;
+                double sl = b.m[l][j] * inv3;
+                double sk = b.m[k][j] * inv3;
+                b.ax[k][j] += dx * sl;
+                b.ay[k][j] += dy * sl;
+                b.az[k][j] += dz * sl;
+                b.ax[l][j] -= dx * sk;
+                b.ay[l][j] -= dy * sk;
+                b.az[l][j] -= dz * sk;
+            }
+        }
+    }
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t j = 0; j < b.lanes; ++j) {
+            b.ax[k][j] *= G;
+            b.ay[k][j] *= G;
+            b.az[k][j] *= G;
+        }
+    }
+}
+
+#ifdef GRAVITYSIM_X86
+// Marks contact for the lanes set in mask, lane 0 in bit 0
+inline void EnsembleMarkContacts(unsigned mask, uint8_t* contact, uint8_t pair) {
+    for (; mask != 0; mask &= mask - 1) {
+        int lane = __builtin_ctz(mask);
+        if (contact[lane] == 0) {
+            contact[lane] = pair;
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void EnsembleForcesAVX2(const EnsembleBlock& b, double G, double eps2, uint8_t* contact) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d soft = _mm256_set1_pd(eps2);
+    const __m256d g = _mm256_set1_pd(G);
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t j = 0; j < b.lanes; j += 4) {
+            _mm256_store_pd(b.ax[k] + j, zero);
+            _mm256_store_pd(b.ay[k] + j, zero);
+            _mm256_store_pd(b.az[k] + j, zero);
+        }
+    }
+    uint8_t pair = 1;
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t l = k + 1; l < b.bodies; ++l, ++pair) {
+            for (size_t j = 0; j < b.lanes; j += 4) {
+                __m256d dx = _mm256_sub_pd(_mm256_load_pd(b.x[l] + j), _mm256_load_pd(b.x[k] + j));
+                __m256d dy = _mm256_sub_pd(_mm256_load_pd(b.y[l] + j), _mm256_load_pd(b.y[k] + j));
+                __m256d dz = _mm256_sub_pd(_mm256_load_pd(b.z[l] + j), _mm256_load_pd(b.z[k] + j));
+                __m256d d2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+                __m256d touch = _mm256_add_pd(_mm256_load_pd(b.r[k] + j), _mm256_load_pd(b.r[l] + j));
+                unsigned hit = (unsigned)_mm256_movemask_pd(_mm256_cmp_pd(d2, _mm256_mul_pd(touch, touch), _CMP_LT_OQ));
+                if (hit) {
+                    EnsembleMarkContacts(hit, contact + j, pair);
+                }
+                __m256d inv = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_add_pd(d2, soft)));
+                __m256d inv3 = _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv));
+                __m256d sl = _mm256_mul_pd(_mm256_load_pd(b.m[l] + j), inv3);
+                __m256d sk = _mm256_mul_pd(_mm256_load_pd(b.m[k] + j), inv3);
+                _mm256_store_pd(b.ax[k] + j, _mm256_fmadd_pd(dx, sl, _mm256_load_pd(b.ax[k] + j)));
+                _mm256_store_pd(b.ay[k] + j, _mm256_fmadd_pd(dy, sl, _mm256_load_pd(b.ay[k] + j)));
+                _mm256_store_pd(b.az[k] + j, _mm256_fmadd_pd(dz, sl, _mm256_load_pd(b.az[k] + j)));
+                _mm256_store_pd(b.ax[l] + j, _mm256_fnmadd_pd(dx, sk, _mm256_load_pd(b.ax[l] + j)));
+                _mm256_store_pd(b.ay[l] + j, _mm256_fnmadd_pd(dy, sk, _mm256_load_pd(b.ay[l] + j)));
+                _mm256_store_pd(b.az[l] + j, _mm256_fnmadd_pd(dz, sk, _mm256_load_pd(b.az[l] + j)));
+            }
+        }
+    }
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t j = 0; j < b.lanes; j += 4) {
+            _mm256_store_pd(b.ax[k] + j, _mm256_mul_pd(g, _mm256_load_pd(b.ax[k] + j)));
+            _mm256_store_pd(b.ay[k] + j, _mm256_mul_pd(g, _mm256_load_pd(b.ay[k] + j)));
+            _mm256_store_pd(b.az[k] + j, _mm256_mul_pd(g, _mm256_load_pd(b.az[k] + j)));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void EnsembleForcesAVX512(const EnsembleBlock& b, double G, double eps2, uint8_t* contact) {
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d soft = _mm512_set1_pd(eps2);
+    const __m512d g = _mm512_set1_pd(G);
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t j = 0; j < b.lanes; j += 8) {
+            _mm512_store_pd(b.ax[k] + j, zero);
+            _mm512_store_pd(b.ay[k] + j, zero);
+            _mm512_store_pd(b.az[k] + j, zero);
+        }
+    }
+    uint8_t pair = 1;
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t l = k + 1; l < b.bodies; ++l, ++pair) {
+            for (size_t j = 0; j < b.lanes; j += 8) {
+                __m512d dx = _mm512_sub_pd(_mm512_load_pd(b.x[l] + j), _mm512_load_pd(b.x[k] + j));
+                __m512d dy = _mm512_sub_pd(_mm512_load_pd(b.y[l] + j), _mm512_load_pd(b.y[k] + j));
+                __m512d dz = _mm512_sub_pd(_mm512_load_pd(b.z[l] + j), _mm512_load_pd(b.z[k] + j));
+                __m512d d2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+                __m512d touch = _mm512_add_pd(_mm512_load_pd(b.r[k] + j), _mm512_load_pd(b.r[l] + j));
+                unsigned hit = (unsigned)_mm512_cmp_pd_mask(d2, _mm512_mul_pd(touch, touch), _CMP_LT_OQ);
+                if (hit) {
+                    EnsembleMarkContacts(hit, contact + j, pair);
+                }
+                __m512d inv = _mm512_div_pd(one, _mm512_maskz_sqrt_pd(0xFF, _mm512_add_pd(d2, soft))); // maskz form avoids GCC's undefined-register warning
+                __m512d inv3 = _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv));
+                __m512d sl = _mm512_mul_pd(_mm512_load_pd(b.m[l] + j), inv3);
+                __m512d sk = _mm512_mul_pd(_mm512_load_pd(b.m[k] + j), inv3);
+                _mm512_store_pd(b.ax[k] + j, _mm512_fmadd_pd(dx, sl, _mm512_load_pd(b.ax[k] + j)));
+                _mm512_store_pd(b.ay[k] + j, _mm512_fmadd_pd(dy, sl, _mm512_load_pd(b.ay[k] + j)));
+                _mm512_store_pd(b.az[k] + j, _mm512_fmadd_pd(dz, sl, _mm512_load_pd(b.az[k] + j)));
+                _mm512_store_pd(b.ax[l] + j, _mm512_fnmadd_pd(dx, sk, _mm512_load_pd(b.ax[l] + j)));
+                _mm512_store_pd(b.ay[l] + j, _mm512_fnmadd_pd(dy, sk, _mm512_load_pd(b.ay[l] + j)));
+                _mm512_store_pd(b.az[l] + j, _mm512_fnmadd_pd(dz, sk, _mm512_load_pd(b.az[l] + j)));
+            }
+        }
+    }
+    for (size_t k = 0; k < b.bodies; ++k) {
+        for (size_t j = 0; j < b.lanes; j += 8) {
+            _mm512_store_pd(b.ax[k] + j, _mm512_mul_pd(g, _mm512_load_pd(b.ax[k] + j)));
+            _mm512_store_pd(b.ay[k] + j, _mm512_mul_pd(g, _mm512_load_pd(b.ay[k] + j)));
+            _mm512_store_pd(b.az[k] + j, _mm512_mul_pd(g, _mm512_load_pd(b.az[k] + j)));
+        }
+    }
+}
+#endif
+
+inline void EnsembleForces(const EnsembleBlock& b, double G, double eps2, uint8_t* contact, SimdLevel level) {
+#ifdef GRAVITYSIM_X86
+    if (level == SimdLevel::AVX512) {
+        EnsembleForcesAVX512(b, G, eps2, contact);
+        return;
+    }
+    if (level == SimdLevel::AVX2) {
+        EnsembleForcesAVX2(b, G, eps2, contact);
+        return;
+    }
+#endif
+    EnsembleForcesScalar(b, G, eps2, contact);
+}
+
+class Ensemble {
+public:
+    static const size_t MaxBodies = EnsembleBlock::MaxBodies;
+    static const size_t BlockMembers = 64; // Lanes per block, a multiple of 8
+    static const size_t Fields = 11;       // x, y, z, vx, vy, vz, mass, radius, ax, ay, az
+
+    Ensemble() {}
+    Ensemble(const Ensemble&) = delete;
+    Ensemble& operator=(const Ensemble&) = delete;
+
+    ~Ensemble() {
+        FreeAligned(block);
+    }
+
+    // Lays out params.members perturbed copies of system. Returns false (with a
+    // message) if the system is empty or has more than MaxBodies bodies.
+    bool Setup(const BodyStore& system, const EnsembleParams& ensembleParams) {
+        params = ensembleParams;
+        bodies = system.size();
+        if (bodies == 0 || bodies > MaxBodies) {
+            std::cerr << "Ensemble systems need 1 to " << MaxBodies << " bodies, got " << bodies << std::endl;
+            return false;
+        }
+        members = params.members;
+        stride = (members + BlockMembers - 1) / BlockMembers * BlockMembers;
+        FreeAligned(block);
+        block = nullptr; // Stays empty if the allocation throws
+        block = static_cast<double*>(AllocAligned(sizeof(double) * Fields * bodies * stride));
+        std::memset(block, 0, sizeof(double) * Fields * bodies * stride);
+
+        // Padding lanes past the last member get the unperturbed system and never run
+        for (size_t j = 0; j < stride; ++j) {
+            SceneRng rng(params.seed, j);
+            bool perturb = j > 0 && j < members;
+            for (size_t k = 0; k < bodies; ++k) {
+                double speed = std::sqrt(system.vx[k] * system.vx[k] + system.vy[k] * system.vy[k] + system.vz[k] * system.vz[k]);
+                Lane(0, k)[j] = system.x[k];
+                Lane(1, k)[j] = system.y[k];
+                Lane(2, k)[j] = system.z[k];
+                for (int c = 0; c < 3; ++c) {
+                    double kick = perturb ? params.velocitySpread * speed * (2.0 * rng.Uniform() - 1.0) : 0.0;
+                    Lane(3 + c, k)[j] = system.vel(c)[k] + kick;
+                }
+                double scale = perturb ? 1.0 + params.massSpread * (2.0 * rng.Uniform() - 1.0) : 1.0;
+                Lane(6, k)[j] = system.mass[k] * scale;
+                Lane(7, k)[j] = system.radius[k];
+            }
+        }
+        records.assign(members, EnsembleRecord());
+        memberSteps = 0;
+        return true;
+    }
+
+    // Takes up to steps leapfrog steps of dt for every member, stopping each one on
+    // its own. Blocks run as independent pool tasks; the result does not depend on
+    // the thread count. Call once per Setup: compaction leaves members in other lanes.
+    void Run(ThreadPool& pool, double dt, uint64_t steps, SimdLevel level) {
+        size_t blocks = stride / BlockMembers;
+        std::vector<uint64_t> blockSteps(blocks, 0);
+        pool.ParallelFor(blocks, [&](size_t b, int) {
+            blockSteps[b] = RunBlock(b, dt, steps, level);
+        });
+        memberSteps = 0;
+        for (uint64_t s : blockSteps) {
+            memberSteps += s;
+        }
+    }
+
+    size_t Members() const { return members; }
+    size_t Bodies() const { return bodies; }
+    const std::vector<EnsembleRecord>& Records() const { return records; }
+
+    // Steps actually taken, summed over members: the systems x steps of the run
+    uint64_t MemberSteps() const { return memberSteps; }
+
+    // Writes the header and one record per member. Returns false (with a message)
+    // if the file could not be written.
+    bool WriteResults(const std::string& path, double dt, uint64_t steps) const {
+        EnsembleHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "GSENSMB\0", 8);
+        header.version = EnsembleVersion;
+        header.byteOrder = 0x01020304;
+        header.bodies = (uint32_t)bodies;
+        header.members = members;
+        header.steps = steps;
+        header.dt = dt;
+        header.seed = params.seed;
+        header.velocitySpread = params.velocitySpread;
+        header.massSpread = params.massSpread;
+        header.escapeRadius = params.escapeRadius;
+
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Could not open ensemble results file " << path << std::endl;
+            return false;
+        }
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  std::fwrite(records.data(), sizeof(EnsembleRecord), records.size(), file) == records.size();
+        if (std::fclose(file) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Could not write ensemble results file " << path << std::endl;
+        }
+        return ok;
+    }
+
+private:
+    EnsembleParams params;
+    size_t bodies = 0;
+    size_t members = 0;
+    size_t stride = 0; // Lanes per field, members rounded up to whole blocks
+    double* block = nullptr;
+    std::vector<EnsembleRecord> records;
+    uint64_t memberSteps = 0;
+
+    double* Lane(size_t field, size_t k) const { return block + (field * bodies + k) * stride; }
+
+    // Runs one block to the end, returns the member steps it took
+    uint64_t RunBlock(size_t b, double dt, uint64_t steps, SimdLevel level) {
+#ifdef GRAVITYSIM_X86
+        if (level == SimdLevel::AVX512) {
+            return RunBlockAVX512(b, dt, steps);
+        }
+        if (level == SimdLevel::AVX2) {
+            return RunBlockAVX2(b, dt, steps);
+        }
+#endif
+        return RunBlockLoop(b, dt, steps, SimdLevel::Scalar);
+    }
+
+#ifdef GRAVITYSIM_X86
+    __attribute__((target("avx512f")))
+    uint64_t RunBlockAVX512(size_t b, double dt, uint64_t steps) {
+        return RunBlockLoop(b, dt, steps, SimdLevel::AVX512);
+    }
+
+    __attribute__((target("avx2,fma")))
+    uint64_t RunBlockAVX2(size_t b, double dt, uint64_t steps) {
+        return RunBlockLoop(b, dt, steps, SimdLevel::AVX2);
+    }
+#endif
+
+    ENSEMBLE_INLINE uint64_t RunBlockLoop(size_t b, double dt, uint64_t steps, SimdLevel level) {
+        size_t first = b * BlockMembers;
+        EnsembleBlock view;
+        view.bodies = bodies;
+        view.lanes = BlockMembers;
+        double* vx[MaxBodies];
+        double* vy[MaxBodies];
+        double* vz[MaxBodies];
+        for (size_t k = 0; k < bodies; ++k) {
+            view.x[k] = Lane(0, k) + first;
+            view.y[k] = Lane(1, k) + first;
+            view.z[k] = Lane(2, k) + first;
+            vx[k] = Lane(3, k) + first;
+            vy[k] = Lane(4, k) + first;
+            vz[k] = Lane(5, k) + first;
+            view.m[k] = Lane(6, k) + first;
+            view.r[k] = Lane(7, k) + first;
+            view.ax[k] = Lane(8, k) + first;
+            view.ay[k] = Lane(9, k) + first;
+            view.az[k] = Lane(10, k) + first;
+        }
+
+        // Per lane step, zero once the member has stopped, and the member each lane holds
+        alignas(64) double step[BlockMembers];
+        alignas(64) uint8_t contact[BlockMembers];
+        uint32_t member[BlockMembers];
+        size_t running = 0;
+        for (size_t j = 0; j < BlockMembers; ++j) {
+            bool live = first + j < members;
+            step[j] = live ? dt : 0.0;
+            member[j] = (uint32_t)(first + j);
+            running += live;
+        }
+
+        std::memset(contact, 0, sizeof(contact));
+        EnsembleForces(view, params.G, params.eps2, contact, level);
+        running -= CheckStops(view, member, 0, step, contact);
+
+        uint64_t taken = 0;
+        for (uint64_t s = 1; s <= steps && running > 0; ++s) {
+            if (running <= view.lanes / 2 && view.lanes > 8) {
+                Compact(b, view, step, member);
+            }
+            for (size_t k = 0; k < bodies; ++k) {
+                KickDrift(view.x[k], vx[k], view.ax[k], step, view.lanes);
+                KickDrift(view.y[k], vy[k], view.ay[k], step, view.lanes);
+                KickDrift(view.z[k], vz[k], view.az[k], step, view.lanes);
+            }
+            std::memset(contact, 0, sizeof(contact));
+            EnsembleForces(view, params.G, params.eps2, contact, level);
+            for (size_t k = 0; k < bodies; ++k) {
+                Kick(vx[k], view.ax[k], step, view.lanes);
+                Kick(vy[k], view.ay[k], step, view.lanes);
+                Kick(vz[k], view.az[k], step, view.lanes);
+            }
+            taken += running;
+            running -= CheckStops(view, member, (uint32_t)s, step, contact);
+        }
+
+        for (size_t j = 0; j < view.lanes; ++j) {
+            if (step[j] != 0.0) {
+                records[member[j]].step = (uint32_t)steps;
+            }
+        }
+        return taken;
+    }
+
+    // Moves the running lanes of block b to the front and shrinks view.lanes to the
+    // next multiple of 8, so stopped members stop costing force evaluations. Stopped
+    // lanes are overwritten, their records are already final. Lanes compute
+    // independently, so this does not change any member's result.
+    ENSEMBLE_INLINE void Compact(size_t b, EnsembleBlock& view, double* step, uint32_t* member) {
+        size_t first = b * BlockMembers;
+        size_t next = 0;
+        for (size_t j = 0; j < view.lanes; ++j) {
+            if (step[j] == 0.0) {
+                continue;
+            }
+            if (j != next) {
+                for (size_t f = 0; f < Fields; ++f) {
+                    for (size_t k = 0; k < bodies; ++k) {
+                        double* lanes = Lane(f, k) + first;
+                        lanes[next] = lanes[j];
+                    }
+                }
+                step[next] = step[j];
+                member[next] = member[j];
+                step[j] = 0.0;
+            }
+            next++;
+        }
+        view.lanes = (next + 7) / 8 * 8;
+    }
+
+    // Half kick then drift of one component for every lane
+    static ENSEMBLE_INLINE void KickDrift(double* __restrict x, double* __restrict v, const double* __restrict a,
+                                          const double* __restrict step, size_t lanes) {
+        for (size_t j0 = 0; j0 < lanes; j0 += 8) {
+            for (size_t j = j0; j < j0 + 8; ++j) {
+                v[j] += a[j] * (0.5 * step[j]);
+                x[j] += v[j] * step[j];
+            }
+        }
+    }
+
+    static ENSEMBLE_INLINE void Kick(double* __restrict v, const double* __restrict a, const double* __restrict step, size_t lanes) {
+        for (size_t j0 = 0; j0 < lanes; j0 += 8) {
+            for (size_t j = j0; j < j0 + 8; ++j) {
+                v[j] += a[j] * (0.5 * step[j]);
+            }
+        }
+    }
+
+    // Records and freezes the running lanes that touched or escaped this step.
+    // Returns how many stopped. The escape test runs across lanes like the forces:
+    // with M the member's mass and S its mass-weighted position sum, body k is out
+    // when |M x_k - S|^2 > (M R)^2, which needs no division.
+    ENSEMBLE_INLINE size_t CheckStops(const EnsembleBlock& view, const uint32_t* member, uint32_t s, double* step, const uint8_t* contact) {
+        size_t lanes = view.lanes;
+        alignas(64) double total[BlockMembers] = {};
+        alignas(64) double sx[BlockMembers] = {};
+        alignas(64) double sy[BlockMembers] = {};
+        alignas(64) double sz[BlockMembers] = {};
+        alignas(64) uint8_t far[BlockMembers];
+        for (size_t k = 0; k < bodies; ++k) {
+            for (size_t j = 0; j < lanes; ++j) {
+                total[j] += view.m[k][j];
+                sx[j] += view.m[k][j] * view.x[k][j];
+                sy[j] += view.m[k][j] * view.y[k][j];
+                sz[j] += view.m[k][j] * view.z[k][j];
+            }
+        }
+        std::memset(far, (int)bodies, sizeof(far));
+        double escape2 = params.escapeRadius * params.escapeRadius;
+        for (size_t k = bodies; k-- > 0;) { // Downwards, so the lowest escaping body is kept
+            for (size_t j = 0; j < lanes; ++j) {
+                double dx = view.x[k][j] * total[j] - sx[j];
+                double dy = view.y[k][j] * total[j] - sy[j];
+                double dz = view.z[k][j] * total[j] - sz[j];
+                bool out = dx * dx + dy * dy + dz * dz > escape2 * total[j] * total[j];
+                far[j] = out ? (uint8_t)k : far[j];
+            }
+        }
+
+        size_t stopped = 0;
+        for (size_t j = 0; j < lanes; ++j) {
+            if (step[j] == 0.0 || (contact[j] == 0 && far[j] == bodies)) {
+                continue;
+            }
+            EnsembleRecord& record = records[member[j]];
+            if (contact[j] != 0) {
+                uint8_t pair = 1;
+                for (size_t k = 0; k < bodies; ++k) {
+                    for (size_t l = k + 1; l < bodies; ++l, ++pair) {
+                        if (pair == contact[j]) {
+                            record.bodyA = (uint8_t)k;
+                            record.bodyB = (uint8_t)l;
+                        }
+                    }
+                }
+                record.outcome = (uint8_t)EnsembleOutcome::Collided;
+            } else {
+                record.outcome = (uint8_t)EnsembleOutcome::Escaped;
+                record.bodyA = record.bodyB = far[j];
+            }
+            record.step = s;
+            step[j] = 0.0;
+            stopped++;
+        }
+        return stopped;
+    }
+};
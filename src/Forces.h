@@ -0,0 +1,86 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include "BodyStore.h"
+#include "Vec.h"
+
+// Exact all-pairs accelerations written into the store's ax/ay/az arrays. This is
+// the reference the approximate solvers are checked against. D is 2 or 3. With
+// potential set, the softened potential -G sum m_j / r_ij goes into pot as well.
+template <int D>
+void DirectAccelerations(BodyStore& bodies, double G, double eps2 = 0.0, bool potential = false) {
+    size_t n = bodies.size();
+    double* acc[D];
+    for (int k = 0; k < D; ++k) {
+        acc[k] = bodies.acc(k);
+        for (size_t i = 0; i < n; ++i) {
+            acc[k][i] = 0.0;
+        }
+    }
+    if (potential) {
+        for (size_t i = 0; i < n; ++i) {
+            bodies.pot[i] = 0.0;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        Vec<D> pi = Position<D>(bodies, i);
+        for (size_t j = i + 1; j < n; ++j) {
+            Vec<D> d = Position<D>(bodies, j) - pi;
+            double inv = 1.0 / std::sqrt(Dot(d, d, eps2));
+            double inv3 = G * inv * inv * inv;
+            for (int k = 0; k < D; ++k) {
+                acc[k][i] += d[k] * bodies.mass[j] * inv3;
+                acc[k][j] -= d[k] * bodies.mass[i] * inv3;
+            }
+            if (potential) {
+                bodies.pot[i] -= G * bodies.mass[j] * inv;
+                bodies.pot[j] -= G * bodies.mass[i] * inv;
+            }
+        }
+    }
+}
+
+// Kinetic plus softened potential energy, O(N^2). Used to measure how well an
+// integrator conserves energy.
+template <int D>
+double TotalEnergy(const BodyStore& bodies, double G, double eps2 = 0.0) {
+    size_t n = bodies.size();
+    double kinetic = 0.0;
+    double potential = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        Vec<D> v = Velocity<D>(bodies, i);
+        kinetic += 0.5 * bodies.mass[i] * Dot(v, v);
+
+        Vec<D> pi = Position<D>(bodies, i);
+        for (size_t j = i + 1; j < n; ++j) {
+            Vec<D> d = Position<D>(bodies, j) - pi;
+            potential -= G * bodies.mass[i] * bodies.mass[j] / std::sqrt(Dot(d, d, eps2));
+        }
+    }
+    return kinetic + potential;
+}
+
+// RMS and worst-case relative error of the accelerations in the store against a
+// reference set, e.g. the result of DirectAccelerations.
+template <int D>
+void AccelerationError(const BodyStore& bodies, double* const ref[D], double& rmsError, double& maxError) {
+    size_t n = bodies.size();
+    double sum = 0.0;
+    maxError = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        Vec<D> expected;
+        for (int k = 0; k < D; ++k) {
+            expected[k] = ref[k][i];
+        }
+        Vec<D> diff = Acceleration<D>(bodies, i) - expected;
+        double diff2 = Dot(diff, diff);
+        double ref2 = Dot(expected, expected);
+        double rel = (ref2 > 0.0) ? std::sqrt(diff2 / ref2) : std::sqrt(diff2);
+        sum += rel * rel;
+        if (rel > maxError) {
+            maxError = rel;
+        }
+    }
+    rmsError = (n > 0) ? std::sqrt(sum / n) : 0.0;
+}
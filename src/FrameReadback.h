@@ -0,0 +1,109 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <GL/glew.h>
+#include "FrameWriter.h"
+
+// Reads rendered frames back without stalling the render loop. Capture() starts an
+// asynchronous glReadPixels into the next pixel buffer of a ring and puts a fence
+// after it, then returns. A buffer is only mapped when the ring comes back round to
+// it, ringSize - 1 frames later, by which time the GPU has long finished the copy and
+// the fence wait returns at once. The mapped pixels are copied into a FrameWriter
+// buffer and encoded on its workers.
+class FrameReadback {
+public:
+    // Needs a current GL context; reads width x height from the read framebuffer
+    void Init(int frameWidth, int frameHeight, size_t ringSize = 3) {
+        width = frameWidth;
+        height = frameHeight;
+        ring.resize(ringSize);
+        for (Slot& slot : ring) {
+            glGenBuffers(1, &slot.pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, Bytes(), nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        next = 0;
+        frames = 0;
+        waitSeconds = 0.0;
+    }
+
+    // Queues the frame just drawn. The oldest frame in the ring goes to writer first
+    // if its buffer is needed again.
+    void Capture(FrameWriter& writer) {
+        Slot& slot = ring[next];
+        if (slot.fence) {
+            Retire(slot, writer);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0); // Into the buffer, returns at once
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.frame = frames++;
+        next = (next + 1) % ring.size();
+    }
+
+    // Hands every frame still in the ring to writer, oldest first
+    void Flush(FrameWriter& writer) {
+        for (size_t k = 0; k < ring.size(); ++k) {
+            Slot& slot = ring[(next + k) % ring.size()];
+            if (slot.fence) {
+                Retire(slot, writer);
+            }
+        }
+    }
+
+    void Destroy() {
+        for (Slot& slot : ring) {
+            if (slot.fence) {
+                glDeleteSync(slot.fence);
+            }
+            glDeleteBuffers(1, &slot.pbo);
+        }
+        ring.clear();
+    }
+
+    uint64_t FramesCaptured() const { return frames; }
+    // Time spent waiting on fences; near 0 unless the GPU is slower than the loop
+    double WaitSeconds() const { return waitSeconds; }
+
+private:
+    struct Slot {
+        GLuint pbo = 0;
+        GLsync fence = 0;
+        uint64_t frame = 0;
+    };
+
+    int width = 0;
+    int height = 0;
+    std::vector<Slot> ring;
+    size_t next = 0;
+    uint64_t frames = 0;
+    double waitSeconds = 0.0;
+
+    size_t Bytes() const { return (size_t)width * height * 4; }
+
+    void Retire(Slot& slot, FrameWriter& writer) {
+        auto start = std::chrono::steady_clock::now();
+        while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED) {
+        }
+        waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+
+        std::vector<unsigned char> pixels = writer.Acquire(); // May wait for the encoders
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, Bytes(), GL_MAP_READ_BIT);
+        if (mapped) {
+            std::memcpy(pixels.data(), mapped, Bytes());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else {
+            std::memset(pixels.data(), 0, Bytes());
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        writer.Submit(slot.frame, std::move(pixels));
+    }
+};
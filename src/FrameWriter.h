@@ -0,0 +1,299 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+
+// Encodes and writes captured frames on worker threads, so the render loop only ever
+// copies pixels. Frames arrive as bottom-up RGBA rows (what glReadPixels returns) and
+// leave top-down as RGB:
+//   Png  one file per frame, named by a printf pattern such as frames/%05d.png
+//   Ppm  the same, uncompressed
+//   Raw  every frame back to back in one file, for ffmpeg -f rawvideo -pix_fmt rgb24
+//
+// Submit hands a frame to the workers and returns. At most maxQueued frames wait
+// or are being encoded at once; past that Acquire blocks until a worker frees a
+// buffer, so a slow disk slows the capture down instead of filling memory. Buffers
+// are recycled, so a long capture allocates them once.
+
+enum class FrameFormat { Png, Ppm, Raw };
+
+inline const char* FrameFormatName(FrameFormat format) {
+    switch (format) {
+        case FrameFormat::Ppm: return "ppm";
+        case FrameFormat::Raw: return "raw";
+        default: return "png";
+    }
+}
+
+// True if pattern holds exactly one integer conversion (%d, %05d, ...) and no other
+// conversions than %%, so it is safe to hand to snprintf
+inline bool ValidFramePattern(const std::string& pattern) {
+    int conversions = 0;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        if (pattern[i] != '%') {
+            continue;
+        }
+        if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < pattern.size() && pattern[j] >= '0' && pattern[j] <= '9') {
+            j++;
+        }
+        if (j >= pattern.size() || pattern[j] != 'd') {
+            return false;
+        }
+        conversions++;
+        i = j;
+    }
+    return conversions == 1;
+}
+
+class FrameWriter {
+public:
+    int pngLevel = 1; // zlib level: the frames are mostly background, speed matters more
+
+    FrameWriter() {}
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    ~FrameWriter() {
+        Close();
+    }
+
+    // path is a frame pattern for Png and Ppm, a file name for Raw
+    bool Open(const std::string& path, FrameFormat frameFormat, int frameWidth, int frameHeight, int threads) {
+        Close();
+        if (frameFormat != FrameFormat::Raw && !ValidFramePattern(path)) {
+            std::cerr << "Frame pattern " << path << " needs one frame number conversion, e.g. frame_%05d.png" << std::endl;
+            return false;
+        }
+        if (frameFormat == FrameFormat::Raw) {
+            raw = std::fopen(path.c_str(), "wb");
+            if (!raw) {
+                std::cerr << "Could not open " << path << " for frames" << std::endl;
+                return false;
+            }
+        }
+        pattern = path;
+        format = frameFormat;
+        width = frameWidth;
+        height = frameHeight;
+        maxQueued = 2 * (size_t)threads + 2;
+        inFlight = 0;
+        nextRaw = 0;
+        written = 0;
+        failed = 0;
+        stopping = false;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([this] { EncodeLoop(); });
+        }
+        return true;
+    }
+
+    bool IsOpen() const { return !workers.empty(); }
+
+    size_t FrameBytes() const { return (size_t)width * height * 4; }
+
+    // An empty frame buffer of FrameBytes(), waiting while maxQueued frames are in flight
+    std::vector<unsigned char> Acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        freed.wait(lock, [this] { return inFlight < maxQueued; });
+        inFlight++;
+        std::vector<unsigned char> pixels;
+        if (!spare.empty()) {
+            pixels.swap(spare.back());
+            spare.pop_back();
+        }
+        lock.unlock();
+        pixels.resize(FrameBytes());
+        return pixels;
+    }
+
+    // Queues an Acquire()d buffer holding frame number index. Raw frames are written in
+    // index order, so indices must be submitted in order without gaps.
+    void Submit(uint64_t index, std::vector<unsigned char>&& pixels) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.emplace_back(index, std::move(pixels));
+        }
+        work.notify_one();
+    }
+
+    // Waits for every queued frame to be written. Safe to call twice.
+    void Close() {
+        if (workers.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        if (raw && std::fclose(raw) != 0) {
+            failed++;
+        }
+        raw = nullptr;
+        if (failed > 0) {
+            std::cerr << "Writing " << failed << " frames failed" << std::endl;
+        }
+    }
+
+    uint64_t FramesWritten() const { return written; }
+    uint64_t FramesFailed() const { return failed; }
+
+    // The file frame index goes to, for Png and Ppm
+    std::string FramePath(uint64_t index) const {
+        std::vector<char> name(pattern.size() + 32);
+        std::snprintf(name.data(), name.size(), pattern.c_str(), (int)index);
+        return name.data();
+    }
+
+private:
+    typedef std::pair<uint64_t, std::vector<unsigned char>> Frame;
+
+    std::string pattern;
+    FrameFormat format = FrameFormat::Png;
+    int width = 0;
+    int height = 0;
+    std::FILE* raw = nullptr;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work;    // A frame was queued, or stopping
+    std::condition_variable freed;   // A buffer came back
+    std::condition_variable rawTurn; // nextRaw moved on
+    std::deque<Frame> queue;
+    std::vector<std::vector<unsigned char>> spare;
+    size_t maxQueued = 4;
+    size_t inFlight = 0; // Acquired and not yet written, guarded by mutex
+    uint64_t nextRaw = 0;
+    uint64_t written = 0;
+    uint64_t failed = 0;
+    bool stopping = false;
+
+    void EncodeLoop() {
+        std::vector<unsigned char> encoded; // Each worker keeps its own
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return; // Stopping with nothing left
+            }
+            Frame frame = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+
+            bool ok = true;
+            if (format == FrameFormat::Raw) {
+                ToRgbRows(frame.second, encoded, 0);
+                lock.lock();
+                // Frames are taken in order, so the one rawTurn waits for is already being encoded
+                rawTurn.wait(lock, [&] { return nextRaw == frame.first; });
+                lock.unlock();
+                ok = std::fwrite(encoded.data(), 1, encoded.size(), raw) == encoded.size();
+                lock.lock();
+                nextRaw++;
+                rawTurn.notify_all();
+                lock.unlock();
+            } else {
+                ok = WriteImage(FramePath(frame.first), frame.second, encoded);
+            }
+
+            lock.lock();
+            if (ok) {
+                written++;
+            } else {
+                failed++;
+            }
+            spare.push_back(std::move(frame.second));
+            inFlight--;
+            freed.notify_one();
+        }
+    }
+
+    // Top-down RGB rows, each preceded by filterBytes zero bytes (PNG's filter type None)
+    void ToRgbRows(const std::vector<unsigned char>& rgba, std::vector<unsigned char>& out, int filterBytes) const {
+        size_t rowBytes = (size_t)width * 3 + filterBytes;
+        out.resize(rowBytes * height);
+        for (int y = 0; y < height; ++y) {
+            const unsigned char* source = rgba.data() + (size_t)(height - 1 - y) * width * 4;
+            unsigned char* dest = out.data() + (size_t)y * rowBytes;
+            if (filterBytes) {
+                *dest++ = 0;
+            }
+            for (int x = 0; x < width; ++x) {
+                dest[3 * x + 0] = source[4 * x + 0];
+                dest[3 * x + 1] = source[4 * x + 1];
+                dest[3 * x + 2] = source[4 * x + 2];
+            }
+        }
+    }
+
+    bool WriteImage(const std::string& path, const std::vector<unsigned char>& rgba, std::vector<unsigned char>& rows) const {
+        std::FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        bool ok;
+        if (format == FrameFormat::Ppm) {
+            ToRgbRows(rgba, rows, 0);
+            ok = std::fprintf(file, "P6\n%d %d\n255\n", width, height) > 0 &&
+                 std::fwrite(rows.data(), 1, rows.size(), file) == rows.size();
+        } else {
+            ToRgbRows(rgba, rows, 1);
+            ok = WritePng(file, rows);
+        }
+        return std::fclose(file) == 0 && ok;
+    }
+
+    // An 8-bit RGB PNG with a single IDAT chunk
+    bool WritePng(std::FILE* file, const std::vector<unsigned char>& rows) const {
+        std::vector<unsigned char> idat(compressBound((uLong)rows.size()));
+        uLongf idatBytes = (uLongf)idat.size();
+        if (compress2(idat.data(), &idatBytes, rows.data(), (uLong)rows.size(), pngLevel) != Z_OK) {
+            return false;
+        }
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        unsigned char ihdr[13] = {0};
+        PutBigEndian(ihdr, (uint32_t)width);
+        PutBigEndian(ihdr + 4, (uint32_t)height);
+        ihdr[8] = 8; // Bits per channel
+        ihdr[9] = 2; // Truecolour, no alpha
+        return std::fwrite(signature, 1, 8, file) == 8 && WriteChunk(file, "IHDR", ihdr, sizeof(ihdr)) &&
+               WriteChunk(file, "IDAT", idat.data(), idatBytes) && WriteChunk(file, "IEND", nullptr, 0);
+    }
+
+    static void PutBigEndian(unsigned char* out, uint32_t value) {
+        out[0] = (unsigned char)(value >> 24);
+        out[1] = (unsigned char)(value >> 16);
+        out[2] = (unsigned char)(value >> 8);
+        out[3] = (unsigned char)value;
+    }
+
+    static bool WriteChunk(std::FILE* file, const char* type, const unsigned char* data, size_t bytes) {
+        unsigned char length[4], crc[4];
+        PutBigEndian(length, (uint32_t)bytes);
+        uLong sum = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+        if (bytes > 0) {
+            sum = crc32(sum, data, (uInt)bytes);
+        }
+        PutBigEndian(crc, (uint32_t)sum);
+        return std::fwrite(length, 1, 4, file) == 4 && std::fwrite(type, 1, 4, file) == 4 &&
+               (bytes == 0 || std::fwrite(data, 1, bytes, file) == bytes) && std::fwrite(crc, 1, 4, file) == 4;
+    }
+};
@@ -2,95 +2,141 @@
 #include <GLFW/glfw3.h>
 #include <vector>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "BodyStore.h"
+#include "Engine.h"
+#include "Integrator.h"
+#include "Trajectory.h"
+#include "Window.h"
 
 float SW = 1600.0f; // Screen Width
 float SH = 900.0f; // Screen Height
 const double GravConst = 6.674e-3; // Was to small to actual change the planets visually
 
 
-class Object {
-    public:
-        double radius;
-        double mass;
-        std::vector<double> position = {0.0f, 0.0f};
-        std::vector<double> velocity = {0.0f, 0.0f};
-        
-};
-
 GLFWwindow* StartGLFW();
 void DrawCircle(float centerX, float centerY, float radius, int points);
-double GetDis(const std::vector<double>& pos1, const std::vector<double>& pos2);
 void DrawGrid(int GridSize, int CellSize);
-void PhysicsProcess(std::vector<double>& P1_POS, std::vector<double>& P1_VEL, double P1_MASS, std::vector<double>& P2_POS, std::vector<double>& P2_VEL, double P2_MASS, double deltaTime);
 
-int main() {
+// Usage: GravitySim [--solver direct|simd|bh] [--precision double|mixed] [--theta t] [--threads n]
+//                   [--integrator euler|leapfrog|yoshida] [--dt step] [--collide off|merge|bounce] [--trajectory file] [--float32]
+int main(int argc, char** argv) {
+    ForceSolver solver = ForceSolver::Pairwise;
+    ForcePrecision precision = ForcePrecision::Double; // Only used with --solver simd
+    double theta = 0.5; // Quadtree opening angle, only used with --solver bh
+    int threads = ThreadPool::HardwareThreads();
+    IntegratorKind integratorKind = IntegratorKind::Leapfrog;
+    double fixedDT = 0.02; // Simulated time per physics step
+    CollisionResponse response = CollisionResponse::Merge;
+    std::string trajectoryPath; // Every physics step is recorded here if set
+    bool trajectoryFloat32 = false;
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--solver") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "bh") == 0) {
+                solver = ForceSolver::BarnesHut;
+            } else if (std::strcmp(name, "simd") == 0) {
+                solver = ForceSolver::Simd;
+            }
+        } else if (std::strcmp(argv[a], "--precision") == 0 && a + 1 < argc) {
+            precision = (std::strcmp(argv[++a], "mixed") == 0) ? ForcePrecision::Mixed : ForcePrecision::Double;
+        } else if (std::strcmp(argv[a], "--theta") == 0 && a + 1 < argc) {
+            theta = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            threads = std::atoi(argv[++a]);
+        } else if (std::strcmp(argv[a], "--integrator") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "euler") == 0) {
+                integratorKind = IntegratorKind::Euler;
+            } else if (std::strcmp(name, "yoshida") == 0) {
+                integratorKind = IntegratorKind::Yoshida4;
+            }
+        } else if (std::strcmp(argv[a], "--dt") == 0 && a + 1 < argc) {
+            fixedDT = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--collide") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "off") == 0) {
+                response = CollisionResponse::Off;
+            } else if (std::strcmp(name, "bounce") == 0) {
+                response = CollisionResponse::Bounce;
+            }
+        } else if (std::strcmp(argv[a], "--trajectory") == 0 && a + 1 < argc) {
+            trajectoryPath = argv[++a];
+        } else if (std::strcmp(argv[a], "--float32") == 0) {
+            trajectoryFloat32 = true;
+        }
+    }
 
-    GLFWwindow* window = StartGLFW();
+    TrajectoryWriter<2> trajectory;
+    if (!trajectoryPath.empty() && !trajectory.Open(trajectoryPath, trajectoryFloat32)) {
+        exit(EXIT_FAILURE);
+    }
 
-    Object Planet1;
-    Planet1.radius = 15.0;
-    Planet1.mass = 1e6;
-    Planet1.position[0] = 1000.0;
-    Planet1.position[1] = 100.0;
-    Planet1.velocity[0] = 0.0;
-    Planet1.velocity[1] = 10.0;
-
-    Object Planet2;
-    Planet2.radius = 25.0;
-    Planet2.mass = 5e6;
-    Planet2.position[0] = 800.0;
-    Planet2.position[1] = 50.0;
-    Planet2.velocity[0] = 0.0;
-    Planet2.velocity[1] = 0.0;
-    int points = 50;
+    Engine<2> engine(GravConst, threads);
+    engine.solver = solver;
+    engine.precision = precision;
+    engine.tree.theta = theta;
+    engine.collisions.response = response;
 
+    GLFWwindow* window = StartGLFW();
 
-    std::vector<float> position = {400.0f, 600.0f};
-    std::vector<float> velocity = {0.0f, 0.0f};
+    BodyStore bodies;
+    // name, mass, radius, position, velocity (z is unused in 2D)
+    bodies.add("Planet1", 1e6, 15.0, 1000.0, 100.0, 0.0, 0.0, 10.0, 0.0);
+    bodies.add("Planet2", 5e6, 25.0, 800.0, 50.0, 0.0, 0.0, 0.0, 0.0);
+    int points = 50;
     
     double previousTime = glfwGetTime();
-
-    while (!glfwWindowShouldClose(window)) {
-        double currentTime = glfwGetTime();
-        double deltaTime = (currentTime - previousTime) * 10.0; // *5 is there to speed up the simulation
-        previousTime = currentTime;
-
-        glClear(GL_COLOR_BUFFER_BIT);
-        DrawGrid(1, 100.0f);
-
-        //DrawCircle(position[0], position[1], radius, points);
-        glColor3f(1.0f, 1.0f, 1.0f);
-        DrawCircle(Planet1.position[0], Planet1.position[1], Planet1.radius, points);
-        DrawCircle(Planet2.position[0], Planet2.position[1], Planet2.radius, points);
-
-        PhysicsProcess(Planet1.position, Planet1.velocity, Planet1.mass, Planet2.position, Planet2.velocity, Planet2.mass, deltaTime);
-
-        std::cout << "Planet1 Position: (" << Planet1.position[0] << ", " << Planet1.position[1] << ")\n";
-        std::cout << "Planet1 Velocity: (" << Planet1.velocity[0] << ", " << Planet1.velocity[1] << ")\n";
-        std::cout << "Planet2 Position: (" << Planet2.position[0] << ", " << Planet2.position[1] << ")\n";
-        std::cout << "Planet2 Velocity: (" << Planet2.velocity[0] << ", " << Planet2.velocity[1] << ")\n";
-   
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+    auto force = [&](BodyStore& b) { engine.ComputeForces(b); };
+
+    // The frame time only feeds the accumulator; physics always steps by fixedDT
+    uint64_t step = 0;
+    WithIntegrator<2>(integratorKind, fixedDT, [&](auto& integrator) {
+        while (!glfwWindowShouldClose(window)) {
+            double currentTime = glfwGetTime();
+            double deltaTime = (currentTime - previousTime) * 10.0; // *5 is there to speed up the simulation
+            previousTime = currentTime;
+
+            glClear(GL_COLOR_BUFFER_BIT);
+            DrawGrid(1, 100.0f);
+
+            //DrawCircle(position[0], position[1], radius, points);
+            glColor3f(1.0f, 1.0f, 1.0f);
+            for (size_t i = 0; i < bodies.size(); ++i) {
+                DrawCircle(bodies.x[i], bodies.y[i], bodies.radius[i], points);
+            }
+
+            // Recording only copies the bodies; the file is written on another thread
+            integrator.Advance(bodies, deltaTime, force, [&] {
+                engine.FinishStep(bodies, integrator);
+                step++;
+                if (trajectory.IsOpen()) {
+                    trajectory.Append(bodies, integrator.Time(), step);
+                }
+            });
+
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+        return 0;
+    });
+
+    if (trajectory.IsOpen()) {
+        trajectory.Close();
+        std::cout << "Trajectory: " << trajectory.FramesWritten() << " steps written to " << trajectoryPath;
+        if (trajectory.FramesDropped() > 0) {
+            std::cout << ", " << trajectory.FramesDropped() << " dropped because the disk fell behind";
+        }
+        std::cout << std::endl;
     }
-
+    glfwTerminate();
+    return 0;
 }
 
 GLFWwindow* StartGLFW(){
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW. Exiting..." << std::endl;
-        exit(EXIT_FAILURE);
-    }
-
-    GLFWwindow* window = glfwCreateWindow(1600, 900, "Gravity Sim", NULL, NULL);
-    if (!window) {
-        std::cerr << "Failed to create GLFW window. Exiting..." << std::endl;
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
-    glfwMakeContextCurrent(window);
-    glViewport(0, 0, 1600, 900);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    GLFWwindow* window = OpenSimWindow(1600, 900);
 
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -118,12 +164,6 @@ void DrawCircle(float centerX, float centerY, float radius, int points){
         glEnd();
 }
 
-double GetDis(const std::vector<double>& pos1, const std::vector<double>& pos2) {
-    double dx = pos2[0] - pos1[0];
-    double dy = pos2[1] - pos1[1];
-    return std::sqrt(dx * dx + dy * dy);
-}
-
 void DrawGrid(int GridSize, int CellSize) {
     glBegin(GL_LINES);
     glColor3f(0.3f, 0.3f, 0.3f); // Set grid color
@@ -142,26 +182,3 @@ void DrawGrid(int GridSize, int CellSize) {
 
     glEnd();
 }
-
-void PhysicsProcess(std::vector<double>& P1_POS, std::vector<double>& P1_VEL, double P1_MASS, std::vector<double>& P2_POS, std::vector<double>& P2_VEL, double P2_MASS, double deltaTime) {
-    double Distance = GetDis(P1_POS, P2_POS);
-
-    double force = (GravConst * (P1_MASS * P2_MASS)) / (Distance * Distance);
-
-    std::vector<double> forceVec{(P2_POS[0] - P1_POS[0]) / Distance, (P2_POS[1] - P1_POS[1]) / Distance};
-    forceVec[0] *= force;
-    forceVec[1] *= force;
-
-    P1_VEL[0] += (forceVec[0] / P1_MASS) * deltaTime;
-    P1_VEL[1] += (forceVec[1] / P1_MASS) * deltaTime;
-
-    P2_VEL[0] += (forceVec[0] / P2_MASS) * deltaTime;
-    P2_VEL[1] += (forceVec[1] / P2_MASS) * deltaTime;
-
-    P1_POS[0] += P1_VEL[0] * deltaTime;
-    P1_POS[1] += P1_VEL[1] * deltaTime;
-
-    P2_POS[0] += P2_VEL[0] * deltaTime;
-    P2_POS[1] += P2_VEL[1] * deltaTime;
-
-}
\ No newline at end of file
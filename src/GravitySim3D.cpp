@@ -4,9 +4,38 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include "BodyStore.h"
+#include "Engine.h"
+#include "PotentialField.h"
+#include "Integrator.h"
+#include "BlockTimestep.h"
+#include "SphereMesh.h"
+#include "Checkpoint.h"
+#include "Scene.h"
+#include "Ensemble.h"
+#include "Diagnostics.h"
+#include "Profiler.h"
+#include "TripleBuffer.h"
+#include "Window.h"
+#ifdef GRAVITYSIM_OFFSCREEN
+#include "Offscreen.h"
+#include "FrameReadback.h"
+#endif
 
 float SW = 1600.0f;
 float SH = 900.0f;
@@ -15,28 +44,73 @@ const double PI = 3.14159265358979323846;
 const double LIGHT_SPEED = 299792458.0;
 int stacks = 50;
 int slices = 50;
-bool Collision = false;
 
 const char* vertexShaderSource = R"glsl(
     #version 330 core
     layout (location = 0) in vec3 aPos;
+    layout (location = 1) in vec4 aInstance; // Sphere centre (xyz) and radius (w), one per body
+    layout (location = 2) in vec3 aColor;    // Per body colour
+    layout (location = 3) in float aHeight;  // Grid height from the CPU field, used when gridBodies is 0
+    layout (location = 4) in int aBirth;     // First trail frame of the body holding this trail slot
 
     uniform mat4 view;
     uniform mat4 projection; // Add projection matrix uniform
+    uniform vec3 color; // Add color uniform
+    uniform bool instanced; // True when drawing bodies, aPos is then on the unit sphere
+    uniform bool grid;      // True when drawing the grid, aPos is then on the flat x/z plane
+    uniform samplerBuffer gridBodyData; // Per body x, z, G * mass, softening^2
+    uniform int gridBodies;
+    uniform float curveScale;
+    uniform bool trail;              // True when drawing trails, one line strip per instance
+    uniform samplerBuffer trailData; // Ring of rows, each holding trailSlots positions
+    uniform int trailSlots;
+    uniform int trailStart;          // Row of the oldest sample drawn
+    uniform int trailCount;          // Samples drawn per trail
+    uniform int trailFrame;          // Frame of the newest sample
+
+    out vec3 vColor;
+    out float vAlpha;
+
+    // Softened potential of every body at the grid point, the same sum PotentialField does
+    float GridHeight(vec2 point) {
+        float potential = 0.0;
+        for (int i = 0; i < gridBodies; ++i) {
+            vec4 body = texelFetch(gridBodyData, i);
+            vec2 d = point - body.xy;
+            potential -= body.z * inversesqrt(dot(d, d) + body.w);
+        }
+        return potential * curveScale;
+    }
 
     void main() {
-        gl_Position = projection * view * vec4(aPos, 1.0); // Apply projection and view transformations
+        vAlpha = 1.0;
+        if (trail) {
+            // Samples from before the body appeared repeat its first one; free slots are clipped
+            int first = trailFrame - trailCount + 1;
+            int sample = max(gl_VertexID, aBirth - first);
+            vec4 point = texelFetch(trailData, (trailStart + sample) * trailSlots + gl_InstanceID);
+            vColor = aColor;
+            vAlpha = float(gl_VertexID + 1) / float(trailCount);
+            gl_Position = aBirth > trailFrame ? vec4(0.0, 0.0, 2.0, 1.0) : projection * view * vec4(point.xyz, 1.0);
+            return;
+        }
+        vec3 world = instanced ? aInstance.xyz + aPos * aInstance.w : aPos;
+        if (grid) {
+            world.y = (gridBodies > 0) ? GridHeight(aPos.xz) : aHeight;
+        }
+        vColor = instanced ? aColor : color;
+        gl_Position = projection * view * vec4(world, 1.0); // Apply projection and view transformations
     }
 )glsl";
 
 const char* fragmentShaderSource = R"glsl(
     #version 330 core
+    in vec3 vColor;
+    in float vAlpha;
     out vec4 FragColor;
 
-    uniform vec3 color; // Add color uniform
-
     void main() {
-        FragColor = vec4(color, 1.0); // Use the color uniform
+        FragColor = vec4(vColor, vAlpha);
     }
 )glsl";
 
@@ -156,7 +230,7 @@ Camera camera(glm::vec3(500.0f, 20.0f, 500.0f), glm::vec3(0.0f, 1.0f, 0.0f), -90
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
-bool paused = false;
+std::atomic<bool> paused{false}; // Read by the physics thread
 bool spacePressedLastFrame = false;
 bool cursorInWindow = true;
 bool zPressedLastFrame = false;
@@ -227,276 +301,1530 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
     camera.ProcessMouseMovement(xoffset, yoffset);
 }
 
-class Object{
+// Draws every body with one instanced call. The unit sphere mesh is uploaded once;
+// each frame only the per-body centre, radius and colour are streamed.
+class SphereRenderer {
+public:
+    struct Instance {
+        float x, y, z, radius;
+        float r, g, b;
+    };
+
+    // Needs a current GL context
+    void Init(int stackCount, int sliceCount) {
+        SphereMesh mesh = BuildSphereMesh(stackCount, sliceCount);
+        indexCount = (GLsizei)mesh.indices.size();
+
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &meshVBO);
+        glGenBuffers(1, &meshIBO);
+        glGenBuffers(1, &instanceVBO);
+        glBindVertexArray(vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, meshVBO);
+        glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(float), mesh.vertices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(unsigned int), mesh.indices.data(), GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, x));
+        glVertexAttribDivisor(1, 1);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, r));
+        glVertexAttribDivisor(2, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // colors holds colorCount RGB triples, body i gets colors[id % colorCount] so a
+    // body keeps its colour when merges or reorders move it to another index
+    void Draw(const BodyStore& bodies, const float (*colors)[3], size_t colorCount) {
+        size_t count = bodies.size();
+        if (count == 0) {
+            return;
+        }
+        instances.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            const float* color = colors[bodies.id[i] % colorCount];
+            instances[i] = {(float)bodies.x[i], (float)bodies.y[i], (float)bodies.z[i], (float)bodies.radius[i],
+                            color[0], color[1], color[2]};
+        }
+
+        // Orphan the old storage so the driver doesn't wait for last frame's draw
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glBufferData(GL_ARRAY_BUFFER, count * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(Instance), instances.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glBindVertexArray(vao);
+        glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void*)0, (GLsizei)count);
+        glBindVertexArray(0);
+    }
+
+    void Destroy() {
+        glDeleteBuffers(1, &instanceVBO);
+        glDeleteBuffers(1, &meshIBO);
+        glDeleteBuffers(1, &meshVBO);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+private:
+    GLuint vao = 0;
+    GLuint meshVBO = 0;
+    GLuint meshIBO = 0;
+    GLuint instanceVBO = 0;
+    GLsizei indexCount = 0;
+    std::vector<Instance> instances;
+};
+
+// Draws the curved grid from a flat grid mesh kept on the GPU. Up to maxGpuBodies,
+// each body's x, z, G * mass and softening go into a buffer texture every frame and
+// the vertex shader sums the potential at every grid point. Past that, the per-vertex
+// sum costs more than the CPU particle-mesh field, so PotentialField is updated instead
+// and its heights are uploaded whenever they change.
+class GridRenderer {
 public:
-    std::string name;
-    double radius;
-    double mass;
-    std::vector<double> position = {0.0f, 0.0f, 0.0f};
-    std::vector<double> velocity = {0.0f, 0.0f, 0.0f};
-
-    void drawObject() {
-        for (int i = 0; i <= stacks; ++i) {
-            float stackAngle1 = PI / 2 - i * PI / stacks;
-            float stackAngle2 = PI / 2 - (i + 1) * PI / stacks;
-
-            float xy1 = radius * cos(stackAngle1);
-            float z1 = radius * sin(stackAngle1);
-
-            float xy2 = radius * cos(stackAngle2);
-            float z2 = radius * sin(stackAngle2);
-
-            glBegin(GL_TRIANGLE_STRIP);
-            for (int j = 0; j <= slices; ++j) {
-                float sliceAngle = j * 2 * PI / slices;
-
-                float x1 = xy1 * cos(sliceAngle);
-                float y1 = xy1 * sin(sliceAngle);
-                    
-                float x2 = xy2 * cos(sliceAngle);
-                float y2 = xy2 * sin(sliceAngle);
-
-                glVertex3f(position[0] + x1, position[1] + y1, position[2] + z1);
-                glVertex3f(position[0] + x2, position[1] + y2, position[2] + z2);
+    size_t maxGpuBodies = 2048;
+
+    // Needs a current GL context and the linked shader program
+    void Init(GLuint program, const PotentialField& field) {
+        const std::vector<GridVertex>& grid = field.Vertices();
+        vertexCount = grid.size();
+        std::vector<float> flat(3 * vertexCount);
+        for (size_t v = 0; v < vertexCount; ++v) {
+            flat[3 * v + 0] = grid[v].x;
+            flat[3 * v + 1] = 0.0f;
+            flat[3 * v + 2] = grid[v].z;
+        }
+
+        // One line strip per grid line, separated by the restart index
+        std::vector<unsigned int> indices;
+        size_t samples = field.SamplesPerLine();
+        indices.reserve(vertexCount + vertexCount / samples);
+        for (size_t start = 0; start < vertexCount; start += samples) {
+            for (size_t v = start; v < start + samples; ++v) {
+                indices.push_back((unsigned int)v);
             }
-            glEnd();
+            indices.push_back((unsigned int)RestartIndex);
+        }
+        indexCount = (GLsizei)indices.size();
+
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &vertexVBO);
+        glGenBuffers(1, &heightVBO);
+        glGenBuffers(1, &ibo);
+        glBindVertexArray(vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, vertexVBO);
+        glBufferData(GL_ARRAY_BUFFER, flat.size() * sizeof(float), flat.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, heightVBO);
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void*)0);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+
+        glGenBuffers(1, &bodyBuffer);
+        glGenTextures(1, &bodyTexture);
+        glBindBuffer(GL_TEXTURE_BUFFER, bodyBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, 4 * sizeof(float), nullptr, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, bodyTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, bodyBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        gridLoc = glGetUniformLocation(program, "grid");
+        colorLoc = glGetUniformLocation(program, "color");
+        bodiesLoc = glGetUniformLocation(program, "gridBodies");
+        curveLoc = glGetUniformLocation(program, "curveScale");
+        samplerLoc = glGetUniformLocation(program, "gridBodyData");
+    }
+
+    // The field supplies softeningScale and curveScale, and the heights past maxGpuBodies
+    void Draw(const BodyStore& bodies, PotentialField& field, double G, ThreadPool* pool) {
+        size_t n = bodies.size();
+        int gpuBodies = 0;
+        if (n > 0 && n <= maxGpuBodies) {
+            UploadBodies(bodies, field.softeningScale, G);
+            gpuBodies = (int)n;
+        } else if (field.Update(bodies, G, pool) || !heightsValid) {
+            UploadHeights(field);
+        }
+
+        glUniform1i(gridLoc, 1);
+        glUniform3f(colorLoc, 0.3f, 0.3f, 0.3f);
+        glUniform1i(bodiesLoc, gpuBodies);
+        glUniform1f(curveLoc, (float)field.curveScale);
+        glUniform1i(samplerLoc, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_BUFFER, bodyTexture);
+
+        glEnable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(RestartIndex);
+        glBindVertexArray(vao);
+        glDrawElements(GL_LINE_STRIP, indexCount, GL_UNSIGNED_INT, (void*)0);
+        glBindVertexArray(0);
+        glDisable(GL_PRIMITIVE_RESTART);
+
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glUniform1i(gridLoc, 0);
+    }
+
+    void Destroy() {
+        glDeleteTextures(1, &bodyTexture);
+        glDeleteBuffers(1, &bodyBuffer);
+        glDeleteBuffers(1, &ibo);
+        glDeleteBuffers(1, &heightVBO);
+        glDeleteBuffers(1, &vertexVBO);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+private:
+    static const unsigned int RestartIndex = 0xFFFFFFFFu;
+
+    GLuint vao = 0;
+    GLuint vertexVBO = 0;
+    GLuint heightVBO = 0;
+    GLuint ibo = 0;
+    GLuint bodyBuffer = 0;
+    GLuint bodyTexture = 0;
+    GLint gridLoc = -1;
+    GLint colorLoc = -1;
+    GLint bodiesLoc = -1;
+    GLint curveLoc = -1;
+    GLint samplerLoc = -1;
+    size_t vertexCount = 0;
+    GLsizei indexCount = 0;
+    bool heightsValid = false;
+    std::vector<float> bodyData;
+    std::vector<float> heights;
+
+    // 16 bytes per body
+    void UploadBodies(const BodyStore& bodies, double softeningScale, double G) {
+        size_t n = bodies.size();
+        bodyData.resize(4 * n);
+        for (size_t i = 0; i < n; ++i) {
+            double softening = bodies.radius[i] * softeningScale;
+            bodyData[4 * i + 0] = (float)bodies.x[i];
+            bodyData[4 * i + 1] = (float)bodies.z[i];
+            bodyData[4 * i + 2] = (float)(G * bodies.mass[i]);
+            bodyData[4 * i + 3] = (float)(softening * softening);
         }
+        glBindBuffer(GL_TEXTURE_BUFFER, bodyBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, bodyData.size() * sizeof(float), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, bodyData.size() * sizeof(float), bodyData.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        heightsValid = false;
     }
 
+    void UploadHeights(const PotentialField& field) {
+        const std::vector<GridVertex>& grid = field.Vertices();
+        heights.resize(grid.size());
+        for (size_t v = 0; v < grid.size(); ++v) {
+            heights[v] = grid[v].y;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, heightVBO);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, heights.size() * sizeof(float), heights.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        heightsValid = true;
+    }
 };
 
-struct GridVertex {
-    float x, y, z;
+// Orbit trails: the last `length` positions of each body, drawn as fading line strips
+// in one instanced call. The whole history is one GPU ring buffer of rows, one row per
+// frame with a position for every trail slot. Each row is written twice, at r and at
+// r + rows, so the newest `length` rows are always one contiguous range however the
+// ring has wrapped. A frame appends one row and never moves or reallocates anything,
+// so its cost grows with the body count but not with the trail length.
+//
+// With GL 4.4 or ARB_buffer_storage the buffer stays mapped and rows are copied
+// straight into it. A fence after each draw lets Append wait until no draw from
+// SpareRows + 1 frames ago can still be reading the row it overwrites; that draw has
+// long finished, so the wait returns at once. Otherwise rows go in with
+// glBufferSubData. Slots follow body ids, so a body keeps its trail when merges or
+// reordering move it to another index.
+class TrailRenderer {
+public:
+    size_t maxBodies = 1024; // Bodies past this many get no trail
+
+    // Needs a current GL context and the linked shader program. length is in frames.
+    void Init(GLuint program, size_t bodyCount, int length) {
+        GLint maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        maxTexels = std::max(maxTexels, (GLint)65536); // The GL 3.3 minimum
+        // Both copies of every row must fit in the texture even with a single slot
+        size_t maxLength = (size_t)maxTexels / 2 - SpareRows;
+        if ((size_t)length > maxLength) {
+            std::cerr << "Trails of " << length << " frames don't fit in a texture buffer, using " << maxLength
+                      << std::endl;
+            length = (int)maxLength;
+        }
+        trailLength = length;
+        rows = length + SpareRows;
+        slots = std::min(std::max(bodyCount, (size_t)1), maxBodies);
+        slots = std::max((size_t)1, std::min(slots, (size_t)maxTexels / (2 * rows)));
+        row.assign(4 * slots, 0.0f);
+        slotData.assign(slots, {0.0f, 0.0f, 0.0f, Unused});
+        slotId.assign(slots, 0);
+        seen.assign(slots, 0);
+        usedSlots = 0;
+        frame = -1;
+
+        size_t bytes = 2 * rows * RowBytes();
+        glGenBuffers(1, &ringBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, ringBuffer);
+        persistent = HasBufferStorage();
+        if (persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_TEXTURE_BUFFER, bytes, nullptr, flags);
+            mapped = (unsigned char*)glMapBufferRange(GL_TEXTURE_BUFFER, 0, bytes, flags);
+            persistent = mapped != nullptr;
+        }
+        if (!persistent) {
+            glBufferData(GL_TEXTURE_BUFFER, bytes, nullptr, GL_DYNAMIC_DRAW);
+        }
+        glGenTextures(1, &ringTexture);
+        glBindTexture(GL_TEXTURE_BUFFER, ringTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, ringBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        // Per slot colour and birth frame, one instance each
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &slotVBO);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, slotVBO);
+        glBufferData(GL_ARRAY_BUFFER, slots * sizeof(Slot), nullptr, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Slot), (void*)offsetof(Slot, r));
+        glVertexAttribDivisor(2, 1);
+        glEnableVertexAttribArray(4);
+        glVertexAttribIPointer(4, 1, GL_INT, sizeof(Slot), (void*)offsetof(Slot, birth));
+        glVertexAttribDivisor(4, 1);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        slotsDirty = true;
+
+        trailLoc = glGetUniformLocation(program, "trail");
+        samplerLoc = glGetUniformLocation(program, "trailData");
+        slotsLoc = glGetUniformLocation(program, "trailSlots");
+        startLoc = glGetUniformLocation(program, "trailStart");
+        countLoc = glGetUniformLocation(program, "trailCount");
+        frameLoc = glGetUniformLocation(program, "trailFrame");
+    }
+
+    // Adds the bodies' current positions as the newest sample
+    void Append(const BodyStore& bodies, const float (*colors)[3], size_t colorCount) {
+        frame++;
+        size_t n = bodies.size();
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t id = bodies.id[i];
+            if (id >= slotOfId.size()) {
+                slotOfId.resize(id + 1, NoSlot);
+            }
+            uint32_t s = slotOfId[id];
+            if (s == NoSlot) {
+                s = TakeSlot(id, colors[id % colorCount]);
+                if (s == NoSlot) {
+                    continue;
+                }
+            }
+            seen[s] = frame;
+            row[4 * s + 0] = (float)bodies.x[i];
+            row[4 * s + 1] = (float)bodies.y[i];
+            row[4 * s + 2] = (float)bodies.z[i];
+        }
+        // Slots whose body was merged away or removed
+        for (size_t s = 0; s < usedSlots; ++s) {
+            if (slotData[s].birth != Unused && seen[s] != frame) {
+                slotOfId[slotId[s]] = NoSlot;
+                slotData[s].birth = Unused;
+                freeSlots.push_back((uint32_t)s);
+                slotsDirty = true;
+            }
+        }
+
+        size_t r = (size_t)(frame % (int64_t)rows);
+        if (persistent) {
+            GLsync& fence = fences[frame % FenceCount];
+            if (fence) {
+                glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+                glDeleteSync(fence);
+                fence = 0;
+            }
+            std::memcpy(mapped + r * RowBytes(), row.data(), RowBytes());
+            std::memcpy(mapped + (r + rows) * RowBytes(), row.data(), RowBytes());
+        } else {
+            glBindBuffer(GL_TEXTURE_BUFFER, ringBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, r * RowBytes(), RowBytes(), row.data());
+            glBufferSubData(GL_TEXTURE_BUFFER, (r + rows) * RowBytes(), RowBytes(), row.data());
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+    }
+
+    void Draw() {
+        if (frame < 0 || usedSlots == 0) {
+            return;
+        }
+        if (slotsDirty) {
+            glBindBuffer(GL_ARRAY_BUFFER, slotVBO);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, usedSlots * sizeof(Slot), slotData.data());
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            slotsDirty = false;
+        }
+        int count = (int)std::min<int64_t>(frame + 1, trailLength);
+        int newest = (int)(frame % (int64_t)rows) + (int)rows; // The second copy of the newest row
+        glUniform1i(trailLoc, 1);
+        glUniform1i(samplerLoc, 1);
+        glUniform1i(slotsLoc, (int)slots);
+        glUniform1i(startLoc, newest - count + 1);
+        glUniform1i(countLoc, count);
+        glUniform1i(frameLoc, (int)frame);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_BUFFER, ringTexture);
+
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDepthMask(GL_FALSE);
+        glBindVertexArray(vao);
+        glDrawArraysInstanced(GL_LINE_STRIP, 0, count, (GLsizei)usedSlots);
+        glBindVertexArray(0);
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(trailLoc, 0);
+        if (persistent) {
+            // Covers every draw of this frame's rows, including repeats while paused
+            GLsync& fence = fences[frame % FenceCount];
+            if (fence) {
+                glDeleteSync(fence);
+            }
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+
+    void Destroy() {
+        for (GLsync& fence : fences) {
+            if (fence) {
+                glDeleteSync(fence);
+                fence = 0;
+            }
+        }
+        if (persistent) {
+            glBindBuffer(GL_TEXTURE_BUFFER, ringBuffer);
+            glUnmapBuffer(GL_TEXTURE_BUFFER);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+            mapped = nullptr;
+        }
+        glDeleteTextures(1, &ringTexture);
+        glDeleteBuffers(1, &ringBuffer);
+        glDeleteBuffers(1, &slotVBO);
+        glDeleteVertexArrays(1, &vao);
+    }
+
+private:
+    struct Slot {
+        float r, g, b;
+        GLint birth; // Frame of the slot's first sample, Unused when free
+    };
+
+    static constexpr size_t SpareRows = 3; // Rows past the drawn length, written while older frames draw
+    static constexpr int64_t FenceCount = SpareRows + 1;
+    static constexpr GLint Unused = 0x7FFFFFFF; // Later than any frame, so the shader clips the slot
+    static constexpr uint32_t NoSlot = 0xFFFFFFFFu;
+
+    GLuint vao = 0;
+    GLuint slotVBO = 0;
+    GLuint ringBuffer = 0;
+    GLuint ringTexture = 0;
+    GLint trailLoc = -1;
+    GLint samplerLoc = -1;
+    GLint slotsLoc = -1;
+    GLint startLoc = -1;
+    GLint countLoc = -1;
+    GLint frameLoc = -1;
+    bool persistent = false;
+    unsigned char* mapped = nullptr;
+    GLsync fences[FenceCount] = {};
+
+    int trailLength = 0;
+    size_t rows = 0;
+    size_t slots = 0;
+    size_t usedSlots = 0; // Slots ever handed out, the instance count
+    int64_t frame = -1;   // Newest sample
+    std::vector<float> row; // The next row, 4 floats per slot
+    std::vector<Slot> slotData;
+    std::vector<uint32_t> slotId;
+    std::vector<int64_t> seen; // Last frame each slot's body was there
+    std::vector<uint32_t> slotOfId;
+    std::vector<uint32_t> freeSlots;
+    bool slotsDirty = false;
+
+    size_t RowBytes() const { return slots * 4 * sizeof(float); }
+
+    uint32_t TakeSlot(uint32_t id, const float* color) {
+        uint32_t s;
+        if (!freeSlots.empty()) {
+            s = freeSlots.back();
+            freeSlots.pop_back();
+        } else if (usedSlots < slots) {
+            s = (uint32_t)usedSlots++;
+        } else {
+            return NoSlot;
+        }
+        slotOfId[id] = s;
+        slotId[s] = id;
+        slotData[s] = {color[0], color[1], color[2], (GLint)frame};
+        slotsDirty = true;
+        return s;
+    }
+
+    static bool HasBufferStorage() {
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        if (major > 4 || (major == 4 && minor >= 4)) {
+            return true;
+        }
+        GLint extensions = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+        for (GLint e = 0; e < extensions; ++e) {
+            const char* name = (const char*)glGetStringi(GL_EXTENSIONS, e);
+            if (name && std::strcmp(name, "GL_ARB_buffer_storage") == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Command line settings shared by the window and headless modes
+struct SimOptions {
+    bool headless = false;
+    int bodyCount = 3;
+    long steps = 10000;
+    double DT = 0.001; // Fixed integration step, also used by the window
+    IntegratorKind integrator = IntegratorKind::Leapfrog;
+    ForceSolver solver = ForceSolver::Pairwise;
+    double theta = 0.5;
+    double softening = 0.0; // Plummer softening length used by the simd and tree solvers
+    SimdLevel simd = DetectSimdLevel();
+    ForcePrecision precision = ForcePrecision::Double; // Pair arithmetic of the simd solver
+    int threads = ThreadPool::HardwareThreads();
+    CollisionResponse collisions = CollisionResponse::Merge;
+    CurveKind curve = CurveKind::Hilbert; // Space-filling curve the store is kept sorted along
+    double reorderThreshold = 0.1;        // Disorder that triggers a re-sort, 0 turns reordering off
+    double restitution = 1.0;
+    double gridSoftening = 3.5; // Grid softening length as a multiple of each body's radius
+    double gridCurve = 0.5;     // Grid height = potential * gridCurve
+    bool checkForces = false;
+    bool scaling = false; // Headless only: repeat the run from 1 thread up to all threads
+    uint64_t seed = 12345; // Scene generator seed, so runs are repeatable
+    SceneKind scene = SceneKind::Planets;
+    std::string scenePath; // With SceneKind::File
+    SceneParams sceneParams;
+    std::string saveScenePath; // Initial bodies written here as a text scene
+    std::string checkpointPath; // Saved here every checkpointEvery steps and on exit
+    long checkpointEvery = 0;
+    std::string restorePath; // Resume from this checkpoint instead of generating the scene
+    std::string profileTracePath; // Profiling builds only: Chrome trace written on exit
+    double profileInterval = 2.0; // Profiling builds only: seconds between summaries
+    size_t ensembleMembers = 0;   // Above 0: integrate this many perturbed copies of the scene instead
+    EnsembleParams ensemble;
+    std::string ensembleOutPath;  // Per-member outcomes written here
+    std::string diagnosticsPath;  // Conservation samples written here, "-" for stdout
+    long diagnosticsEvery = 100;
+    bool cameraSet = false;       // Start the camera at cameraPosition, cameraYaw, cameraPitch
+    glm::vec3 cameraPosition = glm::vec3(500.0f, 20.0f, 500.0f);
+    float cameraYaw = -90.0f;
+    float cameraPitch = 0.0f;
+    std::string capturePath;      // Offscreen builds only: frames rendered to files instead of a window
+    long captureFrames = 600;
+    double captureFps = 60.0;     // Frames per simulated second
+    int captureWidth = 1600;
+    int captureHeight = 900;
+    int trailLength = 600;        // Frames of history drawn behind each body, 0 for none
+};
+
+// Solver state that lives for the whole run: the shared engine set up from the
+// options, plus the 3D view's checkpoint writer and diagnostics
+struct SolverState : Engine<3> {
+    Checkpointer checkpoints;
+    Diagnostics diagnostics;
+    bool diagnosticsOn = false;
+    std::ofstream diagnosticsFile;
+    BodyStore diagnosticsScratch; // Copy for samples the last force pass can't serve
+
+    SolverState(const SimOptions& options, int threads) : Engine<3>(GravConst, threads) {
+        solver = options.solver;
+        eps2 = options.softening * options.softening;
+        simd = options.simd;
+        precision = options.precision;
+        tree.theta = options.theta;
+        collisions.response = options.collisions;
+        collisions.restitution = options.restitution;
+        collisions.verbose = !options.headless;
+        order.curve = options.curve;
+        order.threshold = options.reorderThreshold;
+        diagnostics.every = options.diagnosticsEvery;
+    }
+
+    // Opens the --diagnostics output and takes the reference sample at run.step
+    bool StartDiagnostics(const BodyStore& bodies, const SimOptions& options, const CheckpointState& run) {
+        if (options.diagnosticsPath.empty() || options.diagnosticsEvery <= 0) {
+            return true;
+        }
+        std::ostream* out = &std::cout;
+        if (options.diagnosticsPath != "-") {
+            diagnosticsFile.open(options.diagnosticsPath);
+            if (!diagnosticsFile) {
+                std::cerr << "Could not open " << options.diagnosticsPath << " for diagnostics" << std::endl;
+                return false;
+            }
+            out = &diagnosticsFile;
+        }
+        diagnosticsOn = true;
+        diagnostics.Start(out);
+        SampleDiagnostics(bodies, run, false);
+        computePotential = diagnostics.Due(run.step + 1);
+        return true;
+    }
+
+    // Samples from the store if the step ended on a force pass, which then also filled
+    // pot because computePotential was set for it. Otherwise (euler and block steps,
+    // or a collision since) the forces are evaluated on a copy, so the run itself is
+    // never touched.
+    void SampleDiagnostics(const BodyStore& bodies, const CheckpointState& run, bool forcesCurrent) {
+        PROFILE_SCOPE("diagnostics");
+        if (forcesCurrent) {
+            diagnostics.Sample(bodies, run.step, run.time);
+            return;
+        }
+        diagnosticsScratch = bodies;
+        bool wanted = computePotential;
+        computePotential = true;
+        ComputeForces(diagnosticsScratch);
+        computePotential = wanted;
+        diagnostics.Sample(diagnosticsScratch, run.step, run.time);
+    }
+};
+
+// The grid and the bodies as the window and the capture mode both draw them, through
+// the global camera. Needs a current GL context from Init to Destroy.
+class SceneRenderer {
+public:
+    PotentialField gridField{1000, 4, 1}; // Lines every 4 units, sampled every unit
+
+    explicit SceneRenderer(const SimOptions& options) : pool(options.threads), trailLength(options.trailLength) {
+        gridField.softeningScale = options.gridSoftening;
+        gridField.curveScale = options.gridCurve;
+    }
+
+    // bodyCount sizes the trail buffer; bodies that appear later share its slots
+    void Init(size_t bodyCount) {
+        program = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
+        viewLoc = glGetUniformLocation(program, "view");
+        projLoc = glGetUniformLocation(program, "projection");
+        instancedLoc = glGetUniformLocation(program, "instanced");
+        grid.Init(program, gridField);
+        spheres.Init(stacks, slices);
+        if (trailLength > 0) {
+            trails.Init(program, bodyCount, trailLength);
+        }
+    }
+
+    // advance adds the bodies' positions to the trails, false while paused
+    void Draw(const BodyStore& bodies, float aspect, bool advance) {
+        {
+            PROFILE_SCOPE("uniforms");
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glUseProgram(program);
+            glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(camera.GetViewMatrix()));
+            glm::mat4 projection = glm::perspective(glm::radians(45.0f), aspect, 0.1f, 3000.0f); // Change last value for render distance if needed
+            glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        }
+        {
+            PROFILE_SCOPE("grid");
+            glUniform1i(instancedLoc, 0);
+            grid.Draw(bodies, gridField, GravConst, &pool);
+        }
+        {
+            PROFILE_SCOPE("spheres");
+            glUniform1i(instancedLoc, 1);
+            spheres.Draw(bodies, colors, 3);
+        }
+        if (trailLength > 0) {
+            PROFILE_SCOPE("trails");
+            if (advance) {
+                trails.Append(bodies, colors, 3);
+            }
+            glUniform1i(instancedLoc, 0);
+            trails.Draw();
+        }
+    }
+
+    void Destroy() {
+        if (trailLength > 0) {
+            trails.Destroy();
+        }
+        spheres.Destroy();
+        grid.Destroy();
+        glDeleteProgram(program);
+    }
+
+private:
+    const float colors[3][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}};
+    ThreadPool pool; // For the grid field; the solver's pool belongs to the physics
+    GridRenderer grid;
+    SphereRenderer spheres;
+    TrailRenderer trails;
+    int trailLength;
+    GLuint program = 0;
+    GLint viewLoc = -1;
+    GLint projLoc = -1;
+    GLint instancedLoc = -1;
 };
 
-double GetDis(const std::vector<double>& pos1, const std::vector<double>& pos2);
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
-void PhysicsProcess(Object& Object1, Object& Object2, double DT);
-bool CollisionDet(Object& Object1, Object& Object2);
-void DrawCurvedGrid(int GridSize, GLuint colorLoc, const std::vector<Object*>& objects);
-double CalCurve(double potential);
-double CalGravPot(double x, double z, const std::vector<Object*>& objects);
+bool BuildScene(BodyStore& bodies, const SimOptions& options);
+bool LoadScene(BodyStore& bodies, CheckpointState& run, const SimOptions& options);
+void AfterStep(BodyStore& bodies, SolverState& solver, const SimOptions& options, CheckpointState& run, bool forcesCurrent);
+void FinalCheckpoint(const BodyStore& bodies, SolverState& solver, const SimOptions& options, const CheckpointState& run);
+void WriteProfileTrace(const SimOptions& options);
+SimOptions ParseOptions(int argc, char** argv);
+double RunSteps(BodyStore& bodies, SolverState& solver, const SimOptions& options, CheckpointState& run);
+template <class Fn>
+int WithSelectedIntegrator(const SimOptions& options, SolverState& solver, const CheckpointState& run, Fn&& fn);
+void CheckForceAccuracy(BodyStore& bodies, SolverState& solver, const SimOptions& options);
+unsigned long long StateHash(const BodyStore& bodies);
+int RunHeadless(const SimOptions& options);
+int RunScaling(const SimOptions& options);
+int RunEnsemble(const SimOptions& options);
+int RunWindow(const SimOptions& options);
+int RunCapture(const SimOptions& options);
+
+int main(int argc, char** argv) {
+    SimOptions options = ParseOptions(argc, argv);
+    if (options.cameraSet) {
+        camera = Camera(options.cameraPosition, glm::vec3(0.0f, 1.0f, 0.0f), options.cameraYaw, options.cameraPitch);
+    }
+    if (options.ensembleMembers > 0) {
+        return RunEnsemble(options);
+    }
+    if (!options.capturePath.empty()) {
+        return RunCapture(options);
+    }
+    if (options.headless) {
+        return options.scaling ? RunScaling(options) : RunHeadless(options);
+    }
+    return RunWindow(options);
+}
 
-int main() {
+int RunWindow(const SimOptions& options) {
     GLFWwindow* window = StartGLFW();
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    GLuint shaderProgram = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     glEnable(GL_DEPTH_TEST);
 
-    Object Planet1;
-    Planet1.name = "Planet1";
-    Planet1.radius = 1.0;
-    Planet1.mass = 1e6;
-    Planet1.position[0] = 550.0;
-    Planet1.position[1] = 0.0;
-    Planet1.position[2] = 530.0;
-    Planet1.velocity[0] = -5.0;
-    Planet1.velocity[1] = 0.0;
-    Planet1.velocity[2] = 0.0;
-
-    Object Planet2;
-    Planet2.name = "Planet2";
-    Planet2.radius = 2.0;
-    Planet2.mass = 5e6;
-    Planet2.position[0] = 525.0;
-    Planet2.position[1] = 0.0;
-    Planet2.position[2] = 500.0;
-    Planet2.velocity[0] = -2.0;
-    Planet2.velocity[1] = 0.0;
-    Planet2.velocity[2] = 0.0;
-
-    Object Planet3;
-    Planet3.name = "Planet3";
-    Planet3.radius = 3.0;
-    Planet3.mass = 9e6;
-    Planet3.position[0] = 450.0;
-    Planet3.position[1] = 0.0;
-    Planet3.position[2] = 450.0;
-    Planet3.velocity[0] = 0.0;
-    Planet3.velocity[1] = 0.0;
-    Planet3.velocity[2] = 0.0;
-
-    double prevTime = glfwGetTime();
-
+    BodyStore bodies;
+    CheckpointState run;
+    if (!LoadScene(bodies, run, options)) {
+        glfwTerminate();
+        return 1;
+    }
+    SolverState solver(options, options.threads);
+    if (!solver.StartDiagnostics(bodies, options, run)) {
+        glfwTerminate();
+        return 1;
+    }
+    SceneRenderer scene(options);
+    scene.Init(bodies.size());
+
+    // Physics runs on its own thread in fixed steps of options.DT, paced by the wall
+    // clock, and publishes every step through a triple buffer. The window draws at its
+    // own rate, blending the last two published states, so a slow step doesn't stall
+    // input and a slow frame doesn't slow the simulation.
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point epoch = Clock::now();
+    auto wallSeconds = [&] { return std::chrono::duration<double>(Clock::now() - epoch).count(); };
+
+    TripleBuffer<BodySnapshot> states;
+    states.WriteSlot().CopyFrom(bodies, run.time, wallSeconds(), run.step);
+    states.Publish();
+    std::atomic<bool> stopPhysics{false};
+
+    std::thread physics([&] {
+        auto force = [&](BodyStore& b) { solver.ComputeForces(b); };
+        WithSelectedIntegrator(options, solver, run, [&](auto& integrator) {
+            double owed = 0.0; // Wall time not yet simulated
+            double last = wallSeconds();
+            // Pause and quit are checked between steps, so they wait for one step at most
+            while (!stopPhysics) {
+                double now = wallSeconds();
+                if (paused) {
+                    last = now;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                    continue;
+                }
+                owed += now - last;
+                last = now;
+                if (owed < integrator.dt) {
+                    std::this_thread::sleep_for(std::chrono::duration<double>(integrator.dt - owed));
+                    continue;
+                }
+
+                {
+                    PROFILE_SCOPE("step");
+                    integrator.Step(bodies, force);
+                    // Collisions are resolved after every step; only the bodies involved are affected
+                    solver.FinishStep(bodies, integrator);
+                    run.time = integrator.Time();
+                    AfterStep(bodies, solver, options, run, integrator.ForcesCurrent());
+                }
+                {
+                    PROFILE_SCOPE("publish");
+                    states.WriteSlot().CopyFrom(bodies, run.time, wallSeconds(), run.step);
+                    states.Publish();
+                }
+
+                // Beyond this many steps behind, drop time instead of spiralling
+                owed -= integrator.dt;
+                if (owed >= integrator.maxStepsPerAdvance * integrator.dt) {
+                    owed = 0.0;
+                }
+            }
+            return 0;
+        });
+    });
+
+    BodySnapshot snapshots[2]; // Previous and latest published states
+    int latest = 0;
+    BodyStore view; // What is drawn this frame
+    double lastSummary = glfwGetTime();
     while (!glfwWindowShouldClose(window)) {
+        PROFILE_SCOPE("frame");
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
-
         double CT = glfwGetTime();
-        double DT = (CT - prevTime); // *5 to speed up the sim
-        prevTime = CT;
-        
-
-        processInput(window);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glUseProgram(shaderProgram);
-        GLuint viewLoc = glGetUniformLocation(shaderProgram, "view");
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(camera.GetViewMatrix()));
-        GLuint projLoc = glGetUniformLocation(shaderProgram, "projection");
-        glm::mat4 projection = glm::perspective(glm::radians(45.0f), SW / SH, 0.1f, 3000.0f); // Change last value for render distance if needed
-        glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-        GLuint colorLoc = glGetUniformLocation(shaderProgram, "color");
-        std::vector<Object*> objects = {&Planet1, &Planet2, &Planet3};
-        DrawCurvedGrid(4.0f, colorLoc, objects);
-
-        glUniform3f(colorLoc, 1.0f, 0.0f, 0.0f);
-        Planet1.drawObject();
-        glUniform3f(colorLoc, 0.0f, 1.0f, 0.0f);
-        Planet2.drawObject();
-        glUniform3f(colorLoc, 1.0f, 1.0f, 0.0f);
-        Planet3.drawObject();
-
-        if (CollisionDet(Planet1, Planet2) || CollisionDet(Planet1, Planet3) || CollisionDet(Planet2, Planet3)) {
-            Collision = true;
-        }
-
-
-        if (!paused && !Collision) {
-            PhysicsProcess(Planet1, Planet2, DT);
-            PhysicsProcess(Planet1, Planet3, DT);
-            PhysicsProcess(Planet2, Planet3, DT);
-        } 
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        {
+            PROFILE_SCOPE("input");
+            processInput(window);
+        }
+        {
+            PROFILE_SCOPE("interpolate");
+            if (states.Update()) {
+                const BodySnapshot& published = states.ReadSlot();
+                latest ^= 1;
+                snapshots[latest].CopyFrom(published.bodies, published.time, published.wall, published.step);
+            }
+            InterpolateSnapshots(snapshots[latest ^ 1], snapshots[latest], wallSeconds(), view);
+        }
+        scene.Draw(view, SW / SH, !paused);
+        {
+            PROFILE_SCOPE("swap");
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+
+        // Rolling summary on stdout, frame times in the title bar
+        if (Profiler::Enabled && CT - lastSummary >= options.profileInterval) {
+            Profiler& profiler = Profiler::Instance();
+            profiler.PrintSummary(std::cout, options.profileInterval);
+            double p50 = 0.0, p99 = 0.0;
+            if (profiler.PhasePercentiles("frame", options.profileInterval, p50, p99)) {
+                std::ostringstream title;
+                title << std::fixed << std::setprecision(2) << "Gravity Sim - frame p50 " << p50 << " ms, p99 " << p99 << " ms";
+                glfwSetWindowTitle(window, title.str().c_str());
+            }
+            lastSummary = CT;
+        }
     }
 
-    glDeleteProgram(shaderProgram);
+    stopPhysics = true;
+    physics.join();
+    FinalCheckpoint(bodies, solver, options, run);
+    WriteProfileTrace(options);
+    scene.Destroy();
     glfwTerminate();
     return 0;
 }
 
-GLFWwindow* StartGLFW(){
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW. Exiting..." << std::endl;
-        exit(EXIT_FAILURE);
+// Renders the run straight to image files with no window, on an EGL context that
+// needs no display. Physics is stepped in lockstep with the frames, as many steps as
+// one frame covers at options.captureFps, so the output plays at the same speed as
+// the window runs but is produced as fast as the machine can go. Readback goes through
+// a ring of pixel buffers and encoding through FrameWriter's threads, so the loop only
+// steps, draws and starts a copy.
+int RunCapture(const SimOptions& options) {
+#ifdef GRAVITYSIM_OFFSCREEN
+    FrameFormat format = FrameFormat::Png;
+    const std::string& path = options.capturePath;
+    auto endsWith = [&](const char* suffix) {
+        size_t n = std::strlen(suffix);
+        return path.size() >= n && path.compare(path.size() - n, n, suffix) == 0;
+    };
+    if (endsWith(".ppm")) {
+        format = FrameFormat::Ppm;
+    } else if (endsWith(".rgb") || endsWith(".raw")) {
+        format = FrameFormat::Raw;
     }
 
-    GLFWwindow* window = glfwCreateWindow(1600, 900, "Gravity Sim", NULL, NULL);
-    if (!window) {
-        std::cerr << "Failed to create GLFW window. Exiting..." << std::endl;
-        glfwTerminate();
-        exit(EXIT_FAILURE);
+    OffscreenContext context;
+    if (!context.Create(options.captureWidth, options.captureHeight)) {
+        return 1;
+    }
+    glEnable(GL_DEPTH_TEST);
+    BodyStore bodies;
+    CheckpointState run;
+    if (!LoadScene(bodies, run, options)) {
+        return 1;
+    }
+    SolverState solver(options, options.threads);
+    SceneRenderer scene(options);
+    scene.Init(bodies.size());
+    FrameReadback readback;
+    readback.Init(options.captureWidth, options.captureHeight);
+    FrameWriter writer;
+    if (!writer.Open(path, format, options.captureWidth, options.captureHeight, std::max(1, options.threads / 2))) {
+        return 1;
     }
-    glfwMakeContextCurrent(window);
-    glViewport(0, 0, 1600, 900);
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(45.0, SW / SH, 0.1, 100.0);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    long stepsPerFrame = std::max(1L, std::lround(1.0 / (options.captureFps * options.DT)));
+    std::cout << "Capturing " << options.captureFrames << " frames of " << options.captureWidth << "x" << options.captureHeight
+              << " (" << FrameFormatName(format) << ") to " << path << ", " << stepsPerFrame << " steps per frame, "
+              << bodies.size() << " bodies, renderer " << context.Renderer() << std::endl;
+    if (!solver.StartDiagnostics(bodies, options, run)) {
+        return 1;
+    }
 
-    if (glewInit() != GLEW_OK) {
-        std::cerr << "Failed to initialize GLEW. Exiting..." << std::endl;
-        exit(EXIT_FAILURE);
+    auto start = std::chrono::steady_clock::now();
+    auto force = [&](BodyStore& b) { solver.ComputeForces(b); };
+    WithSelectedIntegrator(options, solver, run, [&](auto& integrator) {
+        for (long frame = 0; frame < options.captureFrames; ++frame) {
+            if (frame > 0) {
+                PROFILE_SCOPE("step");
+                for (long s = 0; s < stepsPerFrame; ++s) {
+                    integrator.Step(bodies, force);
+                    solver.FinishStep(bodies, integrator);
+                    run.time = integrator.Time();
+                    AfterStep(bodies, solver, options, run, integrator.ForcesCurrent());
+                }
+            }
+            scene.Draw(bodies, (float)options.captureWidth / (float)options.captureHeight, true);
+            PROFILE_SCOPE("readback");
+            readback.Capture(writer);
+        }
+        return 0;
+    });
+    readback.Flush(writer);
+    writer.Close();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds <= 0.0) {
+        seconds = 1e-9;
     }
 
-    return window;
+    double videoSeconds = options.captureFrames / options.captureFps;
+    std::cout << "Captured " << writer.FramesWritten() << " frames in " << seconds << " s: "
+              << writer.FramesWritten() / seconds << " frames/s, " << videoSeconds / seconds << "x real time at "
+              << options.captureFps << " fps (" << readback.WaitSeconds() << " s waiting on readback)" << std::endl;
+    if (format == FrameFormat::Raw) {
+        std::cout << "Encode with: ffmpeg -f rawvideo -pix_fmt rgb24 -s " << options.captureWidth << "x"
+                  << options.captureHeight << " -r " << options.captureFps << " -i " << path << " out.mp4" << std::endl;
+    }
+    FinalCheckpoint(bodies, solver, options, run);
+    if (Profiler::Enabled) {
+        Profiler::Instance().PrintSummary(std::cout, seconds + 1.0);
+    }
+    WriteProfileTrace(options);
+    readback.Destroy();
+    scene.Destroy();
+    return writer.FramesFailed() == 0 ? 0 : 1;
+#else
+    (void)options;
+    std::cerr << "--capture needs a build with -DGRAVITYSIM_OFFSCREEN (Linux, link with -lEGL -lz)" << std::endl;
+    return 1;
+#endif
 }
 
-void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
-    glViewport(0, 0, width, height);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(45.0, (float)width / (float)height, 0.1, 100.0);
-    glMatrixMode(GL_MODELVIEW);
-}
+// Starts from options.restorePath if set, otherwise generates the scene. Fills run
+// with the time and step to carry on from.
+bool LoadScene(BodyStore& bodies, CheckpointState& run, const SimOptions& options) {
+    run = CheckpointState();
+    run.integrator = options.integrator;
+    run.dt = options.DT;
+    run.seed = options.seed;
+    if (options.restorePath.empty()) {
+        return BuildScene(bodies, options);
+    }
 
-double GetDis(const std::vector<double>& pos1, const std::vector<double>& pos2) {
-    double dx = pos2[0] - pos1[0];
-    double dy = pos2[1] - pos1[1];
-    double dz = pos2[2] - pos1[2];
-    return std::sqrt(dx * dx + dy * dy + dz * dz);
+    CheckpointState saved;
+    if (!LoadCheckpoint(options.restorePath, bodies, saved)) {
+        return false;
+    }
+    run.time = saved.time;
+    run.step = saved.step;
+    run.seed = saved.seed;
+    std::cout << "Resuming " << options.restorePath << ": " << bodies.size() << " bodies at step " << saved.step
+              << ", t = " << saved.time << std::endl;
+    // The command line decides how to carry on, so a run can resume with other settings
+    if (saved.integrator != options.integrator || saved.dt != options.DT) {
+        std::cout << "Note: checkpoint was written with integrator = " << IntegratorName(saved.integrator)
+                  << ", dt = " << saved.dt << "; continuing with " << IntegratorName(options.integrator)
+                  << ", dt = " << options.DT << std::endl;
+    }
+    return true;
 }
 
-void PhysicsProcess(Object& Object1, Object& Object2, double DT) {
-    double Distance = GetDis(Object1.position, Object2.position);
+// The starting bodies selected by --scene: the planets and moons, a scene file or a
+// generated distribution of options.bodyCount bodies
+bool BuildScene(BodyStore& bodies, const SimOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    if (options.scene == SceneKind::Planets) {
+        GeneratePlanets(bodies, options.bodyCount, options.seed, GravConst);
+    } else if (options.scene == SceneKind::File) {
+        if (!LoadSceneFile(options.scenePath, bodies)) {
+            return false;
+        }
+    } else {
+        SceneParams params = options.sceneParams;
+        params.G = GravConst;
+        ThreadPool pool(options.threads);
+        GenerateScene(bodies, options.scene, (size_t)std::max(options.bodyCount, 0), params, options.seed, pool);
+    }
+    if (options.scene != SceneKind::Planets) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Scene " << (options.scene == SceneKind::File ? options.scenePath : SceneKindName(options.scene))
+                  << ": " << bodies.size() << " bodies in " << seconds << " s" << std::endl;
+    }
+    if (!options.saveScenePath.empty() && !SaveSceneText(options.saveScenePath, bodies)) {
+        return false;
+    }
+    return true;
+}
 
-    double force = (GravConst * (Object1.mass * Object2.mass)) / (Distance * Distance);
-    
-    std::vector<double> forceVec = {(Object2.position[0] - Object1.position[0]) / Distance, (Object2.position[1] - Object1.position[1]) / Distance, (Object2.position[2] - Object1.position[2]) / Distance};
-    forceVec[0] *= force;
-    forceVec[1] *= force;
-    forceVec[2] *= force;
+// Bookkeeping after every physics step: counts it and starts a periodic checkpoint
+void AfterStep(BodyStore& bodies, SolverState& solver, const SimOptions& options, CheckpointState& run, bool forcesCurrent) {
+    run.step++;
+    if (solver.diagnosticsOn) {
+        if (solver.diagnostics.Due(run.step)) {
+            solver.SampleDiagnostics(bodies, run, forcesCurrent);
+        }
+        // Only the step before a sample pays for the potential
+        solver.computePotential = solver.diagnostics.Due(run.step + 1);
+    }
+    if (options.checkpointEvery > 0 && !options.checkpointPath.empty() && run.step % options.checkpointEvery == 0) {
+        solver.checkpoints.Save(options.checkpointPath, bodies, run);
+    }
+}
 
-    Object1.velocity[0] += (forceVec[0] / Object1.mass) * DT;
-    Object1.velocity[1] += (forceVec[1] / Object1.mass) * DT;
-    Object1.velocity[2] += (forceVec[2] / Object1.mass) * DT;
+// Saves the final state and waits for it, so the run can be resumed exactly here
+void FinalCheckpoint(const BodyStore& bodies, SolverState& solver, const SimOptions& options, const CheckpointState& run) {
+    if (options.checkpointPath.empty()) {
+        return;
+    }
+    solver.checkpoints.Wait();
+    solver.checkpoints.Save(options.checkpointPath, bodies, run);
+    if (solver.checkpoints.Wait()) {
+        std::cout << "Checkpoint: step " << run.step << " saved to " << options.checkpointPath << " ("
+                  << solver.checkpoints.Written() << " written";
+        if (solver.checkpoints.Skipped() > 0) {
+            std::cout << ", " << solver.checkpoints.Skipped() << " skipped while the previous one was saving";
+        }
+        std::cout << ")" << std::endl;
+    }
+}
 
-    Object2.velocity[0] -= (forceVec[0] / Object2.mass) * DT;
-    Object2.velocity[1] -= (forceVec[1] / Object2.mass) * DT;
-    Object2.velocity[2] -= (forceVec[2] / Object2.mass) * DT;
+void WriteProfileTrace(const SimOptions& options) {
+    if (options.profileTracePath.empty()) {
+        return;
+    }
+    if (!Profiler::Enabled) {
+        std::cerr << "--profile-trace needs a build with -DGRAVITYSIM_PROFILE" << std::endl;
+    } else if (Profiler::Instance().WriteChromeTrace(options.profileTracePath)) {
+        std::cout << "Profile trace written to " << options.profileTracePath << std::endl;
+    } else {
+        std::cerr << "Could not write " << options.profileTracePath << std::endl;
+    }
+}
 
-    Object1.position[0] += Object1.velocity[0] * DT;
-    Object1.position[1] += Object1.velocity[1] * DT;
-    Object1.position[2] += Object1.velocity[2] * DT;
+// Usage: GravitySim3D [--headless] [bodies] [steps] [dt] [--solver direct|simd|bh] [--theta t]
+//                     [--integrator euler|leapfrog|yoshida|block] [--collide off|merge|bounce]
+//                     [--restitution e] [--softening eps] [--grid-softening s] [--grid-curve c]
+//                     [--simd scalar|avx2|avx512] [--precision double|mixed] [--threads n] [--check] [--scaling] [--seed s]
+//                     [--reorder hilbert|morton|off] [--reorder-threshold f]
+//                     [--checkpoint file] [--checkpoint-every steps] [--restore file]
+//                     [--profile-trace file.json] [--profile-interval seconds]
+//                     [--scene planets|plummer|disc|collapse|file] [--scene-mass m] [--scene-scale r]
+//                     [--central-mass m] [--save-scene file]
+//                     [--ensemble members] [--ensemble-dv f] [--ensemble-dm f] [--escape-radius r] [--ensemble-out file]
+//                     [--diagnostics file|-] [--diagnostics-every steps] [--camera x,y,z,yaw,pitch]
+//                     [--capture frame_%05d.png|.ppm|file.rgb] [--capture-frames n] [--capture-fps f] [--capture-size WxH]
+//                     [--trails frames]
+SimOptions ParseOptions(int argc, char** argv) {
+    SimOptions options;
+    int positional = 0;
+
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--headless") == 0) {
+            options.headless = true;
+        } else if (std::strcmp(argv[a], "--solver") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "bh") == 0) {
+                options.solver = ForceSolver::BarnesHut;
+            } else if (std::strcmp(name, "simd") == 0) {
+                options.solver = ForceSolver::Simd;
+            } else {
+                options.solver = ForceSolver::Pairwise;
+            }
+        } else if (std::strcmp(argv[a], "--integrator") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "euler") == 0) {
+                options.integrator = IntegratorKind::Euler;
+            } else if (std::strcmp(name, "yoshida") == 0) {
+                options.integrator = IntegratorKind::Yoshida4;
+            } else if (std::strcmp(name, "block") == 0) {
+                options.integrator = IntegratorKind::Block;
+            } else {
+                options.integrator = IntegratorKind::Leapfrog;
+            }
+        } else if (std::strcmp(argv[a], "--collide") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "off") == 0) {
+                options.collisions = CollisionResponse::Off;
+            } else if (std::strcmp(name, "bounce") == 0) {
+                options.collisions = CollisionResponse::Bounce;
+            } else {
+                options.collisions = CollisionResponse::Merge;
+            }
+        } else if (std::strcmp(argv[a], "--restitution") == 0 && a + 1 < argc) {
+            options.restitution = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--softening") == 0 && a + 1 < argc) {
+            options.softening = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--grid-softening") == 0 && a + 1 < argc) {
+            options.gridSoftening = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--grid-curve") == 0 && a + 1 < argc) {
+            options.gridCurve = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--simd") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            SimdLevel wanted = SimdLevel::Scalar;
+            if (std::strcmp(name, "avx512") == 0) {
+                wanted = SimdLevel::AVX512;
+            } else if (std::strcmp(name, "avx2") == 0) {
+                wanted = SimdLevel::AVX2;
+            }
+            if (wanted > options.simd) {
+                std::cerr << "CPU does not support " << name << ", using " << SimdLevelName(options.simd) << std::endl;
+            } else {
+                options.simd = wanted;
+            }
+        } else if (std::strcmp(argv[a], "--precision") == 0 && a + 1 < argc) {
+            options.precision = (std::strcmp(argv[++a], "mixed") == 0) ? ForcePrecision::Mixed : ForcePrecision::Double;
+        } else if (std::strcmp(argv[a], "--reorder") == 0 && a + 1 < argc) {
+            const char* curve = argv[++a];
+            if (std::strcmp(curve, "off") == 0) {
+                options.reorderThreshold = 0.0;
+            } else {
+                options.curve = (std::strcmp(curve, "morton") == 0) ? CurveKind::Morton : CurveKind::Hilbert;
+            }
+        } else if (std::strcmp(argv[a], "--reorder-threshold") == 0 && a + 1 < argc) {
+            options.reorderThreshold = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--theta") == 0 && a + 1 < argc) {
+            options.theta = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            options.threads = std::atoi(argv[++a]);
+            if (options.threads < 1) {
+                options.threads = 1;
+            }
+        } else if (std::strcmp(argv[a], "--check") == 0) {
+            options.checkForces = true;
+        } else if (std::strcmp(argv[a], "--scaling") == 0) {
+            options.scaling = true;
+        } else if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc) {
+            options.scene = ParseSceneKind(argv[++a]);
+            if (options.scene == SceneKind::File) {
+                options.scenePath = argv[a];
+            }
+        } else if (std::strcmp(argv[a], "--scene-mass") == 0 && a + 1 < argc) {
+            options.sceneParams.totalMass = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--scene-scale") == 0 && a + 1 < argc) {
+            options.sceneParams.scale = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--central-mass") == 0 && a + 1 < argc) {
+            options.sceneParams.centralMass = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--save-scene") == 0 && a + 1 < argc) {
+            options.saveScenePath = argv[++a];
+        } else if (std::strcmp(argv[a], "--ensemble") == 0 && a + 1 < argc) {
+            options.ensembleMembers = std::strtoull(argv[++a], nullptr, 10);
+        } else if (std::strcmp(argv[a], "--ensemble-dv") == 0 && a + 1 < argc) {
+            options.ensemble.velocitySpread = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--ensemble-dm") == 0 && a + 1 < argc) {
+            options.ensemble.massSpread = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--escape-radius") == 0 && a + 1 < argc) {
+            options.ensemble.escapeRadius = std::atof(argv[++a]);
+        } else if (std::strcmp(argv[a], "--ensemble-out") == 0 && a + 1 < argc) {
+            options.ensembleOutPath = argv[++a];
+        } else if (std::strcmp(argv[a], "--diagnostics") == 0 && a + 1 < argc) {
+            options.diagnosticsPath = argv[++a];
+        } else if (std::strcmp(argv[a], "--diagnostics-every") == 0 && a + 1 < argc) {
+            options.diagnosticsEvery = std::atol(argv[++a]);
+        } else if (std::strcmp(argv[a], "--camera") == 0 && a + 1 < argc) {
+            glm::vec3& at = options.cameraPosition;
+            if (std::sscanf(argv[++a], "%f,%f,%f,%f,%f", &at.x, &at.y, &at.z, &options.cameraYaw, &options.cameraPitch) >= 3) {
+                options.cameraSet = true;
+            } else {
+                std::cerr << "Ignoring --camera " << argv[a] << ", expected x,y,z[,yaw,pitch]" << std::endl;
+            }
+        } else if (std::strcmp(argv[a], "--trails") == 0 && a + 1 < argc) {
+            options.trailLength = std::max(0, std::atoi(argv[++a]));
+        } else if (std::strcmp(argv[a], "--capture") == 0 && a + 1 < argc) {
+            options.capturePath = argv[++a];
+        } else if (std::strcmp(argv[a], "--capture-frames") == 0 && a + 1 < argc) {
+            options.captureFrames = std::atol(argv[++a]);
+        } else if (std::strcmp(argv[a], "--capture-fps") == 0 && a + 1 < argc) {
+            options.captureFps = std::atof(argv[++a]);
+            if (!(options.captureFps > 0.0)) {
+                options.captureFps = 60.0;
+            }
+        } else if (std::strcmp(argv[a], "--capture-size") == 0 && a + 1 < argc) {
+            int w = 0, h = 0;
+            if (std::sscanf(argv[++a], "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+                options.captureWidth = w;
+                options.captureHeight = h;
+            } else {
+                std::cerr << "Ignoring --capture-size " << argv[a] << ", expected WxH" << std::endl;
+            }
+        } else if (std::strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            options.seed = std::strtoull(argv[++a], nullptr, 10);
+        } else if (std::strcmp(argv[a], "--checkpoint") == 0 && a + 1 < argc) {
+            options.checkpointPath = argv[++a];
+        } else if (std::strcmp(argv[a], "--checkpoint-every") == 0 && a + 1 < argc) {
+            options.checkpointEvery = std::atol(argv[++a]);
+        } else if (std::strcmp(argv[a], "--restore") == 0 && a + 1 < argc) {
+            options.restorePath = argv[++a];
+        } else if (std::strcmp(argv[a], "--profile-trace") == 0 && a + 1 < argc) {
+            options.profileTracePath = argv[++a];
+        } else if (std::strcmp(argv[a], "--profile-interval") == 0 && a + 1 < argc) {
+            options.profileInterval = std::atof(argv[++a]);
+        } else if (positional == 0) {
+            options.bodyCount = std::atoi(argv[a]);
+            positional++;
+        } else if (positional == 1) {
+            options.steps = std::atol(argv[a]);
+            positional++;
+        } else if (positional == 2) {
+            options.DT = std::atof(argv[a]);
+            positional++;
+        } else {
+            std::cerr << "Ignoring unknown argument " << argv[a] << std::endl;
+        }
+    }
 
-    Object2.position[0] += Object2.velocity[0] * DT;
-    Object2.position[1] += Object2.velocity[1] * DT;
-    Object2.position[2] += Object2.velocity[2] * DT;
+    return options;
 }
 
-bool CollisionDet(Object& Object1, Object& Object2) {
-    double Distance = GetDis(Object1.position, Object2.position);
-    bool Collision = false;
+// Calls fn(integrator) with the integrator chosen by options, starting at run.time.
+// Block steps use their own direct summation with jerk, so the solver choice only
+// applies to the others.
+template <class Fn>
+int WithSelectedIntegrator(const SimOptions& options, SolverState& solver, const CheckpointState& run, Fn&& fn) {
+    if (options.integrator == IntegratorKind::Block) {
+        BlockIntegrator<3> integrator(options.DT, GravConst, options.softening * options.softening, &solver.pool);
+        integrator.SetTime(run.time);
+        return fn(integrator);
+    }
+    return WithIntegrator<3>(options.integrator, options.DT, [&](auto& integrator) {
+        integrator.SetTime(run.time);
+        return fn(integrator);
+    });
+}
 
-    if (Distance <= (Object1.radius + Object2.radius)) {
-        std::cout << "Collision between " << Object1.name << " and " << Object2.name << std::endl;
-        Object1.velocity = {0.0f, 0.0f, 0.0f};
-        Object2.velocity = {0.0f, 0.0f, 0.0f};
-        Collision = true;
+// Takes options.steps fixed steps of options.DT with the selected integrator,
+// carrying on from run. Returns the number of interactions evaluated.
+double RunSteps(BodyStore& bodies, SolverState& solver, const SimOptions& options, CheckpointState& run) {
+    double interactions = 0.0;
+    auto force = [&](BodyStore& b) { interactions += solver.ComputeForces(b); };
+
+    if (options.integrator == IntegratorKind::Block) {
+        BlockIntegrator<3> integrator(options.DT, GravConst, options.softening * options.softening, &solver.pool);
+        integrator.SetTime(run.time);
+        for (long step = 0; step < options.steps; ++step) {
+            integrator.Step(bodies, force);
+            solver.FinishStep(bodies, integrator);
+            run.time = integrator.Time();
+            AfterStep(bodies, solver, options, run, integrator.ForcesCurrent());
+        }
+        double evaluations = (double)integrator.ForceEvaluations();
+        if (!options.scaling) {
+            std::cout << "Block steps: " << integrator.SubSteps() << " sub-steps, deepest level " << integrator.DeepestLevel()
+                      << ", " << evaluations << " body force evaluations, "
+                      << integrator.SharedStepEvaluations() / (evaluations > 0.0 ? evaluations : 1.0)
+                      << "x fewer than stepping every body at the smallest dt" << std::endl;
+        }
+        return evaluations * (double)(bodies.size() > 0 ? bodies.size() - 1 : 0);
     }
-    return Collision;
+
+    WithIntegrator<3>(options.integrator, options.DT, [&](auto& integrator) {
+        integrator.SetTime(run.time);
+        for (long step = 0; step < options.steps; ++step) {
+            integrator.Step(bodies, force);
+            solver.FinishStep(bodies, integrator);
+            run.time = integrator.Time();
+            AfterStep(bodies, solver, options, run, integrator.ForcesCurrent());
+        }
+        return 0;
+    });
+    return interactions;
 }
 
-double CalGravPot(double x, double z, const std::vector<Object*>& objects){
-    double potential = 0.0;
+// Compares the selected solver's accelerations with the exact all-pairs result for
+// the current state
+void CheckForceAccuracy(BodyStore& bodies, SolverState& solver, const SimOptions& options) {
+    size_t count = bodies.size();
+    double eps2 = options.softening * options.softening;
+    std::vector<double> exact(3 * count);
+
+    DirectAccelerations<3>(bodies, GravConst, eps2);
+    for (int k = 0; k < 3; ++k) {
+        std::copy(bodies.acc(k), bodies.acc(k) + count, exact.begin() + k * count);
+    }
+    double* ref[3] = {exact.data(), exact.data() + count, exact.data() + 2 * count};
+
+    if (options.solver == ForceSolver::Pairwise) {
+        std::cout << "Pairwise solver is the exact reference, nothing to check" << std::endl;
+        return;
+    }
+    solver.ComputeForces(bodies);
+    if (options.solver == ForceSolver::BarnesHut) {
+        std::cout << "Barnes-Hut (theta = " << options.theta << ", " << solver.tree.NodeCount() << " nodes)";
+    } else {
+        std::cout << "SIMD direct (" << SimdLevelName(options.simd) << ", " << ForcePrecisionName(options.precision) << ")";
+    }
 
-    for (const auto& obj : objects) {
-        double dx = x - obj->position[0];
-        double dz = z - obj->position[2];
-        double distance = std::sqrt(dx * dx + dz * dz);
+    double rmsError = 0.0;
+    double maxError = 0.0;
+    AccelerationError<3>(bodies, ref, rmsError, maxError);
+    std::cout << " vs direct: rms relative error " << rmsError << ", max " << maxError << std::endl;
+}
 
-        double softening = obj->radius * 3.5; // Change last value to increase or decrease curve of grid(less or more pointy)
+// Steps the system at a fixed DT with no window or GL context and reports throughput.
+int RunHeadless(const SimOptions& options) {
+    BodyStore bodies;
+    CheckpointState run;
+    if (!LoadScene(bodies, run, options)) {
+        return 1;
+    }
+    SolverState solver(options, options.threads);
+    size_t count = bodies.size();
+    long steps = options.steps;
+
+    std::cout << "Headless run: " << count << " bodies, " << steps << " steps, dt = " << options.DT
+              << ", solver = " << ForceSolverName(options.solver, options.simd) << ", integrator = " << IntegratorName(options.integrator)
+              << ", threads = " << solver.pool.size() << std::endl;
+    if (options.solver == ForceSolver::Simd && options.precision == ForcePrecision::Mixed) {
+        std::cout << "Mixed precision: float32 pairs, double sums, origin at the centre of mass" << std::endl;
+    }
+    if (!solver.StartDiagnostics(bodies, options, run)) {
+        return 1;
+    }
+    double startEnergy = 0.0;
+    if (options.checkForces) {
+        CheckForceAccuracy(bodies, solver, options);
+        startEnergy = TotalEnergy<3>(bodies, GravConst, options.softening * options.softening);
+    }
 
-        double smoothedDist = std::sqrt(distance * distance + softening * softening);
+    auto start = std::chrono::steady_clock::now();
+    double interactions = RunSteps(bodies, solver, options, run);
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    if (seconds <= 0.0) {
+        seconds = 1e-9;
+    }
 
-        double phi = -(GravConst * obj->mass) / smoothedDist;
-        potential += phi;
+    std::cout << "Elapsed: " << seconds << " s" << std::endl;
+    std::cout << "Steps/sec: " << steps / seconds << std::endl;
+    std::cout << "Interactions/sec: " << interactions / seconds << std::endl;
+    if (options.solver == ForceSolver::Simd) {
+        std::cout << "GFLOP/s: " << interactions * FlopsPerInteraction / seconds * 1e-9 << std::endl;
+    }
+    if (options.checkForces && startEnergy != 0.0) {
+        double endEnergy = TotalEnergy<3>(bodies, GravConst, options.softening * options.softening);
+        std::cout << "Relative energy error: " << std::abs((endEnergy - startEnergy) / startEnergy) << std::endl;
     }
+    if (options.collisions != CollisionResponse::Off) {
+        std::cout << "Collisions (" << CollisionResponseName(options.collisions) << "): "
+                  << solver.collisions.TotalCollisions() << ", " << bodies.size() << " bodies left" << std::endl;
+    }
+    if (solver.diagnosticsOn) {
+        const DiagnosticsSample& last = solver.diagnostics.Latest();
+        std::cout << "Diagnostics at step " << last.step << ": energy error " << last.energyError << ", virial ratio "
+                  << last.virialRatio << ", momentum error " << last.momentumError << ", centre of mass drift "
+                  << last.comDrift << std::endl;
+    }
+    if (solver.order.reorders > 0) {
+        std::cout << "Reordered along the " << CurveKindName(options.curve) << " curve " << solver.order.reorders << " times" << std::endl;
+    }
+    // The first body of the scene, wherever reordering has moved it
+    size_t first = std::find(bodies.id.begin(), bodies.id.end(), 0u) - bodies.id.begin();
+    if (first < bodies.size()) {
+        std::cout << bodies.name[first] << " Position: (" << bodies.x[first] << ", " << bodies.y[first] << ", " << bodies.z[first] << ")" << std::endl;
+    }
+    std::cout << "State hash: " << std::hex << StateHash(bodies) << std::dec << std::endl;
+    FinalCheckpoint(bodies, solver, options, run);
+    if (Profiler::Enabled) {
+        Profiler::Instance().PrintSummary(std::cout, seconds + 1.0);
+    }
+    WriteProfileTrace(options);
 
-    return potential;
+    return 0;
 }
 
-double CalCurve(double potential) {
-    return potential * 0.5;
+// FNV-1a over the raw bytes of every position and velocity, used to show that
+// runs with different thread counts end in exactly the same state
+unsigned long long StateHash(const BodyStore& bodies) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int k = 0; k < 3; ++k) {
+        const double* arrays[2] = {bodies.pos(k), bodies.vel(k)};
+        for (const double* values : arrays) {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+            for (size_t b = 0; b < bodies.size() * sizeof(double); ++b) {
+                hash = (hash ^ bytes[b]) * 1099511628211ULL;
+            }
+        }
+    }
+    return hash;
 }
 
-void DrawCurvedGrid(int GridSize, GLuint colorLoc, const std::vector<Object*>& objects) {
-    glUniform3f(colorLoc, 0.3f, 0.3f, 0.3f);
+// Strong scaling: the same run repeated with 1, 2, 4, ... threads up to --threads
+int RunScaling(const SimOptions& options) {
+    std::vector<int> threadCounts;
+    for (int t = 1; t < options.threads; t *= 2) {
+        threadCounts.push_back(t);
+    }
+    threadCounts.push_back(options.threads);
+
+    std::cout << "Strong scaling: " << options.bodyCount << " bodies, " << options.steps << " steps" << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "seconds" << std::setw(12) << "steps/sec"
+              << std::setw(10) << "speedup" << std::setw(12) << "efficiency" << "  state" << std::endl;
+
+    double baseSeconds = 0.0;
+    unsigned long long baseHash = 0;
+    for (int threads : threadCounts) {
+        BodyStore bodies;
+        CheckpointState run;
+        if (!BuildScene(bodies, options)) {
+            return 1;
+        }
+        SolverState solver(options, threads);
+
+        auto start = std::chrono::steady_clock::now();
+        RunSteps(bodies, solver, options, run);
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (seconds <= 0.0) {
+            seconds = 1e-9;
+        }
 
-    for (int z = 0; z <= 1000; z += GridSize) {
-        glBegin(GL_LINE_STRIP);
-        for (int x = 0; x <= 1000; x += GridSize / 4) {
-            double potential = CalGravPot(x, z, objects);
-            double y = CalCurve(potential);
-            glVertex3f(x, y, z);
+        unsigned long long hash = StateHash(bodies);
+        if (threads == 1) {
+            baseSeconds = seconds;
+            baseHash = hash;
         }
-        glEnd();
+        double speedup = baseSeconds / seconds;
+        std::cout << std::setw(8) << threads << std::setw(12) << seconds << std::setw(12) << options.steps / seconds
+                  << std::setw(10) << speedup << std::setw(12) << speedup / threads << "  "
+                  << (hash == baseHash ? "identical" : "DIFFERS") << std::endl;
     }
 
-    for (int x = 0; x <= 1000; x+= GridSize) {
-        glBegin(GL_LINE_STRIP);
-        for (int z = 0; z <= 1000; z += GridSize / 4) {
-            double potential = CalGravPot(x, z, objects);
-            double y = CalCurve(potential);
-            glVertex3f(x,y,z);
+    return 0;
+}
+
+GLFWwindow* StartGLFW(){
+    GLFWwindow* window = OpenSimWindow(1600, 900);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(45.0, SW / SH, 0.1, 100.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW. Exiting..." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return window;
+}
+
+void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(45.0, (float)width / (float)height, 0.1, 100.0);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// Integrates options.ensembleMembers perturbed copies of the scene (the three planets
+// unless --scene or a body count says otherwise) and reports how each one ended.
+// Never opens a window.
+int RunEnsemble(const SimOptions& options) {
+    BodyStore system;
+    if (!BuildScene(system, options)) {
+        return 1;
+    }
+    EnsembleParams params = options.ensemble;
+    params.members = options.ensembleMembers;
+    params.G = GravConst;
+    params.eps2 = options.softening * options.softening;
+    params.seed = options.seed;
+    Ensemble ensemble;
+    if (!ensemble.Setup(system, params)) {
+        return 1;
+    }
+    ThreadPool pool(options.threads);
+    uint64_t steps = options.steps > 0 ? (uint64_t)options.steps : 0;
+
+    std::cout << "Ensemble: " << ensemble.Members() << " systems of " << ensemble.Bodies() << " bodies, " << steps
+              << " steps, dt = " << options.DT << ", " << SimdLevelName(options.simd) << ", threads = " << pool.size()
+              << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    ensemble.Run(pool, options.DT, steps, options.simd);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (seconds <= 0.0) {
+        seconds = 1e-9;
+    }
+
+    size_t outcomes[3] = {0, 0, 0};
+    for (const EnsembleRecord& record : ensemble.Records()) {
+        outcomes[record.outcome]++;
+    }
+    std::cout << "Elapsed: " << seconds << " s" << std::endl;
+    std::cout << "Systems x steps: " << ensemble.MemberSteps() << std::endl;
+    std::cout << "Systems x steps/sec: " << (double)ensemble.MemberSteps() / seconds << std::endl;
+    for (int o = 0; o < 3; ++o) {
+        std::cout << EnsembleOutcomeName((EnsembleOutcome)o) << ": " << outcomes[o] << std::endl;
+    }
+    const EnsembleRecord& reference = ensemble.Records()[0];
+    std::cout << "Unperturbed system: " << EnsembleOutcomeName((EnsembleOutcome)reference.outcome) << " at step "
+              << reference.step << std::endl;
+    if (!options.ensembleOutPath.empty()) {
+        if (!ensemble.WriteResults(options.ensembleOutPath, options.DT, steps)) {
+            return 1;
         }
-        glEnd();
+        std::cout << "Results written to " << options.ensembleOutPath << std::endl;
     }
-}
\ No newline at end of file
+    return 0;
+}
@@ -0,0 +1,356 @@
+#define GSIM_BUILDING
+#include "GravitySimAPI.h"
+#include <exception>
+#include <new>
+#include <string>
+#include "Simulation.h"
+#include "Scene.h"
+
+// The C interface in GravitySimAPI.h, over Simulation. No C++ exception crosses it:
+// allocation failures come back as GSIM_OUT_OF_MEMORY, any other exception as
+// GSIM_INTERNAL_ERROR.
+
+static_assert(GSIM_FIELD_COUNT == BodyStore::FieldCount, "gsim_field must follow the store's field order");
+
+struct gsim_sim {
+    Simulation sim;
+    std::string error;
+
+    gsim_sim(double G, int threads) : sim(G, threads) {
+        sim.engine.collisions.verbose = false; // A library shouldn't print per collision
+    }
+};
+
+namespace {
+
+const double DefaultG = 6.674e-5; // Same as the 3D view
+
+gsim_status Fail(gsim_sim* s, gsim_status status, const std::string& message) {
+    s->error = message;
+    return status;
+}
+
+// Runs fn, turning std::bad_alloc into GSIM_OUT_OF_MEMORY and any other exception
+// into GSIM_INTERNAL_ERROR
+template <class Fn>
+gsim_status Guarded(gsim_sim* s, Fn&& fn) {
+    try {
+        return fn();
+    } catch (const std::bad_alloc&) {
+        return Fail(s, GSIM_OUT_OF_MEMORY, "out of memory");
+    } catch (const std::exception& e) {
+        return Fail(s, GSIM_INTERNAL_ERROR, e.what());
+    } catch (...) {
+        return Fail(s, GSIM_INTERNAL_ERROR, "unknown error");
+    }
+}
+
+} // namespace
+
+extern "C" {
+
+uint32_t gsim_api_version(void) {
+    return GSIM_API_VERSION;
+}
+
+gsim_sim* gsim_create(int threads) {
+    try {
+        return new gsim_sim(DefaultG, threads > 0 ? threads : ThreadPool::HardwareThreads());
+    } catch (...) {
+        return nullptr; // Out of memory, or the worker threads failed to start
+    }
+}
+
+void gsim_destroy(gsim_sim* s) {
+    delete s;
+}
+
+const char* gsim_last_error(const gsim_sim* s) {
+    return s->error.c_str();
+}
+
+gsim_status gsim_set_gravity(gsim_sim* s, double G) {
+    if (!(G > 0.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "G must be positive");
+    }
+    s->sim.engine.G = G;
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_softening(gsim_sim* s, double eps) {
+    if (!(eps >= 0.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "softening must not be negative");
+    }
+    s->sim.engine.eps2 = eps * eps;
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_solver(gsim_sim* s, gsim_solver solver) {
+    switch (solver) {
+        case GSIM_SOLVER_DIRECT: s->sim.engine.solver = ForceSolver::Pairwise; break;
+        case GSIM_SOLVER_SIMD: s->sim.engine.solver = ForceSolver::Simd; break;
+        case GSIM_SOLVER_BARNES_HUT: s->sim.engine.solver = ForceSolver::BarnesHut; break;
+        default: return Fail(s, GSIM_INVALID_ARGUMENT, "unknown solver");
+    }
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_theta(gsim_sim* s, double theta) {
+    if (!(theta >= 0.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "theta must not be negative");
+    }
+    s->sim.engine.tree.theta = theta;
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_mixed_precision(gsim_sim* s, int mixed) {
+    s->sim.engine.precision = mixed ? ForcePrecision::Mixed : ForcePrecision::Double;
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_integrator(gsim_sim* s, gsim_integrator integrator, double dt) {
+    if (!(dt > 0.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "dt must be positive");
+    }
+    switch (integrator) {
+        case GSIM_INTEGRATOR_EULER: s->sim.SetIntegrator(IntegratorKind::Euler, dt); break;
+        case GSIM_INTEGRATOR_LEAPFROG: s->sim.SetIntegrator(IntegratorKind::Leapfrog, dt); break;
+        case GSIM_INTEGRATOR_YOSHIDA: s->sim.SetIntegrator(IntegratorKind::Yoshida4, dt); break;
+        case GSIM_INTEGRATOR_BLOCK: s->sim.SetIntegrator(IntegratorKind::Block, dt); break;
+        default: return Fail(s, GSIM_INVALID_ARGUMENT, "unknown integrator");
+    }
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_collisions(gsim_sim* s, gsim_collisions response, double restitution) {
+    if (!(restitution >= 0.0 && restitution <= 1.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "restitution must be between 0 and 1");
+    }
+    switch (response) {
+        case GSIM_COLLISIONS_OFF: s->sim.engine.collisions.response = CollisionResponse::Off; break;
+        case GSIM_COLLISIONS_MERGE: s->sim.engine.collisions.response = CollisionResponse::Merge; break;
+        case GSIM_COLLISIONS_BOUNCE: s->sim.engine.collisions.response = CollisionResponse::Bounce; break;
+        default: return Fail(s, GSIM_INVALID_ARGUMENT, "unknown collision response");
+    }
+    s->sim.engine.collisions.restitution = restitution;
+    return GSIM_OK;
+}
+
+gsim_status gsim_set_reorder(gsim_sim* s, int hilbert, double threshold) {
+    if (!(threshold >= 0.0)) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "reorder threshold must not be negative");
+    }
+    s->sim.engine.order.curve = hilbert ? CurveKind::Hilbert : CurveKind::Morton;
+    s->sim.engine.order.threshold = threshold;
+    return GSIM_OK;
+}
+
+void gsim_set_potential(gsim_sim* s, int enabled) {
+    s->sim.engine.computePotential = enabled != 0;
+    s->sim.Invalidate(); // The last pass may not have filled it
+}
+
+gsim_status gsim_reserve(gsim_sim* s, size_t capacity) {
+    return Guarded(s, [&] {
+        s->sim.bodies.reserve(capacity);
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_resize(gsim_sim* s, size_t count) {
+    return Guarded(s, [&] {
+        s->sim.bodies.resize(count);
+        s->sim.Invalidate();
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_add_body(gsim_sim* s, double mass, double radius, const double position[3], const double velocity[3],
+                          size_t* index) {
+    if (!position || !velocity) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "position and velocity are required");
+    }
+    return Guarded(s, [&] {
+        BodyStore& bodies = s->sim.bodies;
+        size_t i = bodies.add("Body" + std::to_string(bodies.size()), mass, radius, position[0], position[1],
+                              position[2], velocity[0], velocity[1], velocity[2]);
+        if (index) {
+            *index = i;
+        }
+        s->sim.Invalidate();
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_remove_body(gsim_sim* s, size_t index) {
+    if (index >= s->sim.bodies.size()) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "body index out of range");
+    }
+    s->sim.bodies.remove(index);
+    s->sim.Invalidate();
+    return GSIM_OK;
+}
+
+void gsim_clear(gsim_sim* s) {
+    s->sim.bodies.clear();
+    s->sim.Invalidate();
+}
+
+gsim_status gsim_generate_scene(gsim_sim* s, gsim_scene scene, size_t count, uint64_t seed, double totalMass,
+                                double scale) {
+    Simulation& sim = s->sim;
+    return Guarded(s, [&] {
+        if (scene == GSIM_SCENE_PLANETS) {
+            GeneratePlanets(sim.bodies, (int)count, seed, sim.engine.G);
+        } else {
+            SceneKind kind;
+            switch (scene) {
+                case GSIM_SCENE_PLUMMER: kind = SceneKind::Plummer; break;
+                case GSIM_SCENE_DISC: kind = SceneKind::Disc; break;
+                case GSIM_SCENE_COLLAPSE: kind = SceneKind::Collapse; break;
+                default: return Fail(s, GSIM_INVALID_ARGUMENT, "unknown scene");
+            }
+            SceneParams params;
+            params.G = sim.engine.G;
+            if (totalMass > 0.0) {
+                params.totalMass = totalMass;
+            }
+            if (scale > 0.0) {
+                params.scale = scale;
+            }
+            GenerateScene(sim.bodies, kind, count, params, seed, sim.engine.pool);
+        }
+        sim.Invalidate();
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_load_scene(gsim_sim* s, const char* path) {
+    if (!path) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "no path given");
+    }
+    Simulation& sim = s->sim;
+    return Guarded(s, [&] {
+        // Loaded aside, so a bad file or a failed allocation leaves the sim as it was
+        BodyStore loaded;
+        CheckpointState saved;
+        saved.step = sim.step;
+        saved.time = sim.time;
+        if (!LoadSceneFile(path, loaded, &saved)) {
+            return Fail(s, GSIM_IO_ERROR, std::string("could not load ") + path);
+        }
+        sim.bodies.swap(loaded);
+        sim.step = saved.step;
+        sim.SetTime(saved.time); // Also restarts the integrator on the new bodies
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_save_scene(gsim_sim* s, const char* path) {
+    if (!path) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "no path given");
+    }
+    if (!SaveSceneText(path, s->sim.bodies)) {
+        return Fail(s, GSIM_IO_ERROR, std::string("could not write ") + path);
+    }
+    return GSIM_OK;
+}
+
+gsim_status gsim_step(gsim_sim* s, uint64_t steps) {
+    return Guarded(s, [&] {
+        s->sim.Step(steps);
+        return GSIM_OK;
+    });
+}
+
+gsim_status gsim_compute_forces(gsim_sim* s, int potential) {
+    return Guarded(s, [&] {
+        s->sim.ComputeForces(potential != 0);
+        return GSIM_OK;
+    });
+}
+
+void gsim_invalidate(gsim_sim* s) {
+    s->sim.Invalidate();
+}
+
+gsim_status gsim_sample_diagnostics(gsim_sim* s, gsim_diagnostics* out) {
+    if (!out) {
+        return Fail(s, GSIM_INVALID_ARGUMENT, "no output given");
+    }
+    return Guarded(s, [&] {
+        const DiagnosticsSample& d = s->sim.Sample();
+        out->step = d.step;
+        out->time = d.time;
+        out->bodies = d.count;
+        out->kinetic = d.kinetic;
+        out->potential = d.potential;
+        out->energy = d.energy;
+        out->energy_error = d.energyError;
+        out->virial_ratio = d.virialRatio;
+        out->momentum_error = d.momentumError;
+        out->angular_error = d.angularError;
+        out->com_drift = d.comDrift;
+        for (int k = 0; k < 3; ++k) {
+            out->momentum[k] = d.momentum[k];
+            out->angular_momentum[k] = d.angularMomentum[k];
+            out->com[k] = d.com[k];
+        }
+        return GSIM_OK;
+    });
+}
+
+void gsim_reset_diagnostics(gsim_sim* s) {
+    s->sim.ResetDiagnostics();
+}
+
+size_t gsim_body_count(const gsim_sim* s) {
+    return s->sim.bodies.size();
+}
+
+size_t gsim_capacity(const gsim_sim* s) {
+    return s->sim.bodies.capacity();
+}
+
+double* gsim_field_data(gsim_sim* s, gsim_field field) {
+    if ((int)field < 0 || (int)field >= GSIM_FIELD_COUNT) {
+        s->error = "unknown field";
+        return nullptr;
+    }
+    return s->sim.bodies.field((size_t)field);
+}
+
+const uint32_t* gsim_ids(const gsim_sim* s) {
+    return s->sim.bodies.id.data();
+}
+
+uint64_t gsim_layout(const gsim_sim* s) {
+    return s->sim.bodies.layout;
+}
+
+double gsim_time(const gsim_sim* s) {
+    return s->sim.time;
+}
+
+void gsim_set_time(gsim_sim* s, double time) {
+    s->sim.SetTime(time);
+}
+
+uint64_t gsim_step_count(const gsim_sim* s) {
+    return s->sim.step;
+}
+
+uint64_t gsim_collision_count(const gsim_sim* s) {
+    return s->sim.engine.collisions.TotalCollisions();
+}
+
+uint64_t gsim_reorder_count(const gsim_sim* s) {
+    return s->sim.engine.order.reorders;
+}
+
+} // extern "C"
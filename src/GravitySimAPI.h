@@ -0,0 +1,177 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* C interface to the 3D engine, built as the GravitySimEngine library (static or
+ * shared, see CMakeLists.txt). Everything the headless mode can do to a run is here:
+ * pick a solver and integrator, add bodies or generate a scene, step, and read or
+ * change the state.
+ *
+ * State access is zero-copy. gsim_field_data returns the engine's own array for one
+ * field of every body, 64 byte aligned, with gsim_body_count valid entries; write into
+ * it and call gsim_invalidate before the next step. These pointers and gsim_ids stay
+ * valid until a call that can grow the store (gsim_add_body, gsim_resize or
+ * gsim_reserve past gsim_capacity, gsim_generate_scene, gsim_load_scene). Steps never
+ * move the arrays, but collisions and reordering move bodies to other indices: gsim_ids
+ * gives each index's stable body id, and gsim_layout changes whenever indices do.
+ *
+ * Functions that can fail return a gsim_status; gsim_last_error describes the last
+ * failure. A gsim_sim is not thread-safe: use it from one thread at a time (it runs
+ * its own worker threads inside gsim_step). The API only grows: new functions and
+ * enum values are added, existing ones keep their meaning and numbering, and
+ * gsim_api_version reports which version a library implements. */
+
+#if defined(_WIN32) && defined(GSIM_SHARED)
+#ifdef GSIM_BUILDING
+#define GSIM_API __declspec(dllexport)
+#else
+#define GSIM_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define GSIM_API __attribute__((visibility("default")))
+#else
+#define GSIM_API
+#endif
+
+#define GSIM_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct gsim_sim gsim_sim;
+
+typedef enum gsim_status {
+    GSIM_OK = 0,
+    GSIM_INVALID_ARGUMENT = 1,
+    GSIM_OUT_OF_MEMORY = 2,
+    GSIM_IO_ERROR = 3,
+    GSIM_INTERNAL_ERROR = 4 /* Anything else the engine hit, e.g. worker threads failed to start */
+} gsim_status;
+
+typedef enum gsim_solver {
+    GSIM_SOLVER_DIRECT = 0, /* Scalar all-pairs, the exact reference */
+    GSIM_SOLVER_SIMD = 1,   /* Vectorised, multithreaded all-pairs */
+    GSIM_SOLVER_BARNES_HUT = 2
+} gsim_solver;
+
+typedef enum gsim_integrator {
+    GSIM_INTEGRATOR_EULER = 0,
+    GSIM_INTEGRATOR_LEAPFROG = 1,
+    GSIM_INTEGRATOR_YOSHIDA = 2,
+    GSIM_INTEGRATOR_BLOCK = 3
+} gsim_integrator;
+
+typedef enum gsim_collisions {
+    GSIM_COLLISIONS_OFF = 0,
+    GSIM_COLLISIONS_MERGE = 1,
+    GSIM_COLLISIONS_BOUNCE = 2
+} gsim_collisions;
+
+typedef enum gsim_scene {
+    GSIM_SCENE_PLANETS = 0,
+    GSIM_SCENE_PLUMMER = 1,
+    GSIM_SCENE_DISC = 2,
+    GSIM_SCENE_COLLAPSE = 3
+} gsim_scene;
+
+/* Per-body arrays, in the engine's storage order */
+typedef enum gsim_field {
+    GSIM_FIELD_X = 0,
+    GSIM_FIELD_Y = 1,
+    GSIM_FIELD_Z = 2,
+    GSIM_FIELD_VX = 3,
+    GSIM_FIELD_VY = 4,
+    GSIM_FIELD_VZ = 5,
+    GSIM_FIELD_MASS = 6,
+    GSIM_FIELD_RADIUS = 7,
+    GSIM_FIELD_AX = 8, /* Accelerations from the last force pass */
+    GSIM_FIELD_AY = 9,
+    GSIM_FIELD_AZ = 10,
+    GSIM_FIELD_POTENTIAL = 11, /* Per unit mass, only filled when asked for */
+    GSIM_FIELD_COUNT = 12
+} gsim_field;
+
+/* Conservation diagnostics, errors against the first sample (see Diagnostics.h) */
+typedef struct gsim_diagnostics {
+    uint64_t step;
+    double time;
+    uint64_t bodies;
+    double kinetic;
+    double potential;
+    double energy;
+    double energy_error;
+    double virial_ratio;
+    double momentum[3];
+    double momentum_error;
+    double angular_momentum[3];
+    double angular_error;
+    double com[3];
+    double com_drift;
+} gsim_diagnostics;
+
+GSIM_API uint32_t gsim_api_version(void);
+
+/* threads <= 0 uses every hardware thread. Starts empty, with G = 6.674e-5 (the 3D
+ * view's units), the direct solver, leapfrog at dt = 0.001, merging collisions and
+ * Hilbert reordering. Returns NULL if out of memory or the worker threads can't start. */
+GSIM_API gsim_sim* gsim_create(int threads);
+GSIM_API void gsim_destroy(gsim_sim* sim);
+GSIM_API const char* gsim_last_error(const gsim_sim* sim);
+
+/* Settings, applied from the next step on */
+GSIM_API gsim_status gsim_set_gravity(gsim_sim* sim, double G);
+GSIM_API gsim_status gsim_set_softening(gsim_sim* sim, double eps);
+GSIM_API gsim_status gsim_set_solver(gsim_sim* sim, gsim_solver solver);
+GSIM_API gsim_status gsim_set_theta(gsim_sim* sim, double theta);
+GSIM_API gsim_status gsim_set_mixed_precision(gsim_sim* sim, int mixed);
+GSIM_API gsim_status gsim_set_integrator(gsim_sim* sim, gsim_integrator integrator, double dt);
+/* restitution, from 0 to 1, is only used by bounce (see CollisionSystem) */
+GSIM_API gsim_status gsim_set_collisions(gsim_sim* sim, gsim_collisions response, double restitution);
+/* threshold 0 keeps bodies where they are; hilbert != 0 picks Hilbert over Morton */
+GSIM_API gsim_status gsim_set_reorder(gsim_sim* sim, int hilbert, double threshold);
+/* Keep the potential field filled on every force pass */
+GSIM_API void gsim_set_potential(gsim_sim* sim, int enabled);
+
+/* Bodies */
+GSIM_API gsim_status gsim_reserve(gsim_sim* sim, size_t capacity);
+/* New bodies are zeroed, for filling through gsim_field_data */
+GSIM_API gsim_status gsim_resize(gsim_sim* sim, size_t count);
+GSIM_API gsim_status gsim_add_body(gsim_sim* sim, double mass, double radius, const double position[3],
+                                   const double velocity[3], size_t* index);
+/* Moves the last body into index */
+GSIM_API gsim_status gsim_remove_body(gsim_sim* sim, size_t index);
+GSIM_API void gsim_clear(gsim_sim* sim);
+/* total_mass and scale <= 0 keep the defaults; planets ignores both */
+GSIM_API gsim_status gsim_generate_scene(gsim_sim* sim, gsim_scene scene, size_t count, uint64_t seed,
+                                         double total_mass, double scale);
+/* A text scene or a checkpoint; a checkpoint also restores the time and step count.
+ * If the file can't be loaded, the bodies, time and step count stay as they were. */
+GSIM_API gsim_status gsim_load_scene(gsim_sim* sim, const char* path);
+GSIM_API gsim_status gsim_save_scene(gsim_sim* sim, const char* path);
+
+/* Running */
+GSIM_API gsim_status gsim_step(gsim_sim* sim, uint64_t steps);
+/* Fills the acceleration fields, and the potential if potential != 0, for the
+ * current positions without stepping */
+GSIM_API gsim_status gsim_compute_forces(gsim_sim* sim, int potential);
+/* Call after writing through gsim_field_data */
+GSIM_API void gsim_invalidate(gsim_sim* sim);
+GSIM_API gsim_status gsim_sample_diagnostics(gsim_sim* sim, gsim_diagnostics* out);
+GSIM_API void gsim_reset_diagnostics(gsim_sim* sim);
+
+/* State */
+GSIM_API size_t gsim_body_count(const gsim_sim* sim);
+GSIM_API size_t gsim_capacity(const gsim_sim* sim);
+GSIM_API double* gsim_field_data(gsim_sim* sim, gsim_field field);
+GSIM_API const uint32_t* gsim_ids(const gsim_sim* sim);
+GSIM_API uint64_t gsim_layout(const gsim_sim* sim);
+GSIM_API double gsim_time(const gsim_sim* sim);
+GSIM_API void gsim_set_time(gsim_sim* sim, double time);
+GSIM_API uint64_t gsim_step_count(const gsim_sim* sim);
+GSIM_API uint64_t gsim_collision_count(const gsim_sim* sim);
+GSIM_API uint64_t gsim_reorder_count(const gsim_sim* sim);
+
+#ifdef __cplusplus
+}
+#endif
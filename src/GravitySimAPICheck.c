@@ -0,0 +1,53 @@
+/* Compiles GravitySimAPI.h as C and runs a short session through the library, so the C
+ * interface is built and called the way an embedding program would. Run by ctest. */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "GravitySimAPI.h"
+
+static int failures = 0;
+
+static void Expect(int ok, const char* what) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        failures++;
+    }
+}
+
+int main(void) {
+    gsim_sim* sim = gsim_create(2);
+    Expect(sim != NULL, "create");
+    if (!sim) {
+        return 1;
+    }
+    Expect(gsim_api_version() == GSIM_API_VERSION, "api version");
+
+    Expect(gsim_set_solver(sim, GSIM_SOLVER_SIMD) == GSIM_OK, "set solver");
+    Expect(gsim_set_softening(sim, 0.05) == GSIM_OK, "set softening");
+    Expect(gsim_set_collisions(sim, GSIM_COLLISIONS_BOUNCE, NAN) == GSIM_INVALID_ARGUMENT, "reject NaN restitution");
+    Expect(gsim_set_collisions(sim, GSIM_COLLISIONS_OFF, 1.0) == GSIM_OK, "set collisions");
+    Expect(gsim_generate_scene(sim, GSIM_SCENE_PLUMMER, 300, 7, 0.0, 0.0) == GSIM_OK, "generate scene");
+    Expect(gsim_body_count(sim) == 300, "body count");
+
+    Expect(gsim_step(sim, 10) == GSIM_OK, "step");
+    Expect(gsim_step_count(sim) == 10, "step count");
+
+    const double* x = gsim_field_data(sim, GSIM_FIELD_X);
+    const double* mass = gsim_field_data(sim, GSIM_FIELD_MASS);
+    int finite = x != NULL && mass != NULL && ((uintptr_t)x % 64) == 0;
+    for (size_t i = 0; finite && i < gsim_body_count(sim); ++i) {
+        finite = isfinite(x[i]) && mass[i] > 0.0;
+    }
+    Expect(finite, "field data");
+
+    gsim_diagnostics d;
+    Expect(gsim_sample_diagnostics(sim, &d) == GSIM_OK && d.bodies == 300 && d.step == 10 && d.potential < 0.0 &&
+               isfinite(d.energy),
+           "sample diagnostics");
+
+    Expect(gsim_reserve(sim, SIZE_MAX) == GSIM_OUT_OF_MEMORY, "oversized reserve");
+    Expect(gsim_body_count(sim) == 300 && gsim_field_data(sim, GSIM_FIELD_X) == x, "store kept after failed reserve");
+
+    gsim_destroy(sim);
+    return failures == 0 ? 0 : 1;
+}
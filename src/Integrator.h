@@ -0,0 +1,180 @@
+#pragma once
+#include <cstddef>
+#include "BodyStore.h"
+
+// Fixed-step time integration, decoupled from the frame rate. The scheme is a
+// policy template parameter, so each stepping loop is compiled once per scheme with
+// no per-step dispatch. Forces come from a callback force(bodies) that fills the
+// store's ax/ay/az arrays from the current positions, so any solver can drive any
+// scheme.
+//
+// Force evaluations per step: semi-implicit Euler 1, leapfrog 1 (the closing kick's
+// accelerations are reused to open the next step), Yoshida 3. Leapfrog and Yoshida
+// keep energy errors bounded at a much larger dt than Euler, so they need fewer force
+// evaluations for the same simulated time.
+
+// Block is the hierarchical timestep scheme in BlockTimestep.h. It needs the force
+// constants up front, so front ends construct it themselves rather than through
+// WithIntegrator. Checkpoints store the kind by number and reject any past Block, so
+// new kinds go at the end and move that check along.
+enum class IntegratorKind { Euler, Leapfrog, Yoshida4, Block };
+
+inline const char* IntegratorName(IntegratorKind kind) {
+    switch (kind) {
+        case IntegratorKind::Euler: return "euler";
+        case IntegratorKind::Yoshida4: return "yoshida";
+        case IntegratorKind::Block: return "block";
+        default: return "leapfrog";
+    }
+}
+
+// v += a * dt
+template <int D>
+void Kick(BodyStore& bodies, double dt) {
+    size_t n = bodies.size();
+    for (int k = 0; k < D; ++k) {
+        double* vel = bodies.vel(k);
+        const double* acc = bodies.acc(k);
+        for (size_t i = 0; i < n; ++i) {
+            vel[i] += acc[i] * dt;
+        }
+    }
+}
+
+// x += v * dt
+template <int D>
+void Drift(BodyStore& bodies, double dt) {
+    size_t n = bodies.size();
+    for (int k = 0; k < D; ++k) {
+        double* pos = bodies.pos(k);
+        const double* vel = bodies.vel(k);
+        for (size_t i = 0; i < n; ++i) {
+            pos[i] += vel[i] * dt;
+        }
+    }
+}
+
+// accValid says whether ax/ay/az already hold the accelerations for the current
+// positions. Schemes that end on a force evaluation set it so the next step can skip
+// its first one.
+
+// First order: kick with the current accelerations, then drift
+struct SemiImplicitEuler {
+    template <int D, class Force>
+    static void Step(BodyStore& bodies, double dt, Force& force, bool& accValid) {
+        if (!accValid) {
+            force(bodies);
+        }
+        Kick<D>(bodies, dt);
+        Drift<D>(bodies, dt);
+        accValid = false;
+    }
+};
+
+// Second order kick-drift-kick (velocity Verlet)
+struct Leapfrog {
+    template <int D, class Force>
+    static void Step(BodyStore& bodies, double dt, Force& force, bool& accValid) {
+        if (!accValid) {
+            force(bodies);
+        }
+        Kick<D>(bodies, 0.5 * dt);
+        Drift<D>(bodies, dt);
+        force(bodies);
+        Kick<D>(bodies, 0.5 * dt);
+        accValid = true;
+    }
+};
+
+// Fourth order: Yoshida's triple jump of three leapfrog steps (w1, w0, w1) * dt
+struct Yoshida4 {
+    template <int D, class Force>
+    static void Step(BodyStore& bodies, double dt, Force& force, bool& accValid) {
+        const double w1 = 1.3512071919596578;  // 1 / (2 - 2^(1/3))
+        const double w0 = -1.7024143839193153; // -2^(1/3) / (2 - 2^(1/3))
+        Leapfrog::Step<D>(bodies, w1 * dt, force, accValid);
+        Leapfrog::Step<D>(bodies, w0 * dt, force, accValid);
+        Leapfrog::Step<D>(bodies, w1 * dt, force, accValid);
+    }
+};
+
+template <int D, class Scheme>
+class Integrator {
+public:
+    double dt;
+    int maxStepsPerAdvance = 64; // Beyond this a slow frame drops time instead of spiralling
+
+    explicit Integrator(double dt) : dt(dt) {}
+
+    template <class Force>
+    void Step(BodyStore& bodies, Force&& force) {
+        Scheme::template Step<D>(bodies, dt, force, accValid);
+        time += dt;
+    }
+
+    // Adds elapsed (e.g. wall-clock frame time) to the accumulator and takes as many
+    // whole steps of dt as it covers. Returns the number of steps taken.
+    template <class Force>
+    int Advance(BodyStore& bodies, double elapsed, Force&& force) {
+        return Advance(bodies, elapsed, force, [] {});
+    }
+
+    // Same, calling afterStep() after every step, e.g. to resolve collisions
+    template <class Force, class AfterStep>
+    int Advance(BodyStore& bodies, double elapsed, Force&& force, AfterStep&& afterStep) {
+        accumulator += elapsed;
+        int steps = 0;
+        while (accumulator >= dt && steps < maxStepsPerAdvance) {
+            Step(bodies, force);
+            afterStep();
+            accumulator -= dt;
+            steps++;
+        }
+        if (accumulator >= dt) {
+            accumulator = 0.0;
+        }
+        return steps;
+    }
+
+    // Call whenever positions or masses change outside Step (collisions, edits)
+    void Invalidate() { accValid = false; }
+
+    // Nothing to do: accelerations live in the store and were permuted with the bodies
+    void BodiesReordered() {}
+
+    // Whether the last force pass saw the current positions, so ax/ay/az (and pot, if
+    // it was asked for) describe the state the step ended in
+    bool ForcesCurrent() const { return accValid; }
+
+    double Time() const { return time; }
+
+    // For resuming from a checkpoint. Accelerations are recomputed on the next step.
+    void SetTime(double t) {
+        time = t;
+        accValid = false;
+    }
+
+    // Fraction of a step left in the accumulator, for interpolating what is drawn
+    double Alpha() const { return accumulator / dt; }
+
+private:
+    double accumulator = 0.0;
+    double time = 0.0;
+    bool accValid = false;
+};
+
+// Calls fn(integrator) with an Integrator<D, Scheme> for the fixed-step scheme chosen
+// at run time and returns its result
+template <int D, class Fn>
+auto WithIntegrator(IntegratorKind kind, double dt, Fn&& fn) {
+    if (kind == IntegratorKind::Euler) {
+        Integrator<D, SemiImplicitEuler> integrator(dt);
+        return fn(integrator);
+    }
+    if (kind == IntegratorKind::Yoshida4) {
+        Integrator<D, Yoshida4> integrator(dt);
+        return fn(integrator);
+    }
+    Integrator<D, Leapfrog> integrator(dt);
+    return fn(integrator);
+}
@@ -0,0 +1,363 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include "BodyStore.h"
+#include "SimdForces.h"
+
+// Mixed-precision direct summation: the pair arithmetic runs in float32, twice the
+// SIMD width of the double kernels, on half the bytes per body.
+//
+// Float positions only have 24 bits, so they are taken relative to an origin that
+// follows the system: the centre of mass, recomputed in double on every call. Pair
+// separations are then accurate to about 6e-8 of the system's size wherever the
+// system has drifted to. The sums are kept short in float: each row's sum over one
+// tile (at most ForceTileSize pairs) and each tile's contributions to its j bodies are
+// added into the double accumulators once per tile, so rounding grows with the tile
+// size rather than with N. State and integration stay in double throughout.
+
+enum class ForcePrecision { Double, Mixed };
+
+inline const char* ForcePrecisionName(ForcePrecision precision) {
+    return precision == ForcePrecision::Mixed ? "mixed" : "double";
+}
+
+// Float copies of the positions relative to origin, plus float masses
+struct MixedPositions {
+    float* x = nullptr; // One block of 4 * capacity floats, 64 byte aligned
+    float* y = nullptr;
+    float* z = nullptr;
+    float* m = nullptr;
+    double origin[3] = {0.0, 0.0, 0.0};
+
+    MixedPositions() {}
+    MixedPositions(const MixedPositions&) = delete;
+    MixedPositions& operator=(const MixedPositions&) = delete;
+
+    ~MixedPositions() {
+        FreeAligned(x);
+    }
+
+    // Moves the origin to the centre of mass and makes room for n bodies. Fill
+    // [begin, end) with Convert afterwards, from any number of threads.
+    void Prepare(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        Reserve(n);
+        double total = 0.0;
+        double sum[3] = {0.0, 0.0, 0.0};
+        for (size_t i = 0; i < n; ++i) {
+            total += bodies.mass[i];
+            sum[0] += bodies.mass[i] * bodies.x[i];
+            sum[1] += bodies.mass[i] * bodies.y[i];
+            sum[2] += bodies.mass[i] * bodies.z[i];
+        }
+        for (int k = 0; k < 3; ++k) {
+            origin[k] = total > 0.0 ? sum[k] / total : 0.0;
+        }
+    }
+
+    void Convert(const BodyStore& bodies, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            x[i] = (float)(bodies.x[i] - origin[0]);
+            y[i] = (float)(bodies.y[i] - origin[1]);
+            z[i] = (float)(bodies.z[i] - origin[2]);
+            m[i] = (float)bodies.mass[i];
+        }
+    }
+
+    size_t MemoryBytes() const { return 4 * capacity * sizeof(float); }
+
+private:
+    size_t capacity = 0;
+
+    // Capacity is a multiple of 16 so the vector loops can load whole registers
+    void Reserve(size_t n) {
+        if (n <= capacity) {
+            return;
+        }
+        FreeAligned(x);
+        x = y = z = m = nullptr; // Stays empty if the allocation throws
+        capacity = 0;
+        size_t newCapacity = (n + 15) / 16 * 16;
+        x = static_cast<float*>(AllocAligned(4 * newCapacity * sizeof(float)));
+        capacity = newCapacity;
+        std::memset(x, 0, 4 * capacity * sizeof(float));
+        y = x + capacity;
+        z = y + capacity;
+        m = z + capacity;
+    }
+};
+
+// Float inputs, double outputs. jx/jy/jz collect the current tile's contributions to
+// its j bodies, indexed from base.
+struct MixedForceArrays {
+    const float* x;
+    const float* y;
+    const float* z;
+    const float* m;
+    double* ax;
+    double* ay;
+    double* az;
+    float* jx;
+    float* jy;
+    float* jz;
+    float* jp;   // Tile scratch for the potential of the j bodies
+    double* pot; // As in ForceArrays: nullptr skips the potential
+    size_t base;
+};
+
+// Pair (i, j): adds j's pull on i to (sx, sy, sz) and i's pull on j to the tile
+// scratch, and likewise for the potential into sp and jp
+template <bool Potential>
+inline void ForcePairMixed(const MixedForceArrays& f, size_t i, size_t j, float eps2, float& sx, float& sy, float& sz, float& sp) {
+    float dx = f.x[j] - f.x[i];
+    float dy = f.y[j] - f.y[i];
+    float dz = f.z[j] - f.z[i];
+    float r2 = dx * dx + dy * dy + dz * dz + eps2;
+    float inv = 1.0f / std::sqrt(r2);
+    float inv3 = inv * inv * inv;
+    float sj = f.m[j] * inv3;
+    float si = f.m[i] * inv3;
+    sx += dx * sj;
+    sy += dy * sj;
+    sz += dz * sj;
+    f.jx[j - f.base] -= dx * si;
+    f.jy[j - f.base] -= dy * si;
+    f.jz[j - f.base] -= dz * si;
+    if (Potential) {
+        sp += f.m[j] * inv;
+        f.jp[j - f.base] += f.m[i] * inv;
+    }
+}
+
+template <bool Potential>
+inline void ForceRowMixedScalar(const MixedForceArrays& f, size_t i, size_t j0, size_t j1, float eps2) {
+    float sx = 0.0f, sy = 0.0f, sz = 0.0f, sp = 0.0f;
+    for (size_t j = j0; j < j1; ++j) {
+        ForcePairMixed<Potential>(f, i, j, eps2, sx, sy, sz, sp);
+    }
+    f.ax[i] += sx;
+    f.ay[i] += sy;
+    f.az[i] += sz;
+    if (Potential) {
+        f.pot[i] += sp;
+    }
+}
+
+#ifdef GRAVITYSIM_X86
+// ForcePairMixed for the peel and tail loops of the AVX rows, with explicit fmas and
+// always inlined for the same reason as ForcePairFma in SimdForces.h
+template <bool Potential>
+__attribute__((always_inline))
+inline void ForcePairMixedFma(const MixedForceArrays& f, size_t i, size_t j, float eps2, float& sx, float& sy, float& sz, float& sp) {
+    float dx = f.x[j] - f.x[i];
+    float dy = f.y[j] - f.y[i];
+    float dz = f.z[j] - f.z[i];
+    float r2 = std::fma(dx, dx, std::fma(dy, dy, std::fma(dz, dz, eps2)));
+    float inv = 1.0f / std::sqrt(r2);
+    float inv3 = inv * (inv * inv);
+    float sj = f.m[j] * inv3;
+    float si = f.m[i] * inv3;
+    sx = std::fma(dx, sj, sx);
+    sy = std::fma(dy, sj, sy);
+    sz = std::fma(dz, sj, sz);
+    f.jx[j - f.base] = std::fma(-dx, si, f.jx[j - f.base]);
+    f.jy[j - f.base] = std::fma(-dy, si, f.jy[j - f.base]);
+    f.jz[j - f.base] = std::fma(-dz, si, f.jz[j - f.base]);
+    if (Potential) {
+        sp = std::fma(f.m[j], inv, sp);
+        f.jp[j - f.base] = std::fma(f.m[i], inv, f.jp[j - f.base]);
+    }
+}
+
+// 1 / sqrt(r2) from the hardware estimate plus one Newton step, about 23 bits
+__attribute__((target("avx2,fma")))
+inline __m256 InvSqrtAVX2(__m256 r2) {
+    __m256 estimate = _mm256_rsqrt_ps(r2);
+    __m256 half = _mm256_mul_ps(_mm256_set1_ps(0.5f), r2);
+    __m256 correction = _mm256_fnmadd_ps(half, _mm256_mul_ps(estimate, estimate), _mm256_set1_ps(1.5f));
+    return _mm256_mul_ps(estimate, correction);
+}
+
+__attribute__((target("avx2,fma")))
+inline float HorizontalSumAVX2(__m256 v) {
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, v);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+template <bool Potential>
+__attribute__((target("avx2,fma")))
+inline void ForceRowMixedAVX2(const MixedForceArrays& f, size_t i, size_t j0, size_t j1, float eps2) {
+    float sx = 0.0f, sy = 0.0f, sz = 0.0f, sp = 0.0f;
+    size_t j = j0;
+    for (; j < j1 && (j & 7) != 0; ++j) {
+        ForcePairMixedFma<Potential>(f, i, j, eps2, sx, sy, sz, sp);
+    }
+
+    __m256 xi = _mm256_set1_ps(f.x[i]);
+    __m256 yi = _mm256_set1_ps(f.y[i]);
+    __m256 zi = _mm256_set1_ps(f.z[i]);
+    __m256 mi = _mm256_set1_ps(f.m[i]);
+    __m256 soft = _mm256_set1_ps(eps2);
+    __m256 axi = _mm256_setzero_ps();
+    __m256 ayi = _mm256_setzero_ps();
+    __m256 azi = _mm256_setzero_ps();
+    __m256 poti = _mm256_setzero_ps();
+
+    for (; j + 8 <= j1; j += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_load_ps(f.x + j), xi);
+        __m256 dy = _mm256_sub_ps(_mm256_load_ps(f.y + j), yi);
+        __m256 dz = _mm256_sub_ps(_mm256_load_ps(f.z + j), zi);
+        __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dz, dz, soft)));
+        __m256 inv = InvSqrtAVX2(r2);
+        __m256 inv3 = _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv));
+        __m256 sj = _mm256_mul_ps(_mm256_load_ps(f.m + j), inv3);
+        __m256 si = _mm256_mul_ps(mi, inv3);
+
+        axi = _mm256_fmadd_ps(dx, sj, axi);
+        ayi = _mm256_fmadd_ps(dy, sj, ayi);
+        azi = _mm256_fmadd_ps(dz, sj, azi);
+        float* jx = f.jx + (j - f.base);
+        float* jy = f.jy + (j - f.base);
+        float* jz = f.jz + (j - f.base);
+        _mm256_store_ps(jx, _mm256_fnmadd_ps(dx, si, _mm256_load_ps(jx)));
+        _mm256_store_ps(jy, _mm256_fnmadd_ps(dy, si, _mm256_load_ps(jy)));
+        _mm256_store_ps(jz, _mm256_fnmadd_ps(dz, si, _mm256_load_ps(jz)));
+        if (Potential) {
+            float* jp = f.jp + (j - f.base);
+            poti = _mm256_fmadd_ps(_mm256_load_ps(f.m + j), inv, poti);
+            _mm256_store_ps(jp, _mm256_fmadd_ps(mi, inv, _mm256_load_ps(jp)));
+        }
+    }
+
+    for (; j < j1; ++j) {
+        ForcePairMixedFma<Potential>(f, i, j, eps2, sx, sy, sz, sp);
+    }
+    f.ax[i] += sx + HorizontalSumAVX2(axi);
+    f.ay[i] += sy + HorizontalSumAVX2(ayi);
+    f.az[i] += sz + HorizontalSumAVX2(azi);
+    if (Potential) {
+        f.pot[i] += sp + HorizontalSumAVX2(poti);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline __m512 InvSqrtAVX512(__m512 r2) {
+    __m512 estimate = _mm512_maskz_rsqrt14_ps(0xFFFF, r2); // maskz form avoids GCC's undefined-register warning
+    __m512 half = _mm512_mul_ps(_mm512_set1_ps(0.5f), r2);
+    __m512 correction = _mm512_fnmadd_ps(half, _mm512_mul_ps(estimate, estimate), _mm512_set1_ps(1.5f));
+    return _mm512_mul_ps(estimate, correction);
+}
+
+__attribute__((target("avx512f")))
+inline float HorizontalSumAVX512(__m512 v) {
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, v);
+    float sum = 0.0f;
+    for (int k = 0; k < 16; k += 4) {
+        sum += (lanes[k] + lanes[k + 1]) + (lanes[k + 2] + lanes[k + 3]);
+    }
+    return sum;
+}
+
+template <bool Potential>
+__attribute__((target("avx512f")))
+inline void ForceRowMixedAVX512(const MixedForceArrays& f, size_t i, size_t j0, size_t j1, float eps2) {
+    float sx = 0.0f, sy = 0.0f, sz = 0.0f, sp = 0.0f;
+    size_t j = j0;
+    for (; j < j1 && (j & 15) != 0; ++j) {
+        ForcePairMixedFma<Potential>(f, i, j, eps2, sx, sy, sz, sp);
+    }
+
+    __m512 xi = _mm512_set1_ps(f.x[i]);
+    __m512 yi = _mm512_set1_ps(f.y[i]);
+    __m512 zi = _mm512_set1_ps(f.z[i]);
+    __m512 mi = _mm512_set1_ps(f.m[i]);
+    __m512 soft = _mm512_set1_ps(eps2);
+    __m512 axi = _mm512_setzero_ps();
+    __m512 ayi = _mm512_setzero_ps();
+    __m512 azi = _mm512_setzero_ps();
+    __m512 poti = _mm512_setzero_ps();
+
+    for (; j + 16 <= j1; j += 16) {
+        __m512 dx = _mm512_sub_ps(_mm512_load_ps(f.x + j), xi);
+        __m512 dy = _mm512_sub_ps(_mm512_load_ps(f.y + j), yi);
+        __m512 dz = _mm512_sub_ps(_mm512_load_ps(f.z + j), zi);
+        __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dz, dz, soft)));
+        __m512 inv = InvSqrtAVX512(r2);
+        __m512 inv3 = _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv));
+        __m512 sj = _mm512_mul_ps(_mm512_load_ps(f.m + j), inv3);
+        __m512 si = _mm512_mul_ps(mi, inv3);
+
+        axi = _mm512_fmadd_ps(dx, sj, axi);
+        ayi = _mm512_fmadd_ps(dy, sj, ayi);
+        azi = _mm512_fmadd_ps(dz, sj, azi);
+        float* jx = f.jx + (j - f.base);
+        float* jy = f.jy + (j - f.base);
+        float* jz = f.jz + (j - f.base);
+        _mm512_store_ps(jx, _mm512_fnmadd_ps(dx, si, _mm512_load_ps(jx)));
+        _mm512_store_ps(jy, _mm512_fnmadd_ps(dy, si, _mm512_load_ps(jy)));
+        _mm512_store_ps(jz, _mm512_fnmadd_ps(dz, si, _mm512_load_ps(jz)));
+        if (Potential) {
+            float* jp = f.jp + (j - f.base);
+            poti = _mm512_fmadd_ps(_mm512_load_ps(f.m + j), inv, poti);
+            _mm512_store_ps(jp, _mm512_fmadd_ps(mi, inv, _mm512_load_ps(jp)));
+        }
+    }
+
+    for (; j < j1; ++j) {
+        ForcePairMixedFma<Potential>(f, i, j, eps2, sx, sy, sz, sp);
+    }
+    f.ax[i] += sx + HorizontalSumAVX512(axi);
+    f.ay[i] += sy + HorizontalSumAVX512(ayi);
+    f.az[i] += sz + HorizontalSumAVX512(azi);
+    if (Potential) {
+        f.pot[i] += sp + HorizontalSumAVX512(poti);
+    }
+}
+#endif
+
+// Same contract as ForceTile: accumulates every pair with i in [i0, i1), j in
+// [j0, j1) and j > i, without the factor G. The j side is summed in float over the
+// tile and added into the double accumulators at the end.
+inline void ForceTileMixed(const MixedForceArrays& arrays, size_t i0, size_t i1, size_t j0, size_t j1, float eps2,
+                           SimdLevel level) {
+    alignas(64) float scratch[4][ForceTileSize];
+    size_t width = j1 - j0;
+    bool potential = arrays.pot != nullptr;
+    std::memset(scratch, 0, sizeof(scratch[0]) * (potential ? 4 : 3));
+    MixedForceArrays f = arrays;
+    f.jx = scratch[0];
+    f.jy = scratch[1];
+    f.jz = scratch[2];
+    f.jp = scratch[3];
+    f.base = j0;
+
+    void (*row)(const MixedForceArrays&, size_t, size_t, size_t, float) =
+        potential ? ForceRowMixedScalar<true> : ForceRowMixedScalar<false>;
+#ifdef GRAVITYSIM_X86
+    if (level == SimdLevel::AVX512) {
+        row = potential ? ForceRowMixedAVX512<true> : ForceRowMixedAVX512<false>;
+    } else if (level == SimdLevel::AVX2) {
+        row = potential ? ForceRowMixedAVX2<true> : ForceRowMixedAVX2<false>;
+    }
+#endif
+    for (size_t i = i0; i < i1; ++i) {
+        size_t start = (j0 > i + 1) ? j0 : i + 1;
+        if (start < j1) {
+            row(f, i, start, j1, eps2);
+        }
+    }
+
+    for (size_t j = 0; j < width; ++j) {
+        f.ax[j0 + j] += scratch[0][j];
+        f.ay[j0 + j] += scratch[1][j];
+        f.az[j0 + j] += scratch[2][j];
+    }
+    if (potential) {
+        for (size_t j = 0; j < width; ++j) {
+            f.pot[j0 + j] += scratch[3][j];
+        }
+    }
+}
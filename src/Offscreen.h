@@ -0,0 +1,149 @@
+#pragma once
+#include <cstring>
+#include <iostream>
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// A GL context with no window, for rendering on machines without a display: EGL on
+// Mesa's surfaceless platform (llvmpipe on a headless server, or any Mesa GPU
+// driver), or the default EGL display elsewhere. Drawing goes into a width x height
+// framebuffer object with colour and depth renderbuffers, bound for both drawing and
+// reading once Create() returns. Linux only; the window views don't need it.
+class OffscreenContext {
+public:
+    OffscreenContext() {}
+    OffscreenContext(const OffscreenContext&) = delete;
+    OffscreenContext& operator=(const OffscreenContext&) = delete;
+
+    ~OffscreenContext() {
+        Destroy();
+    }
+
+    bool Create(int frameWidth, int frameHeight) {
+        width = frameWidth;
+        height = frameHeight;
+        if (!OpenDisplay()) {
+            std::cerr << "No EGL display for offscreen rendering" << std::endl;
+            return false;
+        }
+        EGLint configAttributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                     EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_NONE};
+        EGLConfig config;
+        EGLint configs = 0;
+        if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttributes, &config, 1, &configs) ||
+            configs == 0) {
+            std::cerr << "No EGL config with desktop OpenGL" << std::endl;
+            Destroy();
+            return false;
+        }
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, nullptr);
+        if (context == EGL_NO_CONTEXT) {
+            std::cerr << "Could not create an EGL context (error 0x" << std::hex << eglGetError() << std::dec << ")" << std::endl;
+            Destroy();
+            return false;
+        }
+        // Without EGL_KHR_surfaceless_context a tiny pbuffer stands in for the window
+        if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            EGLint pbufferAttributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+            surface = eglCreatePbufferSurface(display, config, pbufferAttributes);
+            if (surface == EGL_NO_SURFACE || !eglMakeCurrent(display, surface, surface, context)) {
+                std::cerr << "Could not make the EGL context current" << std::endl;
+                Destroy();
+                return false;
+            }
+        }
+
+        GLenum glew = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+        if (glew == GLEW_ERROR_NO_GLX_DISPLAY) {
+            glew = GLEW_OK; // A GLX build of GLEW still loads the GL entry points through EGL contexts
+        }
+#endif
+        if (glew != GLEW_OK) {
+            std::cerr << "Failed to initialize GLEW for the offscreen context" << std::endl;
+            Destroy();
+            return false;
+        }
+
+        glGenFramebuffers(1, &fbo);
+        glGenRenderbuffers(1, &color);
+        glGenRenderbuffers(1, &depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Offscreen framebuffer of " << width << "x" << height << " is incomplete" << std::endl;
+            Destroy();
+            return false;
+        }
+        glViewport(0, 0, width, height);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        return true;
+    }
+
+    void Destroy() {
+        if (display == EGL_NO_DISPLAY) {
+            return;
+        }
+        if (context != EGL_NO_CONTEXT && eglGetCurrentContext() == context) {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glDeleteFramebuffers(1, &fbo);
+            glDeleteRenderbuffers(1, &depth);
+            glDeleteRenderbuffers(1, &color);
+            fbo = color = depth = 0;
+            eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        }
+        if (surface != EGL_NO_SURFACE) {
+            eglDestroySurface(display, surface);
+            surface = EGL_NO_SURFACE;
+        }
+        if (context != EGL_NO_CONTEXT) {
+            eglDestroyContext(display, context);
+            context = EGL_NO_CONTEXT;
+        }
+        eglTerminate(display);
+        display = EGL_NO_DISPLAY;
+    }
+
+    // GL_RENDERER of the context, e.g. "llvmpipe (LLVM 15.0.7, 256 bits)"
+    const char* Renderer() const {
+        const GLubyte* name = glGetString(GL_RENDERER);
+        return name ? reinterpret_cast<const char*>(name) : "unknown";
+    }
+
+private:
+    int width = 0;
+    int height = 0;
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+    GLuint fbo = 0;
+    GLuint color = 0;
+    GLuint depth = 0;
+
+    bool OpenDisplay() {
+        const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+        if (extensions && std::strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+            PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+                (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+            if (getPlatformDisplay) {
+                display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+                if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) {
+                    return true;
+                }
+            }
+        }
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) {
+            return true;
+        }
+        display = EGL_NO_DISPLAY;
+        return false;
+    }
+};
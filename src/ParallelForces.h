@@ -0,0 +1,182 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "BodyStore.h"
+#include "BarnesHut.h"
+#include "SimdForces.h"
+#include "MixedForces.h"
+#include "ThreadPool.h"
+
+// Multithreaded force evaluation on top of ThreadPool. Results are bit-identical
+// for any thread count:
+//  - Direct summation orders the tile pairs in rounds, round-robin style: no two
+//    pairs of a round share a tile, and every pair is in exactly one round. The
+//    rounds are split over a fixed number of slots that depends only on N, each with
+//    its own force accumulator. The pairs of a round run as separate tasks, and a
+//    slot's rounds run one after another, so every body gets its contributions in
+//    the same order however the tasks are spread over the threads. The slots are
+//    then summed in slot order for every body.
+//  - The tree walk computes each body on its own, so only the split into tasks
+//    changes with the thread count, never the arithmetic.
+class ParallelForces {
+public:
+    static const size_t MaxSlots = 32; // Accumulators, not threads: a round has many tasks
+    static const size_t MaxSlotBytes = 64u << 20; // Caps slot count for very large N
+    static const size_t BodiesPerTask = 1024;
+
+    // Memory cap on the slot accumulators; the checks lower it to reach the capped path
+    size_t maxSlotBytes = MaxSlotBytes;
+
+    ParallelForces() {}
+    ParallelForces(const ParallelForces&) = delete;
+    ParallelForces& operator=(const ParallelForces&) = delete;
+
+    ~ParallelForces() {
+        FreeAligned(slots);
+    }
+
+    // Same result as SimdDirectAccelerations up to summation order. With
+    // ForcePrecision::Mixed the pairs are computed in float32 (MixedForces.h) and
+    // still summed into the same double slots. With potential set, each slot gets a
+    // fourth array for the potential, which ends up in the store's pot.
+    void Direct(ThreadPool& pool, BodyStore& bodies, double G, double eps2, SimdLevel level,
+                ForcePrecision precision = ForcePrecision::Double, bool potential = false) {
+        size_t n = bodies.size();
+        if (n == 0) {
+            return;
+        }
+        bool mixed = precision == ForcePrecision::Mixed;
+        if (mixed) {
+            mixedPositions.Prepare(bodies);
+            pool.ParallelFor((n + BodiesPerTask - 1) / BodiesPerTask, [&](size_t chunk, int) {
+                size_t begin = chunk * BodiesPerTask;
+                mixedPositions.Convert(bodies, begin, (begin + BodiesPerTask < n) ? begin + BodiesPerTask : n);
+            });
+        }
+        // Round r pairs tile r with itself and tile r + k with tile r - k (mod an odd
+        // count, one dummy tile past the end if tiles is even), for k = 1 .. half
+        size_t tiles = (n + ForceTileSize - 1) / ForceTileSize;
+        size_t rounds = tiles | 1;
+        size_t half = rounds / 2;
+        size_t stride = (n + 7) / 8 * 8;
+        size_t arrays = potential ? 4 : 3;
+
+        size_t slotCount = MaxSlots;
+        if (slotCount > rounds) {
+            slotCount = rounds;
+        }
+        // Sized for four arrays whether or not the potential is on, so the slot count
+        // and with it the summation order depend on N alone
+        size_t memoryLimit = maxSlotBytes / (4 * sizeof(double) * (stride ? stride : 1));
+        if (slotCount > memoryLimit) {
+            slotCount = memoryLimit;
+        }
+        if (slotCount < 1) {
+            slotCount = 1;
+        }
+        Reserve(slotCount * arrays * stride);
+
+        pool.ParallelFor(slotCount, [&](size_t slot, int) {
+            std::memset(slots + slot * arrays * stride, 0, sizeof(double) * arrays * stride);
+        });
+
+        // Phase p runs round p of every slot's range, all its pairs in parallel
+        size_t phases = (rounds + slotCount - 1) / slotCount;
+        size_t tasks = half + 1;
+        for (size_t phase = 0; phase < phases; ++phase) {
+            pool.ParallelFor(slotCount * tasks, [&](size_t task, int) {
+                size_t slot = task / tasks;
+                size_t k = task % tasks;
+                size_t round = rounds * slot / slotCount + phase;
+                if (round >= rounds * (slot + 1) / slotCount) {
+                    return;
+                }
+                size_t a = (round + k) % rounds;
+                size_t b = (round + rounds - k) % rounds;
+                if (a >= tiles || b >= tiles) {
+                    return; // Paired with the dummy tile
+                }
+                if (a > b) {
+                    std::swap(a, b);
+                }
+
+                double* base = slots + slot * arrays * stride;
+                double* pot = potential ? base + 3 * stride : nullptr;
+                size_t i0 = a * ForceTileSize;
+                size_t j0 = b * ForceTileSize;
+                size_t i1 = (i0 + ForceTileSize < n) ? i0 + ForceTileSize : n;
+                size_t j1 = (j0 + ForceTileSize < n) ? j0 + ForceTileSize : n;
+                if (mixed) {
+                    MixedForceArrays fm = {mixedPositions.x, mixedPositions.y, mixedPositions.z, mixedPositions.m,
+                                           base, base + stride, base + 2 * stride, nullptr, nullptr, nullptr, nullptr,
+                                           pot, 0};
+                    ForceTileMixed(fm, i0, i1, j0, j1, (float)eps2, level);
+                } else {
+                    ForceArrays f = {bodies.x, bodies.y, bodies.z, bodies.mass, base, base + stride, base + 2 * stride, pot};
+                    ForceTile(f, i0, i1, j0, j1, eps2, level);
+                }
+            });
+        }
+
+        size_t chunks = (n + BodiesPerTask - 1) / BodiesPerTask;
+        pool.ParallelFor(chunks, [&](size_t chunk, int) {
+            size_t begin = chunk * BodiesPerTask;
+            size_t end = (begin + BodiesPerTask < n) ? begin + BodiesPerTask : n;
+            for (size_t k = 0; k < arrays; ++k) {
+                double* out = k < 3 ? bodies.acc((int)k) : bodies.pot;
+                double scale = k < 3 ? G : -G;
+                for (size_t i = begin; i < end; ++i) {
+                    double sum = 0.0;
+                    for (size_t slot = 0; slot < slotCount; ++slot) {
+                        sum += slots[slot * arrays * stride + k * stride + i];
+                    }
+                    out[i] = scale * sum;
+                }
+            }
+        });
+    }
+
+    // Parallel walk of an already built tree, also filling pot if potential is set.
+    // Returns the interaction count.
+    template <int D>
+    size_t Tree(ThreadPool& pool, const BarnesHutTree<D>& tree, BodyStore& bodies, double G, bool potential = false) {
+        size_t n = bodies.size();
+        size_t chunks = (n + BodiesPerTask - 1) / BodiesPerTask;
+        taskInteractions.assign(chunks, 0);
+
+        pool.ParallelFor(chunks, [&](size_t chunk, int) {
+            size_t begin = chunk * BodiesPerTask;
+            size_t end = (begin + BodiesPerTask < n) ? begin + BodiesPerTask : n;
+            taskInteractions[chunk] = tree.ComputeAccelerations(bodies, G, begin, end, potential);
+        });
+
+        size_t interactions = 0;
+        for (size_t count : taskInteractions) {
+            interactions += count;
+        }
+        return interactions;
+    }
+
+    size_t MemoryBytes() const {
+        return slotCapacity * sizeof(double) + mixedPositions.MemoryBytes() + taskInteractions.capacity() * sizeof(size_t);
+    }
+
+private:
+    double* slots = nullptr;
+    MixedPositions mixedPositions;
+    size_t slotCapacity = 0;
+    std::vector<size_t> taskInteractions;
+
+    void Reserve(size_t doubles) {
+        if (doubles <= slotCapacity) {
+            return;
+        }
+        FreeAligned(slots);
+        slots = nullptr; // Stays empty if the allocation throws
+        slotCapacity = 0;
+        slots = static_cast<double*>(AllocAligned(sizeof(double) * doubles));
+        slotCapacity = doubles;
+    }
+};
@@ -0,0 +1,342 @@
+#pragma once
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+
+struct GridVertex {
+    float x, y, z;
+};
+
+// Gravitational potential sampled along the lines of the curved grid in the x/z
+// plane. The samples are kept in a buffer and only re-evaluated when a body has
+// moved more than `tolerance` since the last evaluation:
+//  - a few moved bodies: their old contribution is subtracted and the new one added
+//  - many moved bodies, small N: full direct sum over every body
+//  - N >= pmThreshold: particle-mesh. Masses are deposited on a mesh (cloud in cell)
+//    and convolved with the softened kernel by FFT, so the cost no longer grows
+//    with N. PM uses one softening length, the mass-weighted mean of the bodies'.
+class PotentialField {
+public:
+    double tolerance = 0.5;      // Movement in x/z that makes a body count as moved
+    double softeningScale = 3.5; // Softening = radius * softeningScale, larger makes the grid less pointy
+    double curveScale = 0.5;     // Grid height = potential * curveScale
+    size_t pmThreshold = 2048;
+    int fullRefreshInterval = 64; // Incremental updates before a full re-evaluation to drop drift
+
+    // Lines every lineSpacing units over [0, extent] in x and z, sampled every sampleStep
+    PotentialField(int extent = 1000, int lineSpacing = 4, int sampleStep = 1)
+        : extent(extent), lineSpacing(lineSpacing), sampleStep(sampleStep) {
+        lineCount = extent / lineSpacing + 1;
+        samplesPerLine = extent / sampleStep + 1;
+        vertices.resize(2 * (size_t)lineCount * samplesPerLine);
+        potential.assign(vertices.size(), 0.0);
+
+        // Lines of constant z first, then lines of constant x
+        size_t v = 0;
+        for (int dir = 0; dir < 2; ++dir) {
+            for (int line = 0; line < lineCount; ++line) {
+                for (int s = 0; s < samplesPerLine; ++s) {
+                    float along = (float)(s * sampleStep);
+                    float across = (float)(line * lineSpacing);
+                    vertices[v].x = (dir == 0) ? along : across;
+                    vertices[v].z = (dir == 0) ? across : along;
+                    vertices[v].y = 0.0f;
+                    v++;
+                }
+            }
+        }
+    }
+
+    int LineCount() const { return lineCount; }           // Per direction
+    int SamplesPerLine() const { return samplesPerLine; }
+    const std::vector<GridVertex>& Vertices() const { return vertices; }
+    size_t Evaluations() const { return evaluations; }  // Full evaluations so far, for stats
+
+    // Heap bytes held by the samples, the body snapshot and the mesh scratch
+    size_t MemoryBytes() const {
+        return vertices.capacity() * sizeof(GridVertex) + potential.capacity() * sizeof(double) +
+               (lastX.capacity() + lastZ.capacity() + lastMass.capacity() + lastRadius.capacity()) * sizeof(double) +
+               (kernelSpectrum.capacity() + meshScratch.capacity()) * sizeof(std::complex<double>) +
+               meshPotential.capacity() * sizeof(double);
+    }
+
+    // Potential of a single body at (x, z), the same softened form the grid always used
+    double BodyPotential(double dx, double dz, double mass, double radius, double G) const {
+        double softening = radius * softeningScale;
+        return -(G * mass) / std::sqrt(dx * dx + dz * dz + softening * softening);
+    }
+
+    // Brings the samples up to date with the bodies. Returns true if anything was
+    // recomputed. The pool, if given, splits the per-sample work.
+    bool Update(const BodyStore& bodies, double G, ThreadPool* pool = nullptr) {
+        PROFILE_SCOPE("grid potential");
+        size_t n = bodies.size();
+        bool full = !valid || n != lastX.size() || G != lastG || incrementalUpdates >= fullRefreshInterval;
+
+        std::vector<size_t>& moved = movedScratch;
+        moved.clear();
+        if (!full) {
+            double tol2 = tolerance * tolerance;
+            for (size_t i = 0; i < n; ++i) {
+                double dx = bodies.x[i] - lastX[i];
+                double dz = bodies.z[i] - lastZ[i];
+                if (dx * dx + dz * dz > tol2 || bodies.mass[i] != lastMass[i] || bodies.radius[i] != lastRadius[i]) {
+                    moved.push_back(i);
+                }
+            }
+            if (moved.empty()) {
+                return false;
+            }
+            full = (n >= pmThreshold) || (moved.size() * 2 > n);
+        }
+
+        if (full) {
+            if (n >= pmThreshold) {
+                EvaluateMesh(bodies, G, pool);
+            } else {
+                EvaluateDirect(bodies, G, pool);
+            }
+            Snapshot(bodies);
+            lastG = G;
+            valid = true;
+            incrementalUpdates = 0;
+            evaluations++;
+        } else {
+            for (size_t i : moved) {
+                double oldX = lastX[i], oldZ = lastZ[i], oldMass = lastMass[i], oldRadius = lastRadius[i];
+                double newX = bodies.x[i], newZ = bodies.z[i], newMass = bodies.mass[i], newRadius = bodies.radius[i];
+                ForSamples(pool, [&](size_t begin, size_t end) {
+                    for (size_t v = begin; v < end; ++v) {
+                        potential[v] += BodyPotential(vertices[v].x - newX, vertices[v].z - newZ, newMass, newRadius, G)
+                                      - BodyPotential(vertices[v].x - oldX, vertices[v].z - oldZ, oldMass, oldRadius, G);
+                    }
+                });
+                lastX[i] = newX;
+                lastZ[i] = newZ;
+                lastMass[i] = newMass;
+                lastRadius[i] = newRadius;
+            }
+            incrementalUpdates++;
+        }
+
+        for (size_t v = 0; v < vertices.size(); ++v) {
+            vertices[v].y = (float)(potential[v] * curveScale);
+        }
+        return true;
+    }
+
+    // Forces a full re-evaluation on the next Update, e.g. after changing parameters
+    void Invalidate() { valid = false; }
+
+private:
+    int extent;
+    int lineSpacing;
+    int sampleStep;
+    int lineCount;
+    int samplesPerLine;
+    std::vector<GridVertex> vertices;
+    std::vector<double> potential;
+
+    bool valid = false;
+    int incrementalUpdates = 0;
+    size_t evaluations = 0;
+    double lastG = 0.0;
+    std::vector<double> lastX, lastZ, lastMass, lastRadius;
+    std::vector<size_t> movedScratch;
+    std::vector<size_t> outsideScratch;
+
+    // Particle-mesh scratch, kept between evaluations
+    int meshSize = 0;  // Mesh points per side covering [0, extent]
+    int paddedSize = 0; // FFT size, at least 2 * meshSize for a non-periodic convolution
+    double kernelSoftening = -1.0;
+    double kernelG = 0.0;
+    std::vector<std::complex<double>> kernelSpectrum;
+    std::vector<std::complex<double>> meshScratch;
+    std::vector<double> meshPotential;
+
+    template <typename Fn>
+    void ForSamples(ThreadPool* pool, Fn fn) {
+        size_t total = potential.size();
+        const size_t chunk = 16384;
+        size_t tasks = (total + chunk - 1) / chunk;
+        if (!pool || pool->size() == 1) {
+            fn(0, total);
+            return;
+        }
+        pool->ParallelFor(tasks, [&](size_t task, int) {
+            size_t begin = task * chunk;
+            size_t end = (begin + chunk < total) ? begin + chunk : total;
+            fn(begin, end);
+        });
+    }
+
+    void Snapshot(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        lastX.assign(bodies.x, bodies.x + n);
+        lastZ.assign(bodies.z, bodies.z + n);
+        lastMass.assign(bodies.mass, bodies.mass + n);
+        lastRadius.assign(bodies.radius, bodies.radius + n);
+    }
+
+    void EvaluateDirect(const BodyStore& bodies, double G, ThreadPool* pool) {
+        size_t n = bodies.size();
+        ForSamples(pool, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; ++v) {
+                double sum = 0.0;
+                for (size_t i = 0; i < n; ++i) {
+                    sum += BodyPotential(vertices[v].x - bodies.x[i], vertices[v].z - bodies.z[i], bodies.mass[i], bodies.radius[i], G);
+                }
+                potential[v] = sum;
+            }
+        });
+    }
+
+    // In-place iterative radix-2 FFT of length count, reading every stride-th value
+    static void FFT(std::complex<double>* data, int count, int stride, bool inverse) {
+        for (int i = 1, j = 0; i < count; ++i) {
+            int bit = count >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(data[i * stride], data[j * stride]);
+            }
+        }
+        for (int len = 2; len <= count; len <<= 1) {
+            double angle = 2.0 * 3.14159265358979323846 / len * (inverse ? 1.0 : -1.0);
+            std::complex<double> step(std::cos(angle), std::sin(angle));
+            for (int start = 0; start < count; start += len) {
+                std::complex<double> w(1.0, 0.0);
+                for (int k = 0; k < len / 2; ++k) {
+                    std::complex<double> a = data[(start + k) * stride];
+                    std::complex<double> b = data[(start + k + len / 2) * stride] * w;
+                    data[(start + k) * stride] = a + b;
+                    data[(start + k + len / 2) * stride] = a - b;
+                    w *= step;
+                }
+            }
+        }
+    }
+
+    static void FFT2D(std::vector<std::complex<double>>& grid, int size, bool inverse, ThreadPool* pool) {
+        auto rows = [&](size_t row, int) { FFT(&grid[row * size], size, 1, inverse); };
+        auto cols = [&](size_t col, int) { FFT(&grid[col], size, size, inverse); };
+        if (pool) {
+            pool->ParallelFor(size, rows);
+            pool->ParallelFor(size, cols);
+        } else {
+            for (int i = 0; i < size; ++i) {
+                rows(i, 0);
+            }
+            for (int i = 0; i < size; ++i) {
+                cols(i, 0);
+            }
+        }
+    }
+
+    void EvaluateMesh(const BodyStore& bodies, double G, ThreadPool* pool) {
+        size_t n = bodies.size();
+        double h = lineSpacing;
+        meshSize = extent / lineSpacing + 1;
+        int padded = 1;
+        while (padded < 2 * meshSize) {
+            padded <<= 1;
+        }
+
+        // Bodies with a non-finite x, z, mass or radius are left out of the sums and the
+        // deposit; they have no place on the mesh
+        auto finite = [&](size_t i) {
+            return std::isfinite(bodies.x[i]) && std::isfinite(bodies.z[i]) && std::isfinite(bodies.mass[i]) &&
+                   std::isfinite(bodies.radius[i]);
+        };
+        double massSum = 0.0;
+        double softSum = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            if (!finite(i)) {
+                continue;
+            }
+            massSum += bodies.mass[i];
+            softSum += bodies.mass[i] * bodies.radius[i] * softeningScale;
+        }
+        double softening = (massSum > 0.0) ? softSum / massSum : 0.0;
+
+        // The kernel spectrum only changes with the mesh, softening or G
+        if (padded != paddedSize || softening != kernelSoftening || G != kernelG) {
+            paddedSize = padded;
+            kernelSoftening = softening;
+            kernelG = G;
+            kernelSpectrum.assign((size_t)padded * padded, 0.0);
+            for (int a = 0; a < padded; ++a) {
+                double dz = (a < padded / 2 ? a : a - padded) * h;
+                for (int b = 0; b < padded; ++b) {
+                    double dx = (b < padded / 2 ? b : b - padded) * h;
+                    kernelSpectrum[(size_t)a * padded + b] = -G / std::sqrt(dx * dx + dz * dz + softening * softening);
+                }
+            }
+            FFT2D(kernelSpectrum, padded, false, pool);
+        }
+
+        // Cloud-in-cell deposit. Bodies off the mesh are added to the samples directly.
+        meshScratch.assign((size_t)padded * padded, 0.0);
+        std::vector<size_t>& outside = outsideScratch;
+        outside.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (!finite(i)) {
+                continue;
+            }
+            double fx = bodies.x[i] / h;
+            double fz = bodies.z[i] / h;
+            if (!(fx >= 0.0 && fz >= 0.0 && fx < meshSize - 1 && fz < meshSize - 1)) {
+                outside.push_back(i);
+                continue;
+            }
+            int ix = (int)fx;
+            int iz = (int)fz;
+            double wx = fx - ix;
+            double wz = fz - iz;
+            double m = bodies.mass[i];
+            meshScratch[(size_t)iz * padded + ix] += m * (1 - wx) * (1 - wz);
+            meshScratch[(size_t)iz * padded + ix + 1] += m * wx * (1 - wz);
+            meshScratch[(size_t)(iz + 1) * padded + ix] += m * (1 - wx) * wz;
+            meshScratch[(size_t)(iz + 1) * padded + ix + 1] += m * wx * wz;
+        }
+
+        FFT2D(meshScratch, padded, false, pool);
+        for (size_t k = 0; k < meshScratch.size(); ++k) {
+            meshScratch[k] *= kernelSpectrum[k];
+        }
+        FFT2D(meshScratch, padded, true, pool);
+
+        double norm = 1.0 / ((double)padded * padded);
+        meshPotential.resize((size_t)meshSize * meshSize);
+        for (int a = 0; a < meshSize; ++a) {
+            for (int b = 0; b < meshSize; ++b) {
+                meshPotential[(size_t)a * meshSize + b] = meshScratch[(size_t)a * padded + b].real() * norm;
+            }
+        }
+
+        ForSamples(pool, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; ++v) {
+                double fx = vertices[v].x / h;
+                double fz = vertices[v].z / h;
+                int ix = (int)fx < meshSize - 1 ? (int)fx : meshSize - 2;
+                int iz = (int)fz < meshSize - 1 ? (int)fz : meshSize - 2;
+                double wx = fx - ix;
+                double wz = fz - iz;
+                const double* row0 = &meshPotential[(size_t)iz * meshSize];
+                const double* row1 = row0 + meshSize;
+                double sum = (row0[ix] * (1 - wx) + row0[ix + 1] * wx) * (1 - wz)
+                           + (row1[ix] * (1 - wx) + row1[ix + 1] * wx) * wz;
+                for (size_t i : outside) {
+                    sum += BodyPotential(vertices[v].x - bodies.x[i], vertices[v].z - bodies.z[i], bodies.mass[i], bodies.radius[i], G);
+                }
+                potential[v] = sum;
+            }
+        });
+    }
+};
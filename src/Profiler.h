@@ -0,0 +1,231 @@
+#pragma once
+#include <ostream>
+#include <string>
+
+// Scoped phase timers for finding where a frame's time goes. Build with
+// -DGRAVITYSIM_PROFILE to turn them on; without it PROFILE_SCOPE expands to nothing
+// and Profiler is an empty stub, so normal builds pay nothing.
+//
+// PROFILE_SCOPE("name") records the time until the end of the enclosing block. Each
+// thread writes its events into its own ring buffer with no locking, so the last
+// RingCapacity events of every thread are kept. From those the profiler prints a
+// rolling p50/p99 per phase and exports Chrome trace_event JSON (open it in
+// chrome://tracing or ui.perfetto.dev). Names must be string literals.
+
+#ifdef GRAVITYSIM_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct ProfileEvent {
+    const char* name;
+    uint64_t start;    // ns since the profiler started
+    uint64_t duration; // ns
+};
+
+// One thread's events. Only the owning thread writes; readers take the events below
+// head, which the writer publishes after filling the slot. The writer doesn't wait
+// for readers, so it can lap a reader mid-copy: Collect checks head again afterwards
+// and drops whatever the writer may have overwritten meanwhile.
+class ProfileRing {
+public:
+    static const size_t Capacity = 1 << 15;
+
+    explicit ProfileRing(int thread) : thread(thread), events(Capacity) {}
+
+    void Push(const char* name, uint64_t start, uint64_t duration) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        events[h & (Capacity - 1)] = {name, start, duration};
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Appends the events still in the ring that started at or after since
+    void Collect(uint64_t since, std::vector<ProfileEvent>& out) const {
+        uint64_t h = head.load(std::memory_order_acquire);
+        uint64_t first = (h > Capacity) ? h - Capacity : 0;
+        std::vector<ProfileEvent> copy(events.begin(), events.end());
+        std::atomic_thread_fence(std::memory_order_acquire); // Copy before re-reading head
+        uint64_t after = head.load(std::memory_order_relaxed);
+        // Events below after + 1 - Capacity share a slot with one written, or being
+        // written, since the copy began
+        uint64_t intact = (after + 1 > Capacity) ? after + 1 - Capacity : 0;
+        for (uint64_t e = std::max(first, intact); e < h; ++e) {
+            const ProfileEvent& event = copy[e & (Capacity - 1)];
+            if (event.start >= since) {
+                out.push_back(event);
+            }
+        }
+    }
+
+    const int thread;
+
+private:
+    std::atomic<uint64_t> head{0};
+    std::vector<ProfileEvent> events;
+};
+
+class Profiler {
+public:
+    static const bool Enabled = true;
+
+    static Profiler& Instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    // ns since the profiler started
+    uint64_t Now() const {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+    }
+
+    ProfileRing& ThreadRing() {
+        thread_local ProfileRing* ring = nullptr;
+        if (!ring) {
+            std::lock_guard<std::mutex> lock(mutex);
+            rings.emplace_back(new ProfileRing((int)rings.size()));
+            ring = rings.back().get();
+        }
+        return *ring;
+    }
+
+    // Calls, p50, p99 and total per phase over the last windowSeconds
+    void PrintSummary(std::ostream& out, double windowSeconds) {
+        uint64_t now = Now();
+        uint64_t window = (uint64_t)(windowSeconds * 1e9);
+        std::vector<ProfileEvent> events;
+        Collect(now > window ? now - window : 0, events);
+
+        std::map<std::string, std::vector<uint64_t>> phases;
+        for (const ProfileEvent& event : events) {
+            phases[event.name].push_back(event.duration);
+        }
+        out << "Profile, last " << windowSeconds << " s:" << std::endl;
+        out << std::setw(20) << "phase" << std::setw(8) << "calls" << std::setw(12) << "p50 ms" << std::setw(12)
+            << "p99 ms" << std::setw(12) << "total ms" << std::endl;
+        for (auto& phase : phases) {
+            std::vector<uint64_t>& durations = phase.second;
+            std::sort(durations.begin(), durations.end());
+            uint64_t total = 0;
+            for (uint64_t d : durations) {
+                total += d;
+            }
+            out << std::setw(20) << phase.first << std::setw(8) << durations.size() << std::fixed
+                << std::setprecision(3) << std::setw(12) << Percentile(durations, 0.50) * 1e-6 << std::setw(12)
+                << Percentile(durations, 0.99) * 1e-6 << std::setw(12) << total * 1e-6 << std::defaultfloat
+                << std::endl;
+        }
+    }
+
+    // p50 and p99 of one phase over the last windowSeconds, in ms. False if it has no events.
+    bool PhasePercentiles(const char* name, double windowSeconds, double& p50, double& p99) {
+        uint64_t now = Now();
+        uint64_t window = (uint64_t)(windowSeconds * 1e9);
+        std::vector<ProfileEvent> events;
+        Collect(now > window ? now - window : 0, events);
+        std::vector<uint64_t> durations;
+        for (const ProfileEvent& event : events) {
+            if (std::string(event.name) == name) {
+                durations.push_back(event.duration);
+            }
+        }
+        if (durations.empty()) {
+            return false;
+        }
+        std::sort(durations.begin(), durations.end());
+        p50 = Percentile(durations, 0.50) * 1e-6;
+        p99 = Percentile(durations, 0.99) * 1e-6;
+        return true;
+    }
+
+    // Every event still in the rings as Chrome trace_event JSON
+    bool WriteChromeTrace(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) {
+            return false;
+        }
+        out << "{\"traceEvents\": [\n";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<ProfileEvent> events;
+        for (const std::unique_ptr<ProfileRing>& ring : rings) {
+            events.clear();
+            ring->Collect(0, events);
+            for (const ProfileEvent& event : events) {
+                out << (first ? "" : ",\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                    << ring->thread << std::fixed << std::setprecision(3) << ", \"ts\": " << event.start * 1e-3
+                    << ", \"dur\": " << event.duration * 1e-3 << "}";
+                first = false;
+            }
+        }
+        out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+        return (bool)out;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point epoch = Clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ProfileRing>> rings; // Never freed, so exited threads still export
+
+    void Collect(uint64_t since, std::vector<ProfileEvent>& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::unique_ptr<ProfileRing>& ring : rings) {
+            ring->Collect(since, out);
+        }
+    }
+
+    static double Percentile(const std::vector<uint64_t>& sorted, double q) {
+        size_t index = (size_t)(q * (double)(sorted.size() - 1) + 0.5);
+        return (double)sorted[index];
+    }
+};
+
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* name) : name(name), start(Profiler::Instance().Now()) {}
+
+    ~ProfileScope() {
+        Profiler& profiler = Profiler::Instance();
+        profiler.ThreadRing().Push(name, start, profiler.Now() - start);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    const char* name;
+    uint64_t start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#else
+
+// Same interface, nothing recorded
+class Profiler {
+public:
+    static const bool Enabled = false;
+
+    static Profiler& Instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    void PrintSummary(std::ostream&, double) {}
+    bool PhasePercentiles(const char*, double, double&, double&) { return false; }
+    bool WriteChromeTrace(const std::string&) { return false; }
+};
+
+#define PROFILE_SCOPE(name) ((void)0)
+
+#endif
@@ -0,0 +1,393 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include "BodyStore.h"
+#include "Checkpoint.h"
+#include "ThreadPool.h"
+
+// Initial conditions: procedural distributions for large-N runs and scene files.
+//
+// Generated scenes fill the store in parallel. Every body draws its random numbers
+// from its own counter-based stream, seeded from (seed, body index) alone, so a scene
+// is the same for any thread count and any chunking. Each finished scene is moved to
+// its centre-of-mass frame so it does not drift off the grid, then centred on
+// params.centre.
+//
+// Scene files are either the text format below or a checkpoint (Checkpoint.h), which
+// doubles as the binary scene format and loads with one mapped read:
+//
+//   # comment
+//   name mass radius x y z vx vy vz
+//
+// Blank lines and anything after '#' are ignored. Names may not contain spaces.
+
+enum class SceneKind {
+    Planets,  // The original three planets plus moons (GeneratePlanets)
+    Plummer,  // Plummer sphere in virial equilibrium
+    Disc,     // Cold Keplerian disc around a central mass
+    Collapse, // Uniform sphere at rest
+    File
+};
+
+struct SceneParams {
+    double totalMass = 1e7;  // Of the generated bodies; the disc's central mass is extra
+    double scale = 200.0;    // Plummer scale radius, disc outer radius or sphere radius
+    double bodyRadius = 0.5;
+    double centralMass = 1e7; // Disc only
+    double G = 1.0;
+    double centre[3] = {500.0, 0.0, 500.0};
+};
+
+// SplitMix64 on a per-body counter: cheap, statistically fine for initial conditions,
+// and each stream depends only on its seed and index
+class SceneRng {
+public:
+    SceneRng(uint64_t seed, uint64_t index) : state(Mix(seed + 0x9E3779B97F4A7C15ull * (index + 1))) {}
+
+    uint64_t Next() {
+        state += 0x9E3779B97F4A7C15ull;
+        return Mix(state);
+    }
+
+    // Uniform in [0, 1)
+    double Uniform() { return (double)(Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    // Uniform in (0, 1], safe to take logs and negative powers of
+    double UniformPositive() { return 1.0 - Uniform(); }
+
+    // Isotropic unit vector
+    void Direction(double out[3]) {
+        double cosTheta = 2.0 * Uniform() - 1.0;
+        double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
+        double phi = 2.0 * 3.14159265358979323846 * Uniform();
+        out[0] = sinTheta * std::cos(phi);
+        out[1] = cosTheta;
+        out[2] = sinTheta * std::sin(phi);
+    }
+
+private:
+    uint64_t state;
+
+    static uint64_t Mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+};
+
+inline const char* SceneKindName(SceneKind kind) {
+    switch (kind) {
+        case SceneKind::Plummer: return "plummer";
+        case SceneKind::Disc: return "disc";
+        case SceneKind::Collapse: return "collapse";
+        case SceneKind::File: return "file";
+        default: return "planets";
+    }
+}
+
+// "plummer", "disc", "collapse" or "planets"; anything else is taken as a file name
+inline SceneKind ParseSceneKind(const char* name) {
+    if (std::strcmp(name, "plummer") == 0) {
+        return SceneKind::Plummer;
+    }
+    if (std::strcmp(name, "disc") == 0) {
+        return SceneKind::Disc;
+    }
+    if (std::strcmp(name, "collapse") == 0) {
+        return SceneKind::Collapse;
+    }
+    if (std::strcmp(name, "planets") == 0) {
+        return SceneKind::Planets;
+    }
+    return SceneKind::File;
+}
+
+// Body i of a Plummer sphere (Aarseth, Henon & Wielen 1974): radius from the inverted
+// cumulative mass, speed by rejection sampling from the isotropic distribution function
+inline void PlummerBody(SceneRng& rng, const SceneParams& params, double pos[3], double vel[3]) {
+    double a = params.scale;
+    double r;
+    do {
+        r = a / std::sqrt(std::pow(rng.UniformPositive(), -2.0 / 3.0) - 1.0);
+    } while (r > 20.0 * a); // Clip the few far outliers
+    double direction[3];
+    rng.Direction(direction);
+
+    double q, g;
+    do {
+        q = rng.Uniform();
+        g = 0.1 * rng.Uniform();
+    } while (g > q * q * std::pow(1.0 - q * q, 3.5));
+    double escape = std::sqrt(2.0 * params.G * params.totalMass) * std::pow(r * r + a * a, -0.25);
+    double speed = q * escape;
+    double vDirection[3];
+    rng.Direction(vDirection);
+    for (int k = 0; k < 3; ++k) {
+        pos[k] = r * direction[k];
+        vel[k] = speed * vDirection[k];
+    }
+}
+
+// Body i of a disc in the x-z plane (the grid's plane): uniform in radius between
+// 5% and 100% of scale, thin in y, on circular orbits around the central mass plus
+// the disc mass inside the body's radius
+inline void DiscBody(SceneRng& rng, const SceneParams& params, double pos[3], double vel[3]) {
+    double inner = 0.05 * params.scale;
+    double outer = params.scale;
+    double r = inner + (outer - inner) * rng.Uniform();
+    double angle = 2.0 * 3.14159265358979323846 * rng.Uniform();
+    double height = 0.01 * params.scale * (2.0 * rng.Uniform() - 1.0);
+    double enclosed = params.centralMass + params.totalMass * (r - inner) / (outer - inner);
+    double speed = std::sqrt(params.G * enclosed / r);
+    pos[0] = r * std::cos(angle);
+    pos[1] = height;
+    pos[2] = r * std::sin(angle);
+    vel[0] = -speed * std::sin(angle);
+    vel[1] = 0.0;
+    vel[2] = speed * std::cos(angle);
+}
+
+// Body i of a uniform sphere at rest
+inline void CollapseBody(SceneRng& rng, const SceneParams& params, double pos[3], double vel[3]) {
+    double r = params.scale * std::cbrt(rng.Uniform());
+    double direction[3];
+    rng.Direction(direction);
+    for (int k = 0; k < 3; ++k) {
+        pos[k] = r * direction[k];
+        vel[k] = 0.0;
+    }
+}
+
+// Moves the bodies to their centre-of-mass frame, then to params.centre
+inline void CentreScene(BodyStore& bodies, const SceneParams& params) {
+    size_t n = bodies.size();
+    double total = 0.0;
+    double position[3] = {0.0, 0.0, 0.0};
+    double momentum[3] = {0.0, 0.0, 0.0};
+    for (size_t i = 0; i < n; ++i) {
+        total += bodies.mass[i];
+        for (int k = 0; k < 3; ++k) {
+            position[k] += bodies.mass[i] * bodies.pos(k)[i];
+            momentum[k] += bodies.mass[i] * bodies.vel(k)[i];
+        }
+    }
+    if (total <= 0.0) {
+        return;
+    }
+    for (int k = 0; k < 3; ++k) {
+        double shift = params.centre[k] - position[k] / total;
+        double drift = momentum[k] / total;
+        double* p = bodies.pos(k);
+        double* v = bodies.vel(k);
+        for (size_t i = 0; i < n; ++i) {
+            p[i] += shift;
+            v[i] -= drift;
+        }
+    }
+}
+
+// Replaces the store's bodies with count bodies of a generated scene
+inline void GenerateScene(BodyStore& bodies, SceneKind kind, size_t count, const SceneParams& params, uint64_t seed,
+                          ThreadPool& pool) {
+    bodies.clear();
+    bool central = (kind == SceneKind::Disc && count > 0);
+    size_t first = central ? 1 : 0;
+    bodies.resize(count);
+    double mass = count > first ? params.totalMass / (double)(count - first) : 0.0;
+    const char* prefix = (kind == SceneKind::Disc) ? "Disc" : "Star";
+
+    const size_t chunkSize = 4096;
+    pool.ParallelFor((count + chunkSize - 1) / chunkSize, [&](size_t chunk, int) {
+        size_t begin = chunk * chunkSize;
+        size_t end = (begin + chunkSize < count) ? begin + chunkSize : count;
+        for (size_t i = (begin > first ? begin : first); i < end; ++i) {
+            SceneRng rng(seed, i);
+            double pos[3];
+            double vel[3];
+            if (kind == SceneKind::Plummer) {
+                PlummerBody(rng, params, pos, vel);
+            } else if (kind == SceneKind::Disc) {
+                DiscBody(rng, params, pos, vel);
+            } else {
+                CollapseBody(rng, params, pos, vel);
+            }
+            for (int k = 0; k < 3; ++k) {
+                bodies.pos(k)[i] = pos[k];
+                bodies.vel(k)[i] = vel[k];
+            }
+            bodies.mass[i] = mass;
+            bodies.radius[i] = params.bodyRadius;
+            bodies.name[i] = prefix + std::to_string(i);
+        }
+    });
+
+    if (central) {
+        bodies.name[0] = "Centre";
+        bodies.mass[0] = params.centralMass;
+        bodies.radius[0] = 10.0 * params.bodyRadius;
+        for (int k = 0; k < 3; ++k) {
+            bodies.pos(k)[0] = 0.0;
+            bodies.vel(k)[0] = 0.0;
+        }
+    }
+    CentreScene(bodies, params);
+}
+
+// The three planets from the original scene, followed by small moons on circular
+// orbits around the system so the headless mode can be run at any N. G sets the
+// moons' orbital speeds.
+inline void GeneratePlanets(BodyStore& bodies, int count, uint64_t seed, double G) {
+    bodies.clear();
+    bodies.reserve(count > 3 ? count : 3);
+
+    // name, mass, radius, position, velocity
+    bodies.add("Planet1", 1e6, 1.0, 550.0, 0.0, 530.0, -5.0, 0.0, 0.0);
+    bodies.add("Planet2", 5e6, 2.0, 525.0, 0.0, 500.0, -2.0, 0.0, 0.0);
+    bodies.add("Planet3", 9e6, 3.0, 450.0, 0.0, 450.0, 0.0, 0.0, 0.0);
+
+    while ((int)bodies.size() > count && bodies.size() > 0) {
+        bodies.remove(bodies.size() - 1);
+    }
+
+    std::mt19937 rng((std::mt19937::result_type)seed);
+    std::uniform_real_distribution<double> orbitDist(60.0, 450.0);
+    std::uniform_real_distribution<double> angleDist(0.0, 2.0 * 3.14159265358979323846);
+    std::uniform_real_distribution<double> heightDist(-5.0, 5.0);
+    double centralMass = 1.5e7;
+
+    while ((int)bodies.size() < count) {
+        double r = orbitDist(rng);
+        double angle = angleDist(rng);
+        double speed = std::sqrt(G * centralMass / r);
+        double height = heightDist(rng);
+
+        bodies.add("Moon" + std::to_string(bodies.size() - 2), 1e3, 0.5,
+                   500.0 + r * std::cos(angle), height, 500.0 + r * std::sin(angle),
+                   -speed * std::sin(angle), 0.0, speed * std::cos(angle));
+    }
+}
+
+// Reads a text scene file into the store. Returns false (with a message) if the file
+// can't be read, a line doesn't parse, or a value is not finite or is a negative
+// mass or radius, leaving the store as it was.
+inline bool LoadSceneText(const std::string& path, BodyStore& bodies) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open scene file " << path << std::endl;
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string text = buffer.str();
+
+    BodyStore loaded; // Only replaces bodies once every line has parsed
+    const char* cursor = text.c_str();
+    size_t line = 0;
+    while (*cursor) {
+        line++;
+        const char* end = std::strchr(cursor, '\n');
+        if (!end) {
+            end = cursor + std::strlen(cursor);
+        }
+        const char* hash = static_cast<const char*>(std::memchr(cursor, '#', end - cursor));
+        const char* stop = hash ? hash : end;
+
+        const char* p = cursor;
+        while (p < stop && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+        if (p < stop) {
+            const char* nameEnd = p;
+            while (nameEnd < stop && *nameEnd != ' ' && *nameEnd != '\t') {
+                nameEnd++;
+            }
+            std::string name(p, nameEnd);
+            double values[8];
+            char* next = const_cast<char*>(nameEnd);
+            bool ok = true;
+            for (int v = 0; v < 8 && ok; ++v) {
+                char* parsed = next;
+                values[v] = std::strtod(next, &parsed);
+                ok = parsed != next && parsed <= stop;
+                next = parsed;
+            }
+            if (!ok) {
+                std::cerr << path << ":" << line << ": expected name mass radius x y z vx vy vz" << std::endl;
+                return false;
+            }
+            while (next < stop && (*next == ' ' || *next == '\t' || *next == '\r')) {
+                next++;
+            }
+            if (next < stop) {
+                const char* extraEnd = stop;
+                while (extraEnd[-1] == ' ' || extraEnd[-1] == '\t' || extraEnd[-1] == '\r') {
+                    extraEnd--;
+                }
+                std::cerr << path << ":" << line << ": unexpected '" << std::string(next, extraEnd - next)
+                          << "' after name mass radius x y z vx vy vz" << std::endl;
+                return false;
+            }
+            bool finite = true;
+            for (int v = 0; v < 8; ++v) {
+                finite = finite && std::isfinite(values[v]);
+            }
+            if (!finite || values[0] < 0.0 || values[1] < 0.0) {
+                std::cerr << path << ":" << line << ": values must be finite, and mass and radius not negative"
+                          << std::endl;
+                return false;
+            }
+            loaded.add(name, values[0], values[1], values[2], values[3], values[4], values[5], values[6], values[7]);
+        }
+        cursor = *end ? end + 1 : end;
+    }
+    bodies.swap(loaded);
+    return true;
+}
+
+// Loads a scene file: a checkpoint if it starts with the checkpoint magic, text
+// otherwise. saved, if given, receives a checkpoint's time and step. On failure the
+// store is left as it was.
+inline bool LoadSceneFile(const std::string& path, BodyStore& bodies, CheckpointState* saved = nullptr) {
+    char magic[8] = {};
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open scene file " << path << std::endl;
+        return false;
+    }
+    in.read(magic, sizeof(magic));
+    in.close();
+    if (std::memcmp(magic, "GSCHKPT\0", 8) == 0) {
+        CheckpointState ignored;
+        BodyStore loaded;
+        if (!LoadCheckpoint(path, loaded, saved ? *saved : ignored)) {
+            return false;
+        }
+        bodies.swap(loaded);
+        return true;
+    }
+    return LoadSceneText(path, bodies);
+}
+
+// Writes the store in the text scene format, e.g. to hand-edit a generated scene
+inline bool SaveSceneText(const std::string& path, const BodyStore& bodies) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Could not open scene file " << path << std::endl;
+        return false;
+    }
+    out.precision(17);
+    out << "# name mass radius x y z vx vy vz\n";
+    for (size_t i = 0; i < bodies.size(); ++i) {
+        out << (bodies.name[i].empty() ? "Body" + std::to_string(i) : bodies.name[i]) << ' ' << bodies.mass[i] << ' '
+            << bodies.radius[i] << ' ' << bodies.x[i] << ' ' << bodies.y[i] << ' ' << bodies.z[i] << ' ' << bodies.vx[i]
+            << ' ' << bodies.vy[i] << ' ' << bodies.vz[i] << '\n';
+    }
+    return (bool)out;
+}
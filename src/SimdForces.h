@@ -0,0 +1,275 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include "BodyStore.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GRAVITYSIM_X86 1
+#endif
+
+// Vectorised direct summation. Bodies are processed in square tiles so the j block
+// stays in L1 while every i of the i block sweeps over it, and each pair is visited
+// once with the force applied to both bodies (Newton's third law). The AVX2 and
+// AVX-512 paths are compiled with target attributes and picked at runtime, so the
+// same binary still runs on CPUs without them.
+//
+// Every kernel comes in two variants: Potential = true also sums m / r per body into
+// pot, reusing the 1 / r the acceleration already needs. ForceTile picks it when pot
+// is set, so the plain pass carries no extra work.
+
+enum class SimdLevel { Scalar, AVX2, AVX512 };
+
+const size_t ForceTileSize = 256;
+const double FlopsPerInteraction = 20.0; // The usual convention for one softened pair
+
+struct ForceArrays {
+    const double* x;
+    const double* y;
+    const double* z;
+    const double* m;
+    double* ax;
+    double* ay;
+    double* az;
+    double* pot; // Sum of m_j / r_ij, or nullptr to skip the potential
+};
+
+inline SimdLevel DetectSimdLevel() {
+#ifdef GRAVITYSIM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+inline const char* SimdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// Accumulates pair (i, j) into both bodies. Accelerations are left without the
+// factor G, which is applied once at the end.
+template <bool Potential>
+inline void ForcePairScalar(const ForceArrays& f, size_t i, size_t j, double eps2) {
+    double dx = f.x[j] - f.x[i];
+    double dy = f.y[j] - f.y[i];
+    double dz = f.z[j] - f.z[i];
+    double r2 = dx * dx + dy * dy + dz * dz + eps2;
+    double inv = 1.0 / std::sqrt(r2);
+    double inv3 = inv * inv * inv;
+    double sj = f.m[j] * inv3;
+    double si = f.m[i] * inv3;
+    f.ax[i] += dx * sj;
+    f.ay[i] += dy * sj;
+    f.az[i] += dz * sj;
+    f.ax[j] -= dx * si;
+    f.ay[j] -= dy * si;
+    f.az[j] -= dz * si;
+    if (Potential) {
+        f.pot[i] += f.m[j] * inv;
+        f.pot[j] += f.m[i] * inv;
+    }
+}
+
+template <bool Potential>
+inline void ForceRowScalar(const ForceArrays& f, size_t i, size_t j0, size_t j1, double eps2) {
+    for (size_t j = j0; j < j1; ++j) {
+        ForcePairScalar<Potential>(f, i, j, eps2);
+    }
+}
+
+#ifdef GRAVITYSIM_X86
+// The scalar pair for the peel and tail loops of the AVX rows, with every multiply-add
+// written as an fma in the order the vector lanes use. It is always inlined, so it
+// compiles under the row's target, and the acceleration rounds the same way whether
+// or not Potential is set. Left to the compiler, the two instantiations could be
+// inlined and contracted differently, and --diagnostics would change the trajectory.
+template <bool Potential>
+__attribute__((always_inline))
+inline void ForcePairFma(const ForceArrays& f, size_t i, size_t j, double eps2) {
+    double dx = f.x[j] - f.x[i];
+    double dy = f.y[j] - f.y[i];
+    double dz = f.z[j] - f.z[i];
+    double r2 = std::fma(dx, dx, std::fma(dy, dy, std::fma(dz, dz, eps2)));
+    double inv = 1.0 / std::sqrt(r2);
+    double inv3 = inv * (inv * inv);
+    double sj = f.m[j] * inv3;
+    double si = f.m[i] * inv3;
+    f.ax[i] = std::fma(dx, sj, f.ax[i]);
+    f.ay[i] = std::fma(dy, sj, f.ay[i]);
+    f.az[i] = std::fma(dz, sj, f.az[i]);
+    f.ax[j] = std::fma(-dx, si, f.ax[j]);
+    f.ay[j] = std::fma(-dy, si, f.ay[j]);
+    f.az[j] = std::fma(-dz, si, f.az[j]);
+    if (Potential) {
+        f.pot[i] = std::fma(f.m[j], inv, f.pot[i]);
+        f.pot[j] = std::fma(f.m[i], inv, f.pot[j]);
+    }
+}
+
+template <bool Potential>
+__attribute__((target("avx2,fma")))
+inline void ForceRowAVX2(const ForceArrays& f, size_t i, size_t j0, size_t j1, double eps2) {
+    size_t j = j0;
+    for (; j < j1 && (j & 3) != 0; ++j) {
+        ForcePairFma<Potential>(f, i, j, eps2);
+    }
+
+    __m256d xi = _mm256_set1_pd(f.x[i]);
+    __m256d yi = _mm256_set1_pd(f.y[i]);
+    __m256d zi = _mm256_set1_pd(f.z[i]);
+    __m256d mi = _mm256_set1_pd(f.m[i]);
+    __m256d soft = _mm256_set1_pd(eps2);
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d axi = _mm256_setzero_pd();
+    __m256d ayi = _mm256_setzero_pd();
+    __m256d azi = _mm256_setzero_pd();
+    __m256d poti = _mm256_setzero_pd();
+
+    for (; j + 4 <= j1; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_load_pd(f.x + j), xi);
+        __m256d dy = _mm256_sub_pd(_mm256_load_pd(f.y + j), yi);
+        __m256d dz = _mm256_sub_pd(_mm256_load_pd(f.z + j), zi);
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, soft)));
+        __m256d inv = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+        __m256d inv3 = _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv));
+        __m256d sj = _mm256_mul_pd(_mm256_load_pd(f.m + j), inv3);
+        __m256d si = _mm256_mul_pd(mi, inv3);
+
+        axi = _mm256_fmadd_pd(dx, sj, axi);
+        ayi = _mm256_fmadd_pd(dy, sj, ayi);
+        azi = _mm256_fmadd_pd(dz, sj, azi);
+        _mm256_store_pd(f.ax + j, _mm256_fnmadd_pd(dx, si, _mm256_load_pd(f.ax + j)));
+        _mm256_store_pd(f.ay + j, _mm256_fnmadd_pd(dy, si, _mm256_load_pd(f.ay + j)));
+        _mm256_store_pd(f.az + j, _mm256_fnmadd_pd(dz, si, _mm256_load_pd(f.az + j)));
+        if (Potential) {
+            poti = _mm256_fmadd_pd(_mm256_load_pd(f.m + j), inv, poti);
+            _mm256_store_pd(f.pot + j, _mm256_fmadd_pd(mi, inv, _mm256_load_pd(f.pot + j)));
+        }
+    }
+
+    alignas(32) double sum[4][4];
+    _mm256_store_pd(sum[0], axi);
+    _mm256_store_pd(sum[1], ayi);
+    _mm256_store_pd(sum[2], azi);
+    f.ax[i] += (sum[0][0] + sum[0][1]) + (sum[0][2] + sum[0][3]);
+    f.ay[i] += (sum[1][0] + sum[1][1]) + (sum[1][2] + sum[1][3]);
+    f.az[i] += (sum[2][0] + sum[2][1]) + (sum[2][2] + sum[2][3]);
+    if (Potential) {
+        _mm256_store_pd(sum[3], poti);
+        f.pot[i] += (sum[3][0] + sum[3][1]) + (sum[3][2] + sum[3][3]);
+    }
+
+    for (; j < j1; ++j) {
+        ForcePairFma<Potential>(f, i, j, eps2);
+    }
+}
+
+template <bool Potential>
+__attribute__((target("avx512f")))
+inline void ForceRowAVX512(const ForceArrays& f, size_t i, size_t j0, size_t j1, double eps2) {
+    size_t j = j0;
+    for (; j < j1 && (j & 7) != 0; ++j) {
+        ForcePairFma<Potential>(f, i, j, eps2);
+    }
+
+    __m512d xi = _mm512_set1_pd(f.x[i]);
+    __m512d yi = _mm512_set1_pd(f.y[i]);
+    __m512d zi = _mm512_set1_pd(f.z[i]);
+    __m512d mi = _mm512_set1_pd(f.m[i]);
+    __m512d soft = _mm512_set1_pd(eps2);
+    __m512d one = _mm512_set1_pd(1.0);
+    __m512d axi = _mm512_setzero_pd();
+    __m512d ayi = _mm512_setzero_pd();
+    __m512d azi = _mm512_setzero_pd();
+    __m512d poti = _mm512_setzero_pd();
+
+    for (; j + 8 <= j1; j += 8) {
+        __m512d dx = _mm512_sub_pd(_mm512_load_pd(f.x + j), xi);
+        __m512d dy = _mm512_sub_pd(_mm512_load_pd(f.y + j), yi);
+        __m512d dz = _mm512_sub_pd(_mm512_load_pd(f.z + j), zi);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, soft)));
+        __m512d inv = _mm512_div_pd(one, _mm512_maskz_sqrt_pd(0xFF, r2)); // maskz form avoids GCC's undefined-register warning
+        __m512d inv3 = _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv));
+        __m512d sj = _mm512_mul_pd(_mm512_load_pd(f.m + j), inv3);
+        __m512d si = _mm512_mul_pd(mi, inv3);
+
+        axi = _mm512_fmadd_pd(dx, sj, axi);
+        ayi = _mm512_fmadd_pd(dy, sj, ayi);
+        azi = _mm512_fmadd_pd(dz, sj, azi);
+        _mm512_store_pd(f.ax + j, _mm512_fnmadd_pd(dx, si, _mm512_load_pd(f.ax + j)));
+        _mm512_store_pd(f.ay + j, _mm512_fnmadd_pd(dy, si, _mm512_load_pd(f.ay + j)));
+        _mm512_store_pd(f.az + j, _mm512_fnmadd_pd(dz, si, _mm512_load_pd(f.az + j)));
+        if (Potential) {
+            poti = _mm512_fmadd_pd(_mm512_load_pd(f.m + j), inv, poti);
+            _mm512_store_pd(f.pot + j, _mm512_fmadd_pd(mi, inv, _mm512_load_pd(f.pot + j)));
+        }
+    }
+
+    alignas(64) double sum[4][8];
+    _mm512_store_pd(sum[0], axi);
+    _mm512_store_pd(sum[1], ayi);
+    _mm512_store_pd(sum[2], azi);
+    f.ax[i] += ((sum[0][0] + sum[0][1]) + (sum[0][2] + sum[0][3])) + ((sum[0][4] + sum[0][5]) + (sum[0][6] + sum[0][7]));
+    f.ay[i] += ((sum[1][0] + sum[1][1]) + (sum[1][2] + sum[1][3])) + ((sum[1][4] + sum[1][5]) + (sum[1][6] + sum[1][7]));
+    f.az[i] += ((sum[2][0] + sum[2][1]) + (sum[2][2] + sum[2][3])) + ((sum[2][4] + sum[2][5]) + (sum[2][6] + sum[2][7]));
+    if (Potential) {
+        _mm512_store_pd(sum[3], poti);
+        f.pot[i] += ((sum[3][0] + sum[3][1]) + (sum[3][2] + sum[3][3])) + ((sum[3][4] + sum[3][5]) + (sum[3][6] + sum[3][7]));
+    }
+
+    for (; j < j1; ++j) {
+        ForcePairFma<Potential>(f, i, j, eps2);
+    }
+}
+#endif
+
+// Accumulates every pair with i in [i0, i1), j in [j0, j1) and j > i
+inline void ForceTile(const ForceArrays& f, size_t i0, size_t i1, size_t j0, size_t j1, double eps2, SimdLevel level) {
+    bool potential = f.pot != nullptr;
+    void (*row)(const ForceArrays&, size_t, size_t, size_t, double) = potential ? ForceRowScalar<true> : ForceRowScalar<false>;
+#ifdef GRAVITYSIM_X86
+    if (level == SimdLevel::AVX512) {
+        row = potential ? ForceRowAVX512<true> : ForceRowAVX512<false>;
+    } else if (level == SimdLevel::AVX2) {
+        row = potential ? ForceRowAVX2<true> : ForceRowAVX2<false>;
+    }
+#endif
+    for (size_t i = i0; i < i1; ++i) {
+        size_t start = (j0 > i + 1) ? j0 : i + 1;
+        if (start < j1) {
+            row(f, i, start, j1, eps2);
+        }
+    }
+}
+
+// All-pairs accelerations with Plummer softening eps2 = eps * eps, written into the
+// store's ax/ay/az arrays.
+inline void SimdDirectAccelerations(BodyStore& bodies, double G, double eps2, SimdLevel level) {
+    size_t n = bodies.size();
+    ForceArrays f = {bodies.x, bodies.y, bodies.z, bodies.mass, bodies.ax, bodies.ay, bodies.az, nullptr};
+    for (size_t i = 0; i < n; ++i) {
+        f.ax[i] = f.ay[i] = f.az[i] = 0.0;
+    }
+
+    for (size_t i0 = 0; i0 < n; i0 += ForceTileSize) {
+        size_t i1 = (i0 + ForceTileSize < n) ? i0 + ForceTileSize : n;
+        for (size_t j0 = i0; j0 < n; j0 += ForceTileSize) {
+            size_t j1 = (j0 + ForceTileSize < n) ? j0 + ForceTileSize : n;
+            ForceTile(f, i0, i1, j0, j1, eps2, level);
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        f.ax[i] *= G;
+        f.ay[i] *= G;
+        f.az[i] *= G;
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "BodyStore.h"
+#include "Engine.h"
+#include "Integrator.h"
+#include "BlockTimestep.h"
+#include "Diagnostics.h"
+
+// A whole 3D simulation behind one object: the bodies, the engine and an integrator
+// picked at run time, with the time and step count. This is what the embeddable
+// library (GravitySimAPI.h) wraps; the front ends drive Engine directly because they
+// also pace, draw and checkpoint between steps.
+//
+// Settings can change between calls to Step. Anything that changes the forces (the
+// solver, G, softening) or the bodies from outside Step must be followed by
+// Invalidate, which restarts the integrator from the current state: leapfrog then
+// recomputes the accelerations it carries over, and block steps pick up the new G
+// and softening and restart every body's level.
+
+class Simulation {
+public:
+    BodyStore bodies;
+    Engine<3> engine;
+    double time = 0.0;
+    uint64_t step = 0;
+
+    Simulation(double G, int threads) : engine(G, threads) {}
+
+    Simulation(const Simulation&) = delete;
+    Simulation& operator=(const Simulation&) = delete;
+
+    double Dt() const { return dt; }
+
+    // Takes effect on the next Step, starting from the current time
+    void SetIntegrator(IntegratorKind kind, double stepSize) {
+        integrator = kind;
+        dt = stepSize;
+        stepper.reset();
+    }
+
+    // Call after editing positions, velocities or masses, adding or removing bodies,
+    // or changing what the forces depend on
+    void Invalidate() { stepper.reset(); }
+
+    // Sets the time the next step starts from, e.g. after loading a saved state
+    void SetTime(double t) {
+        time = t;
+        stepper.reset();
+    }
+
+    // count fixed steps of Dt(), each followed by collisions and reordering
+    void Step(uint64_t count) {
+        if (!stepper) {
+            stepper = MakeStepper();
+        }
+        for (uint64_t s = 0; s < count; ++s) {
+            stepper->Step(*this);
+            step++;
+        }
+    }
+
+    // Fills ax/ay/az, and pot if potential is set, for the current positions
+    void ComputeForces(bool potential) {
+        bool wanted = engine.computePotential;
+        engine.computePotential = potential;
+        engine.ComputeForces(bodies);
+        engine.computePotential = wanted;
+        Invalidate();
+    }
+
+    // Conservation diagnostics for the current state; the first call is the reference.
+    // Served from the last force pass when it can be (engine.computePotential set and
+    // a scheme that ends on a force pass), otherwise from a pass on a copy.
+    const DiagnosticsSample& Sample() {
+        if (engine.computePotential && stepper && stepper->ForcesCurrent()) {
+            return diagnostics.Sample(bodies, step, time);
+        }
+        scratch = bodies;
+        bool wanted = engine.computePotential;
+        engine.computePotential = true;
+        engine.ComputeForces(scratch);
+        engine.computePotential = wanted;
+        return diagnostics.Sample(scratch, step, time);
+    }
+
+    // Forgets the diagnostics reference, so the next Sample starts a new one
+    void ResetDiagnostics() { diagnostics.Start(nullptr); }
+
+private:
+    struct Stepper {
+        virtual ~Stepper() {}
+        virtual void Step(Simulation& sim) = 0;
+        virtual bool ForcesCurrent() const = 0;
+    };
+
+    template <class Scheme>
+    struct SteppingWith : Stepper {
+        Scheme scheme;
+
+        template <class... Args>
+        explicit SteppingWith(double start, Args&&... args) : scheme(args...) {
+            scheme.SetTime(start);
+        }
+
+        void Step(Simulation& sim) override {
+            auto force = [&](BodyStore& b) { sim.engine.ComputeForces(b); };
+            scheme.Step(sim.bodies, force);
+            sim.engine.FinishStep(sim.bodies, scheme);
+            sim.time = scheme.Time();
+        }
+
+        bool ForcesCurrent() const override { return scheme.ForcesCurrent(); }
+    };
+
+    IntegratorKind integrator = IntegratorKind::Leapfrog;
+    double dt = 0.001;
+    std::unique_ptr<Stepper> stepper;
+    Diagnostics diagnostics;
+    BodyStore scratch;
+
+    std::unique_ptr<Stepper> MakeStepper() {
+        switch (integrator) {
+            case IntegratorKind::Euler:
+                return std::unique_ptr<Stepper>(new SteppingWith<Integrator<3, SemiImplicitEuler>>(time, dt));
+            case IntegratorKind::Yoshida4:
+                return std::unique_ptr<Stepper>(new SteppingWith<Integrator<3, Yoshida4>>(time, dt));
+            case IntegratorKind::Block:
+                return std::unique_ptr<Stepper>(
+                    new SteppingWith<BlockIntegrator<3>>(time, dt, engine.G, engine.eps2, &engine.pool));
+            default:
+                return std::unique_ptr<Stepper>(new SteppingWith<Integrator<3, Leapfrog>>(time, dt));
+        }
+    }
+};
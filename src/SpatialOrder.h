@@ -0,0 +1,330 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+
+// Keeps the body store sorted along a space-filling curve, so bodies that are close
+// in space are close in memory. The tree walk, the collision grid and the direct
+// kernel's tiles then touch a few cache lines per cell instead of one per body.
+//
+// Each body gets a key from its position quantised to Bits bits per axis inside
+// the bounding cube: the Morton key interleaves the bits, the Hilbert key does the
+// same after Skilling's transform, which keeps every step along the curve between
+// adjacent cells. The keys are sorted with a parallel LSD radix sort, the store is
+// permuted to match, and names and ids move with their bodies.
+//
+// How far the order has decayed is measured as the fraction of memory neighbours
+// whose keys are out of order at the level where a cell holds about eight bodies
+// (ties count as ordered, so dense clumps don't look disordered). A sorted store
+// scores 0 and a shuffled one about 0.5. Maintain re-sorts once the score passes
+// threshold; it depends only on the current state, so runs resumed from a
+// checkpoint reorder at the same steps.
+
+enum class CurveKind {
+    Morton,
+    Hilbert
+};
+
+inline const char* CurveKindName(CurveKind curve) {
+    return curve == CurveKind::Morton ? "morton" : "hilbert";
+}
+
+template <int D>
+class SpatialOrder {
+public:
+    static constexpr int Bits = D == 3 ? 21 : 32; // Per axis, so a key fills 63 or 64 bits
+
+    CurveKind curve = CurveKind::Hilbert;
+    double threshold = 0.1; // Maintain re-sorts once this fraction of neighbours is out of order, 0 disables it
+    size_t minBodies = 1024; // Below this everything fits in cache anyway
+
+    double lastDisorder = 0.0; // Score from the most recent Measure
+    size_t reorders = 0;
+
+    SpatialOrder() = default;
+    SpatialOrder(const SpatialOrder&) = delete;
+    SpatialOrder& operator=(const SpatialOrder&) = delete;
+
+    ~SpatialOrder() {
+        FreeAligned(scratch);
+    }
+
+    // Fraction of memory neighbours out of curve order, see the comment at the top
+    double Measure(ThreadPool& pool, const BodyStore& bodies) {
+        PROFILE_SCOPE("order check");
+        size_t n = bodies.size();
+        if (n < 2) {
+            lastDisorder = 0.0;
+            return lastDisorder;
+        }
+        // Only the cells at this level are compared, and a curve key truncated to its
+        // top levels is the key of the coarse cell, so coarse keys are all it needs
+        int levels = (int)std::ceil(std::log2(std::max(1.0, (double)n / 8.0)) / D);
+        ComputeKeys(pool, bodies, std::max(1, std::min(Bits, levels)));
+
+        size_t chunks = ChunkCount(n);
+        chunkCounts.assign(chunks, 0);
+        pool.ParallelFor(chunks, [&](size_t chunk, int) {
+            size_t begin = n * chunk / chunks;
+            size_t end = std::min(n * (chunk + 1) / chunks, n - 1);
+            size_t descents = 0;
+            for (size_t i = begin; i < end; ++i) {
+                descents += keys[i] > keys[i + 1];
+            }
+            chunkCounts[chunk] = descents;
+        });
+        size_t descents = 0;
+        for (size_t c : chunkCounts) {
+            descents += c;
+        }
+        lastDisorder = (double)descents / (double)(n - 1);
+        return lastDisorder;
+    }
+
+    // Sorts the store along the curve now
+    void Sort(ThreadPool& pool, BodyStore& bodies) {
+        PROFILE_SCOPE("reorder");
+        size_t n = bodies.size();
+        if (n < 2) {
+            return;
+        }
+        ComputeKeys(pool, bodies, Bits);
+        RadixSort(pool, n);
+        Permute(pool, bodies);
+        reorders++;
+    }
+
+    // Measures the order and re-sorts if it has decayed past threshold. Returns true
+    // if the store was permuted.
+    bool Maintain(ThreadPool& pool, BodyStore& bodies) {
+        if (threshold <= 0.0 || bodies.size() < minBodies) {
+            return false;
+        }
+        if (Measure(pool, bodies) <= threshold) {
+            return false;
+        }
+        Sort(pool, bodies);
+        return true;
+    }
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> keysTmp;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> orderTmp;
+    std::vector<size_t> chunkCounts;
+    std::vector<size_t> histograms; // 256 per chunk
+    std::vector<double> chunkBounds; // lo and hi per axis per chunk
+    double* scratch = nullptr;
+    size_t scratchSize = 0;
+
+    static size_t ChunkCount(size_t n) {
+        const size_t chunkSize = 16384;
+        return (n + chunkSize - 1) / chunkSize;
+    }
+
+    // Spreads the low Bits bits of v so that D - 1 zero bits follow each one
+    static uint64_t Spread(uint64_t v) {
+        if (D == 3) {
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffULL;
+            v = (v | v << 16) & 0x1f0000ff0000ffULL;
+            v = (v | v << 8) & 0x100f00f00f00f00fULL;
+            v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+            v = (v | v << 2) & 0x1249249249249249ULL;
+        } else {
+            v &= 0xffffffffULL;
+            v = (v | v << 16) & 0x0000ffff0000ffffULL;
+            v = (v | v << 8) & 0x00ff00ff00ff00ffULL;
+            v = (v | v << 4) & 0x0f0f0f0f0f0f0f0fULL;
+            v = (v | v << 2) & 0x3333333333333333ULL;
+            v = (v | v << 1) & 0x5555555555555555ULL;
+        }
+        return v;
+    }
+
+    // Axis 0 takes the most significant bit of each level
+    static uint64_t Interleave(const uint64_t (&q)[D]) {
+        uint64_t key = 0;
+        for (int k = 0; k < D; ++k) {
+            key |= Spread(q[k]) << (D - 1 - k);
+        }
+        return key;
+    }
+
+    // Skilling's "Programming the Hilbert curve" (2004): turns cell coordinates into
+    // the transposed Hilbert index in place, which Interleave then reads out. The
+    // coordinates have bits bits each.
+    static void AxesToTranspose(uint64_t (&q)[D], int bits) {
+        const uint64_t top = 1ULL << (bits - 1);
+        for (uint64_t bit = top; bit > 1; bit >>= 1) {
+            uint64_t below = bit - 1;
+            for (int k = 0; k < D; ++k) {
+                if (q[k] & bit) {
+                    q[0] ^= below;
+                } else {
+                    uint64_t t = (q[0] ^ q[k]) & below;
+                    q[0] ^= t;
+                    q[k] ^= t;
+                }
+            }
+        }
+        for (int k = 1; k < D; ++k) {
+            q[k] ^= q[k - 1];
+        }
+        uint64_t t = 0;
+        for (uint64_t bit = top; bit > 1; bit >>= 1) {
+            if (q[D - 1] & bit) {
+                t ^= bit - 1;
+            }
+        }
+        for (int k = 0; k < D; ++k) {
+            q[k] ^= t;
+        }
+    }
+
+    // Fills keys (and order = 0..n-1) for the current positions, with bits bits per axis
+    void ComputeKeys(ThreadPool& pool, const BodyStore& bodies, int bits) {
+        size_t n = bodies.size();
+        size_t chunks = ChunkCount(n);
+        keys.resize(n);
+        order.resize(n);
+
+        // Bounding cube of the finite positions, reduced per chunk and then in chunk order
+        chunkBounds.resize(chunks * 2 * D);
+        pool.ParallelFor(chunks, [&](size_t chunk, int) {
+            size_t begin = n * chunk / chunks;
+            size_t end = n * (chunk + 1) / chunks;
+            double* b = &chunkBounds[chunk * 2 * D];
+            for (int k = 0; k < D; ++k) {
+                const double* p = bodies.pos(k);
+                double lo = HUGE_VAL;
+                double hi = -HUGE_VAL;
+                for (size_t i = begin; i < end; ++i) {
+                    if (std::isfinite(p[i])) {
+                        lo = std::min(lo, p[i]);
+                        hi = std::max(hi, p[i]);
+                    }
+                }
+                b[2 * k] = lo;
+                b[2 * k + 1] = hi;
+            }
+        });
+        double lo[D];
+        double extent = 0.0;
+        for (int k = 0; k < D; ++k) {
+            lo[k] = chunkBounds[2 * k];
+            double hi = chunkBounds[2 * k + 1];
+            for (size_t c = 1; c < chunks; ++c) {
+                lo[k] = std::min(lo[k], chunkBounds[c * 2 * D + 2 * k]);
+                hi = std::max(hi, chunkBounds[c * 2 * D + 2 * k + 1]);
+            }
+            extent = std::max(extent, hi - lo[k]);
+        }
+        const double cells = (double)(1ULL << bits);
+        double scale = extent > 0.0 ? cells / extent : 0.0;
+        const uint64_t maxCell = (1ULL << bits) - 1;
+        bool hilbert = curve == CurveKind::Hilbert;
+
+        pool.ParallelFor(chunks, [&](size_t chunk, int) {
+            size_t begin = n * chunk / chunks;
+            size_t end = n * (chunk + 1) / chunks;
+            for (size_t i = begin; i < end; ++i) {
+                uint64_t q[D];
+                for (int k = 0; k < D; ++k) {
+                    double cell = (bodies.pos(k)[i] - lo[k]) * scale;
+                    // Clamped before the cast; NaN (a non-finite position) goes to cell 0
+                    q[k] = cell > 0.0 ? (cell < (double)maxCell ? (uint64_t)cell : maxCell) : 0;
+                }
+                if (hilbert) {
+                    AxesToTranspose(q, bits);
+                }
+                keys[i] = Interleave(q);
+                order[i] = (uint32_t)i;
+            }
+        });
+    }
+
+    // Stable LSD radix sort of (keys, order) by key, 8 bits per pass. Every chunk
+    // counts its digits, an exclusive scan over (digit, chunk) gives each chunk its
+    // output offsets, and the chunks scatter independently. Passes where every key
+    // has the same digit are skipped, which drops the top byte of 63 bit keys.
+    void RadixSort(ThreadPool& pool, size_t n) {
+        size_t chunks = ChunkCount(n);
+        keysTmp.resize(n);
+        orderTmp.resize(n);
+        histograms.resize(chunks * 256);
+
+        for (int shift = 0; shift < 64; shift += 8) {
+            std::fill(histograms.begin(), histograms.end(), 0);
+            pool.ParallelFor(chunks, [&](size_t chunk, int) {
+                size_t begin = n * chunk / chunks;
+                size_t end = n * (chunk + 1) / chunks;
+                size_t* h = &histograms[chunk * 256];
+                for (size_t i = begin; i < end; ++i) {
+                    h[(keys[i] >> shift) & 0xff]++;
+                }
+            });
+
+            bool trivial = false;
+            size_t offset = 0;
+            for (size_t digit = 0; digit < 256; ++digit) {
+                size_t total = 0;
+                for (size_t c = 0; c < chunks; ++c) {
+                    size_t count = histograms[c * 256 + digit];
+                    histograms[c * 256 + digit] = offset + total;
+                    total += count;
+                }
+                trivial |= total == n;
+                offset += total;
+            }
+            if (trivial) {
+                continue;
+            }
+
+            pool.ParallelFor(chunks, [&](size_t chunk, int) {
+                size_t begin = n * chunk / chunks;
+                size_t end = n * (chunk + 1) / chunks;
+                size_t* next = &histograms[chunk * 256];
+                for (size_t i = begin; i < end; ++i) {
+                    size_t slot = next[(keys[i] >> shift) & 0xff]++;
+                    keysTmp[slot] = keys[i];
+                    orderTmp[slot] = order[i];
+                }
+            });
+            keys.swap(keysTmp);
+            order.swap(orderTmp);
+        }
+    }
+
+    // Gathers every field through scratch in order, then moves names and ids
+    void Permute(ThreadPool& pool, BodyStore& bodies) {
+        size_t n = bodies.size();
+        if (scratchSize < n) {
+            FreeAligned(scratch);
+            scratch = nullptr; // Stays empty if the allocation throws
+            scratchSize = 0;
+            scratch = static_cast<double*>(AllocAligned(sizeof(double) * n));
+            scratchSize = n;
+        }
+        size_t chunks = ChunkCount(n);
+        for (size_t f = 0; f < BodyStore::FieldCount; ++f) {
+            double* field = bodies.field(f);
+            pool.ParallelFor(chunks, [&](size_t chunk, int) {
+                size_t begin = n * chunk / chunks;
+                size_t end = n * (chunk + 1) / chunks;
+                for (size_t i = begin; i < end; ++i) {
+                    scratch[i] = field[order[i]];
+                }
+            });
+            std::memcpy(field, scratch, sizeof(double) * n);
+        }
+        bodies.permuteNamesAndIds(order.data());
+    }
+};
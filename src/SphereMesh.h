@@ -0,0 +1,45 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+// Unit UV sphere as an indexed triangle list. Positions double as normals. The
+// layout matches the strips the 3D view used to draw with glBegin: stacks + 1 rings
+// from the +z pole to the -z pole, each with slices + 1 vertices so the seam has its
+// own copy.
+struct SphereMesh {
+    std::vector<float> vertices;       // x, y, z per vertex
+    std::vector<unsigned int> indices; // Three per triangle
+};
+
+inline SphereMesh BuildSphereMesh(int stacks, int slices) {
+    const double pi = 3.14159265358979323846;
+    SphereMesh mesh;
+    mesh.vertices.reserve(3 * (size_t)(stacks + 1) * (slices + 1));
+    mesh.indices.reserve(6 * (size_t)stacks * slices);
+
+    for (int i = 0; i <= stacks; ++i) {
+        double stackAngle = pi / 2 - i * pi / stacks;
+        double xy = std::cos(stackAngle);
+        double z = std::sin(stackAngle);
+        for (int j = 0; j <= slices; ++j) {
+            double sliceAngle = j * 2 * pi / slices;
+            mesh.vertices.push_back((float)(xy * std::cos(sliceAngle)));
+            mesh.vertices.push_back((float)(xy * std::sin(sliceAngle)));
+            mesh.vertices.push_back((float)z);
+        }
+    }
+
+    for (int i = 0; i < stacks; ++i) {
+        unsigned int ring = (unsigned int)(i * (slices + 1));
+        unsigned int next = ring + (unsigned int)(slices + 1);
+        for (int j = 0; j < slices; ++j) {
+            mesh.indices.push_back(ring + j);
+            mesh.indices.push_back(next + j);
+            mesh.indices.push_back(ring + j + 1);
+            mesh.indices.push_back(ring + j + 1);
+            mesh.indices.push_back(next + j);
+            mesh.indices.push_back(next + j + 1);
+        }
+    }
+    return mesh;
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads with per-worker task queues. ParallelFor deals
+// the task indices out in contiguous blocks; each worker pops from the back of its
+// own queue and, once that is empty, steals from the front of the others. The
+// calling thread works as worker 0, so a pool of size 1 runs everything inline.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads) {
+        if (threads < 1) {
+            threads = 1;
+        }
+        queues = std::vector<WorkQueue>(threads);
+        for (int id = 1; id < threads; ++id) {
+            workers.emplace_back(&ThreadPool::WorkerLoop, this, id);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)queues.size(); }
+
+    static int HardwareThreads() {
+        unsigned int count = std::thread::hardware_concurrency();
+        return count ? (int)count : 1;
+    }
+
+    // Runs task(index, worker) for every index in [0, count) and returns when all of
+    // them have finished. worker is in [0, size()) and is unique among the calls
+    // running at the same moment, so it can index per-thread scratch space.
+    void ParallelFor(size_t count, const std::function<void(size_t, int)>& task) {
+        if (count == 0) {
+            return;
+        }
+        if (queues.size() == 1 || count == 1) {
+            for (size_t i = 0; i < count; ++i) {
+                task(i, 0);
+            }
+            return;
+        }
+
+        size_t threads = queues.size();
+        for (size_t id = 0; id < threads; ++id) {
+            size_t begin = count * id / threads;
+            size_t end = count * (id + 1) / threads;
+            std::lock_guard<std::mutex> guard(queues[id].lock);
+            for (size_t i = begin; i < end; ++i) {
+                queues[id].tasks.push_back(i);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            job = &task;
+            active = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        RunTasks(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<WorkQueue> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t, int)>* job = nullptr;
+    size_t generation = 0;
+    int active = 0;
+    bool stopping = false;
+
+    bool PopOwn(int id, size_t& index) {
+        WorkQueue& queue = queues[id];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        index = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool Steal(int id, size_t& index) {
+        int threads = (int)queues.size();
+        for (int offset = 1; offset < threads; ++offset) {
+            WorkQueue& victim = queues[(id + offset) % threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                index = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void RunTasks(int id) {
+        size_t index;
+        while (PopOwn(id, index) || Steal(id, index)) {
+            (*job)(index, id);
+        }
+    }
+
+    void WorkerLoop(int id) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+
+            RunTasks(id);
+
+            std::lock_guard<std::mutex> guard(mutex);
+            if (--active == 0) {
+                done.notify_all();
+            }
+        }
+    }
+};
@@ -0,0 +1,427 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "BodyStore.h"
+#include "MappedFile.h"
+
+// Binary trajectory files: a fixed header, then one record per frame, then an index of
+// frame offsets written when the file is closed.
+//
+//   TrajectoryHeader    64 bytes
+//   frame 0             TrajectoryFrameHeader, then the payload
+//   frame 1 ...
+//   index               TrajectoryIndexEntry per frame (only after Close)
+//
+// A frame's payload is D position arrays, D velocity arrays and the mass array, each
+// holding count values as float or double. Payloads are padded to 8 bytes, so every
+// array in a memory mapped file is aligned for its type. All values are in the
+// writer's native byte order; byteOrder lets a reader detect a mismatch.
+//
+// If the writer never closed the file (a crash), indexOffset is still 0 and the
+// reader finds the frames by walking their headers instead.
+
+struct TrajectoryHeader {
+    char magic[8];         // "GSTRAJ\0\0"
+    uint32_t version;
+    uint32_t dimensions;   // 2 or 3
+    uint32_t valueBytes;   // 4 (float) or 8 (double)
+    uint32_t byteOrder;    // 0x01020304 as written
+    uint64_t indexOffset;  // 0 until the file is closed
+    uint64_t frameCount;   // 0 until the file is closed
+    uint8_t reserved[24];
+};
+
+struct TrajectoryFrameHeader {
+    double time;
+    uint64_t step;
+    uint64_t count;        // Bodies in this frame, merges change it between frames
+    uint64_t payloadBytes; // Including padding, the next frame starts right after
+};
+
+struct TrajectoryIndexEntry {
+    uint64_t offset; // Of the frame header from the start of the file
+    double time;
+};
+
+static_assert(sizeof(TrajectoryHeader) == 64, "trajectory header layout");
+static_assert(sizeof(TrajectoryFrameHeader) == 32, "trajectory frame header layout");
+
+const uint32_t TrajectoryVersion = 1;
+const uint32_t TrajectoryByteOrder = 0x01020304;
+
+// Appends frames from the step loop without ever waiting on the disk. Append()
+// serialises the frame into the pending buffer and returns; a background thread
+// swaps that buffer with its own and writes it out. Each buffer is a list of blocks
+// that are recycled once written, so a growing backlog never copies earlier frames.
+// If the disk falls more than maxPendingBytes behind, frames are dropped (and
+// counted) instead of stalling.
+template <int D>
+class TrajectoryWriter {
+public:
+    size_t maxPendingBytes = 256u << 20;
+
+    TrajectoryWriter() {}
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    ~TrajectoryWriter() {
+        Close();
+    }
+
+    // float32 halves the file size; positions keep about 7 significant digits
+    bool Open(const std::string& path, bool float32) {
+        Close();
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Could not open trajectory file " << path << std::endl;
+            return false;
+        }
+        valueBytes = float32 ? 4 : 8;
+        TrajectoryHeader header = MakeHeader();
+        if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+            std::cerr << "Could not write trajectory header to " << path << std::endl;
+            std::fclose(file);
+            file = nullptr;
+            return false;
+        }
+        nextOffset = sizeof(header);
+        index.clear();
+        dropped = 0;
+        failed = false;
+        stopping = false;
+        worker = std::thread([this] { WriteLoop(); });
+        return true;
+    }
+
+    bool IsOpen() const { return file != nullptr; }
+
+    // Copies the current state of every body. Returns false if the frame was dropped.
+    bool Append(const BodyStore& bodies, double time, uint64_t step) {
+        if (!file) {
+            return false;
+        }
+        size_t n = bodies.size();
+        size_t payload = ((2 * D + 1) * n * valueBytes + 7) / 8 * 8;
+        size_t bytes = sizeof(TrajectoryFrameHeader) + payload;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pendingBytes + bytes > maxPendingBytes) {
+            dropped++;
+            return false;
+        }
+        if (pending.empty() || pending.back().capacity() - pending.back().size() < bytes) {
+            pending.emplace_back();
+            if (!spare.empty() && spare.back().capacity() >= bytes) {
+                pending.back().swap(spare.back());
+                spare.pop_back();
+            } else {
+                pending.back().reserve(bytes > BlockBytes ? bytes : BlockBytes);
+            }
+        }
+        std::vector<unsigned char>& block = pending.back();
+        size_t start = block.size();
+        block.resize(start + bytes); // Within capacity, never reallocates
+        pendingBytes += bytes;
+        unsigned char* out = block.data() + start;
+
+        TrajectoryFrameHeader header = {time, step, (uint64_t)n, (uint64_t)payload};
+        std::memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        for (int k = 0; k < D; ++k) {
+            out = WriteArray(out, bodies.pos(k), n);
+        }
+        for (int k = 0; k < D; ++k) {
+            out = WriteArray(out, bodies.vel(k), n);
+        }
+        out = WriteArray(out, bodies.mass, n);
+        std::memset(out, 0, block.data() + start + bytes - out);
+
+        index.push_back({nextOffset, time});
+        nextOffset += bytes;
+        wake.notify_one();
+        return true;
+    }
+
+    // Writes out everything still pending, then the index. Safe to call twice.
+    void Close() {
+        if (!file) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+
+        bool ok = !failed;
+        if (ok && !index.empty()) {
+            ok = std::fwrite(index.data(), sizeof(TrajectoryIndexEntry), index.size(), file) == index.size();
+        }
+        if (ok) {
+            TrajectoryHeader header = MakeHeader();
+            header.indexOffset = nextOffset;
+            header.frameCount = index.size();
+            ok = std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+        }
+        if (std::fclose(file) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Writing the trajectory file failed, it may be incomplete" << std::endl;
+        }
+        file = nullptr;
+    }
+
+    size_t FramesWritten() const { return index.size(); }
+    size_t FramesDropped() const { return dropped; }
+
+private:
+    static const size_t BlockBytes = 4u << 20;
+
+    std::FILE* file = nullptr;
+    uint32_t valueBytes = 8;
+    uint64_t nextOffset = 0;
+    std::vector<TrajectoryIndexEntry> index;
+    size_t dropped = 0;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    typedef std::vector<std::vector<unsigned char>> BlockList;
+    BlockList pending; // Filled by Append, guarded by mutex
+    BlockList writing; // Owned by the worker
+    BlockList spare;   // Written blocks for reuse, guarded by mutex
+    size_t pendingBytes = 0;
+    bool stopping = false;
+    bool failed = false;
+
+    TrajectoryHeader MakeHeader() const {
+        TrajectoryHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "GSTRAJ\0\0", 8);
+        header.version = TrajectoryVersion;
+        header.dimensions = D;
+        header.valueBytes = valueBytes;
+        header.byteOrder = TrajectoryByteOrder;
+        return header;
+    }
+
+    unsigned char* WriteArray(unsigned char* out, const double* values, size_t n) const {
+        if (valueBytes == 8) {
+            std::memcpy(out, values, n * sizeof(double));
+            return out + n * sizeof(double);
+        }
+        float* dest = reinterpret_cast<float*>(out);
+        for (size_t i = 0; i < n; ++i) {
+            dest[i] = (float)values[i];
+        }
+        return out + n * sizeof(float);
+    }
+
+    void WriteLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return; // Stopping with nothing left
+            }
+            writing.swap(pending);
+            pendingBytes = 0;
+            lock.unlock();
+            for (std::vector<unsigned char>& block : writing) {
+                if (!failed && std::fwrite(block.data(), 1, block.size(), file) != block.size()) {
+                    failed = true;
+                }
+                block.clear();
+            }
+            lock.lock();
+            for (std::vector<unsigned char>& block : writing) {
+                spare.emplace_back();
+                spare.back().swap(block);
+            }
+            writing.clear();
+        }
+    }
+};
+
+// One frame of a mapped trajectory. The arrays point straight into the mapping, so
+// they stay valid until the reader is closed. Use the float accessors for files
+// written with float32 and the double ones otherwise.
+struct TrajectoryFrame {
+    double time = 0.0;
+    uint64_t step = 0;
+    size_t count = 0;
+    int dimensions = 0;
+    int valueBytes = 8;
+    const unsigned char* data = nullptr;
+
+    template <class T>
+    const T* Position(int axis) const { return Array<T>(axis); }
+    template <class T>
+    const T* Velocity(int axis) const { return Array<T>(dimensions + axis); }
+    template <class T>
+    const T* Mass() const { return Array<T>(2 * dimensions); }
+
+    // Either precision, one value at a time
+    double PositionAt(int axis, size_t i) const { return At(axis, i); }
+    double VelocityAt(int axis, size_t i) const { return At(dimensions + axis, i); }
+    double MassAt(size_t i) const { return At(2 * dimensions, i); }
+
+private:
+    template <class T>
+    const T* Array(int field) const {
+        return reinterpret_cast<const T*>(data + (size_t)field * count * sizeof(T));
+    }
+
+    double At(int field, size_t i) const {
+        return (valueBytes == 4) ? (double)Array<float>(field)[i] : Array<double>(field)[i];
+    }
+};
+
+// Memory maps a trajectory file for random access to any frame without copying
+class TrajectoryReader {
+public:
+    TrajectoryReader() {}
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+    ~TrajectoryReader() {
+        Close();
+    }
+
+    bool Open(const std::string& path) {
+        Close();
+        if (!file.Open(path)) {
+            std::cerr << "Could not map trajectory file " << path << std::endl;
+            return false;
+        }
+        const unsigned char* base = file.Data();
+        size_t size = file.Size();
+        if (size < sizeof(TrajectoryHeader)) {
+            return Fail(path, "too short");
+        }
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, "GSTRAJ\0\0", 8) != 0) {
+            return Fail(path, "not a trajectory file");
+        }
+        if (header.byteOrder != TrajectoryByteOrder) {
+            return Fail(path, "written with a different byte order");
+        }
+        if (header.version != TrajectoryVersion || (header.valueBytes != 4 && header.valueBytes != 8) ||
+            (header.dimensions != 2 && header.dimensions != 3)) {
+            return Fail(path, "unsupported version");
+        }
+
+        // Every offset and size below comes from the file, so each is checked against
+        // the mapping before use, subtracting rather than adding so nothing can overflow
+        offsets.clear();
+        if (header.indexOffset != 0) {
+            if (header.indexOffset < sizeof(TrajectoryHeader) || header.indexOffset > size ||
+                header.frameCount > (size - header.indexOffset) / sizeof(TrajectoryIndexEntry)) {
+                return Fail(path, "has a damaged index");
+            }
+            const unsigned char* entry = base + header.indexOffset;
+            offsets.reserve((size_t)header.frameCount);
+            for (uint64_t f = 0; f < header.frameCount; ++f) {
+                TrajectoryIndexEntry e;
+                std::memcpy(&e, entry + f * sizeof(e), sizeof(e));
+                // Frames all lie between the file header and the index
+                if (e.offset < sizeof(TrajectoryHeader) || e.offset % 8 != 0 || e.offset > header.indexOffset ||
+                    header.indexOffset - e.offset < sizeof(TrajectoryFrameHeader)) {
+                    return Fail(path, "has a damaged index");
+                }
+                TrajectoryFrameHeader frame;
+                std::memcpy(&frame, base + e.offset, sizeof(frame));
+                if (frame.payloadBytes > header.indexOffset - e.offset - sizeof(frame) || !PayloadHolds(frame)) {
+                    return Fail(path, "has a damaged frame");
+                }
+                offsets.push_back(e.offset);
+            }
+        } else {
+            // Never closed: walk the frame headers, ignoring a torn last frame
+            uint64_t offset = sizeof(TrajectoryHeader);
+            while (size - offset >= sizeof(TrajectoryFrameHeader)) {
+                TrajectoryFrameHeader frame;
+                std::memcpy(&frame, base + offset, sizeof(frame));
+                if (frame.payloadBytes > size - offset - sizeof(frame)) {
+                    break;
+                }
+                if (!PayloadHolds(frame)) {
+                    return Fail(path, "has a damaged frame");
+                }
+                offsets.push_back(offset);
+                offset += sizeof(frame) + frame.payloadBytes;
+            }
+        }
+        return true;
+    }
+
+    void Close() {
+        file.Close();
+        offsets.clear();
+    }
+
+    size_t FrameCount() const { return offsets.size(); }
+    int Dimensions() const { return (int)header.dimensions; }
+    bool Float32() const { return header.valueBytes == 4; }
+    bool Complete() const { return header.indexOffset != 0; } // False if the writer didn't close it
+
+    TrajectoryFrame Frame(size_t f) const {
+        TrajectoryFrameHeader frameHeader;
+        const unsigned char* base = file.Data();
+        std::memcpy(&frameHeader, base + offsets[f], sizeof(frameHeader));
+        TrajectoryFrame frame;
+        frame.time = frameHeader.time;
+        frame.step = frameHeader.step;
+        frame.count = (size_t)frameHeader.count;
+        frame.dimensions = (int)header.dimensions;
+        frame.valueBytes = (int)header.valueBytes;
+        frame.data = base + offsets[f] + sizeof(frameHeader);
+        return frame;
+    }
+
+    // Last frame at or before time t, by binary search. FrameCount() if there is none:
+    // the file has no frames, or t comes before the first one.
+    size_t FrameAt(double t) const {
+        if (offsets.empty() || !(Frame(0).time <= t)) {
+            return offsets.size();
+        }
+        size_t lo = 0;
+        size_t hi = offsets.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (Frame(mid).time <= t) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+private:
+    TrajectoryHeader header = {};
+    std::vector<uint64_t> offsets;
+    MappedFile file;
+
+    // True if the payload is padded to 8 bytes and has room for count bodies' arrays
+    bool PayloadHolds(const TrajectoryFrameHeader& frame) const {
+        uint64_t bodyBytes = (2 * (uint64_t)header.dimensions + 1) * header.valueBytes;
+        return frame.payloadBytes % 8 == 0 && frame.count <= frame.payloadBytes / bodyBytes;
+    }
+
+    bool Fail(const std::string& path, const char* why) {
+        std::cerr << "Trajectory file " << path << " " << why << std::endl;
+        Close();
+        return false;
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "BodyStore.h"
+
+// Hands values from one writer thread to one reader thread without locks. There are
+// three slots: the writer fills its back slot and swaps it with the middle one, the
+// reader swaps its front slot with the middle one when something new is there. Both
+// sides only ever touch their own slot, so neither waits for the other, and the
+// reader always gets the newest complete value (older ones are overwritten).
+template <class T>
+class TripleBuffer {
+public:
+    // Writer side: fill this slot, then Publish()
+    T& WriteSlot() { return slots[back]; }
+
+    void Publish() {
+        uint8_t previous = middle.exchange((uint8_t)(back | Fresh), std::memory_order_acq_rel);
+        back = previous & IndexMask;
+    }
+
+    // Reader side: takes the newest published value if there is one since the last
+    // call. Returns false if nothing new was published.
+    bool Update() {
+        if (!(middle.load(std::memory_order_relaxed) & Fresh)) {
+            return false;
+        }
+        uint8_t previous = middle.exchange(front, std::memory_order_acq_rel);
+        front = previous & IndexMask;
+        return true;
+    }
+
+    const T& ReadSlot() const { return slots[front]; }
+
+private:
+    static const uint8_t IndexMask = 3;
+    static const uint8_t Fresh = 4; // Set in middle when the writer has published into it
+
+    T slots[3];
+    alignas(64) std::atomic<uint8_t> middle{1};
+    alignas(64) uint8_t back = 0; // Writer only
+    alignas(64) uint8_t front = 2; // Reader only
+};
+
+// What the renderer needs of one physics state: positions, masses and radii, the
+// simulation time and when it was published. Velocities, accelerations and names
+// stay with the physics thread.
+struct BodySnapshot {
+    BodyStore bodies;
+    double time = 0.0;  // Simulation time
+    double wall = 0.0;  // Seconds on the publishing clock
+    uint64_t step = 0;
+
+    void CopyFrom(const BodyStore& source, double simTime, double wallTime, uint64_t stepCount) {
+        size_t n = source.size();
+        bodies.resize(n);
+        std::memcpy(bodies.x, source.x, n * sizeof(double));
+        std::memcpy(bodies.y, source.y, n * sizeof(double));
+        std::memcpy(bodies.z, source.z, n * sizeof(double));
+        std::memcpy(bodies.mass, source.mass, n * sizeof(double));
+        std::memcpy(bodies.radius, source.radius, n * sizeof(double));
+        bodies.id.assign(source.id.begin(), source.id.end());
+        bodies.layout = source.layout;
+        time = simTime;
+        wall = wallTime;
+        step = stepCount;
+    }
+};
+
+// Writes into out the state drawn at wall time now: the renderer runs one publish
+// interval behind and blends from previous to latest over that interval. If a merge
+// or a reorder moved bodies to other indices in between (the store's layout counter
+// changed), indices no longer match, so latest is used as is.
+inline void InterpolateSnapshots(const BodySnapshot& previous, const BodySnapshot& latest, double now, BodyStore& out) {
+    size_t n = latest.bodies.size();
+    out.resize(n);
+    std::memcpy(out.mass, latest.bodies.mass, n * sizeof(double));
+    std::memcpy(out.radius, latest.bodies.radius, n * sizeof(double));
+    out.id.assign(latest.bodies.id.begin(), latest.bodies.id.end());
+
+    double span = latest.wall - previous.wall;
+    if (previous.bodies.layout != latest.bodies.layout || previous.bodies.size() != n || span <= 0.0) {
+        std::memcpy(out.x, latest.bodies.x, n * sizeof(double));
+        std::memcpy(out.y, latest.bodies.y, n * sizeof(double));
+        std::memcpy(out.z, latest.bodies.z, n * sizeof(double));
+        return;
+    }
+    double alpha = std::min(1.0, std::max(0.0, (now - latest.wall) / span));
+    for (int axis = 0; axis < 3; ++axis) {
+        const double* from = previous.bodies.pos(axis);
+        const double* to = latest.bodies.pos(axis);
+        double* blended = out.pos(axis);
+        for (size_t i = 0; i < n; ++i) {
+            blended[i] = from[i] + (to[i] - from[i]) * alpha;
+        }
+    }
+}
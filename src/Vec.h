@@ -0,0 +1,91 @@
+#pragma once
+#include <cstddef>
+#include "BodyStore.h"
+
+// Small fixed-size vectors for the dimension-generic kernels. D is a template
+// constant, so every loop below has a known trip count and compiles to straight-line
+// code; Vec<2> and Vec<3> cost the same as writing out the components by hand.
+template <int D>
+struct Vec {
+    double v[D];
+
+    double& operator[](int k) { return v[k]; }
+    double operator[](int k) const { return v[k]; }
+
+    static Vec Zero() {
+        Vec r;
+        for (int k = 0; k < D; ++k) {
+            r.v[k] = 0.0;
+        }
+        return r;
+    }
+
+    Vec& operator+=(const Vec& o) {
+        for (int k = 0; k < D; ++k) {
+            v[k] += o.v[k];
+        }
+        return *this;
+    }
+
+    Vec& operator-=(const Vec& o) {
+        for (int k = 0; k < D; ++k) {
+            v[k] -= o.v[k];
+        }
+        return *this;
+    }
+};
+
+template <int D>
+inline Vec<D> operator+(Vec<D> a, const Vec<D>& b) {
+    return a += b;
+}
+
+template <int D>
+inline Vec<D> operator-(Vec<D> a, const Vec<D>& b) {
+    return a -= b;
+}
+
+template <int D>
+inline Vec<D> operator*(Vec<D> a, double s) {
+    for (int k = 0; k < D; ++k) {
+        a.v[k] *= s;
+    }
+    return a;
+}
+
+// start + a.b, summed component by component from start
+template <int D>
+inline double Dot(const Vec<D>& a, const Vec<D>& b, double start = 0.0) {
+    for (int k = 0; k < D; ++k) {
+        start += a.v[k] * b.v[k];
+    }
+    return start;
+}
+
+// Gathers and scatters between one body and the store's per-axis arrays
+template <int D>
+inline Vec<D> Position(const BodyStore& bodies, size_t i) {
+    Vec<D> r;
+    for (int k = 0; k < D; ++k) {
+        r.v[k] = bodies.pos(k)[i];
+    }
+    return r;
+}
+
+template <int D>
+inline Vec<D> Velocity(const BodyStore& bodies, size_t i) {
+    Vec<D> r;
+    for (int k = 0; k < D; ++k) {
+        r.v[k] = bodies.vel(k)[i];
+    }
+    return r;
+}
+
+template <int D>
+inline Vec<D> Acceleration(const BodyStore& bodies, size_t i) {
+    Vec<D> r;
+    for (int k = 0; k < D; ++k) {
+        r.v[k] = bodies.acc(k)[i];
+    }
+    return r;
+}
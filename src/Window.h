@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdlib>
+#include <iostream>
+#include <GLFW/glfw3.h>
+
+// Window setup shared by both views: a width x height window with a current GL
+// context and a black clear colour. Each view sets up its own projection after this.
+// Exits with a message if GLFW or the window can't be created.
+inline GLFWwindow* OpenSimWindow(int width, int height) {
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW. Exiting..." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    GLFWwindow* window = glfwCreateWindow(width, height, "Gravity Sim", NULL, NULL);
+    if (!window) {
+        std::cerr << "Failed to create GLFW window. Exiting..." << std::endl;
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+    glfwMakeContextCurrent(window);
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    return window;
+}